@@ -8,7 +8,12 @@
 #include <string.h>
 #include <openssl/sha.h>
 #include <time.h>
+#include <unistd.h>
 #include "server.h"
+#include "tls.h"
+#include "../UDP/include/compress.h"
+#include "../UDP/include/delta.h"
+#include "../UDP/include/metrics.h"
 
 #define DATA_SIZE_TO_SEND 20000
 
@@ -18,67 +23,125 @@ void error(char *msg)
     exit(0);
 }
 
-int main(int argc, char *argv[])
+// lee exactamente len bytes, devuelve -1 si la conexión se corta antes
+int read_full(struct connection *conn, void *buf, size_t len)
 {
-    if (argc < 4)
+    size_t done = 0;
+    while (done < len)
     {
-        fprintf(stderr, "usage %s hostname port file\n", argv[0]);
-        exit(0);
+        int n = conn_read(conn, (char *)buf + done, len - done);
+        if (n <= 0)
+            return -1;
+        done += n;
     }
+    return 0;
+}
 
-    int sockfd, portno, n;
-    FILE *file; // file descritor
-    // info del archivo a enviar
-    struct file_info file_info;
-    // sockaddr_in replaces sockaddr,it is easier to use- with sockaddr you would have to write the ip adress bytes in an ordered manner <<
-    struct sockaddr_in serv_addr;
-    struct hostent *server;
-    char *buffer;
-    char response[256];
+/*
+ * Pide al servidor las firmas de su copia del archivo y codifica el delta
+ * contra ellas. Devuelve NULL si no tiene copia o si el delta no achica
+ * el envío; en ese caso se manda el archivo completo.
+ */
+char *fetch_delta(struct connection *conn, struct file_info *file_info, char *data)
+{
+    struct file_info request = *file_info;
+    request.mode = TCP_SIGNATURES;
+    request.payload_size = 0;
+    if (conn_write(conn, &request, sizeof(request)) != sizeof(request))
+        error("ERROR writing to socket");
 
-    // El último parámetro es el archivo a enviar
-    file = fopen(argv[3], "r");
-    if (file == NULL)
+    struct signature_header header;
+    if (read_full(conn, &header, sizeof(header)) == -1)
+        error("ERROR reading signatures");
+    if (header.nblocks == 0)
     {
-        printf("Error al abrir el archivo\n");
-        exit(1);
+        printf("El servidor no tiene %s, se envía completo\n", file_info->name);
+        return NULL;
     }
+    if (header.nblocks != delta_nblocks(header.old_size, DELTA_BLOCK_SIZE))
+        error("ERROR invalid signatures");
 
-    bzero(&file_info, sizeof(file_info));
-    // Posicionarse al final del archivo
-    fseek(file, 0, SEEK_END);
-
-    // Obtener el tamaño del archivo y el nombre y guardarlo en el struct
-    file_info.size = ftell(file);
-
-    memcpy(file_info.name, argv[3], strlen(argv[3]));
-    printf("Enviar archivo %s, tamaño %d bytes\n", file_info.name, file_info.size);
+    struct block_signature *sigs = malloc(header.nblocks * sizeof(struct block_signature));
+    if (sigs == NULL)
+        error("ERROR allocating signatures");
+    if (read_full(conn, sigs, header.nblocks * sizeof(struct block_signature)) == -1)
+        error("ERROR reading signatures");
 
-    // Volver al inicio del archivo
-    fseek(file, 0, SEEK_SET);
+    char *delta;
+    size_t delta_len = delta_encode(data, file_info->size, sigs, header.nblocks,
+                                    DELTA_BLOCK_SIZE, header.old_size, &delta);
+    free(sigs);
 
-    // reservar memoria para el archivo y struct y setear en 0
-    buffer = malloc(file_info.size + sizeof(file_info));
-    if (buffer == NULL)
+    if (delta_len >= (size_t)file_info->size)
     {
-        printf("Error al reservar memoria\n");
-        exit(1);
+        printf("El delta no es más chico que el archivo, se envía completo\n");
+        free(delta);
+        return NULL;
     }
-    
-    bzero(buffer, file_info.size + sizeof(file_info));
 
-    // carga el archivo a partir de la posicion del file_info
-    fread(buffer + sizeof(file_info), file_info.size, 1, file);
+    printf("Delta contra la copia del servidor: %zu bytes en vez de %d\n", delta_len, file_info->size);
+    file_info->mode = TCP_DELTA;
+    file_info->payload_size = delta_len;
+    return delta;
+}
 
-    calculate_sha256(buffer + sizeof(file_info), file_info.size, file_info.sha256_hash);
+/*
+ * Rearma el buffer a enviar: file_info seguido de cada chunk del payload
+ * comprimido por separado, con su chunk_header adelante.
+ * Devuelve el nuevo tamaño total.
+ */
+int compress_file(char **buffer, struct file_info *file_info, int nthreads)
+{
+    char *data = *buffer + sizeof(*file_info);
+    int nchunks = (file_info->payload_size + CHUNK_SIZE - 1) / CHUNK_SIZE;
 
-    // copiar el struct al principio del buffer
-    memcpy(buffer, &file_info, sizeof(file_info));
+    char *compressed = malloc((size_t)nchunks * CHUNK_SIZE);
+    unsigned int *lengths = malloc(nchunks * sizeof(unsigned int));
+    unsigned char *codecs = malloc(nchunks);
+    char *out = malloc(sizeof(*file_info) + (size_t)nchunks * (sizeof(struct chunk_header) + CHUNK_SIZE));
+    if ((compressed == NULL || lengths == NULL || codecs == NULL) && nchunks > 0)
+        error("ERROR compressing");
+    if (out == NULL)
+        error("ERROR compressing");
 
-    printHex(file_info.sha256_hash);
+    compress_blocks(file_info->codec, data, file_info->payload_size, CHUNK_SIZE,
+                    compressed, lengths, codecs, nthreads);
+
+    memcpy(out, *buffer, sizeof(*file_info));
+    size_t total = sizeof(*file_info);
+    for (int i = 0; i < nchunks; i++)
+    {
+        struct chunk_header header;
+        memset(&header, 0, sizeof(header));
+        header.length = lengths[i];
+        header.codec = codecs[i];
+        memcpy(out + total, &header, sizeof(header));
+        total += sizeof(header);
+        memcpy(out + total, compressed + (size_t)i * CHUNK_SIZE, lengths[i]);
+        total += lengths[i];
+    }
+
+    printf("Comprimido con %s: %d bytes -> %zu bytes\n",
+           codec_name(file_info->codec), file_info->payload_size, total - sizeof(*file_info));
 
-    // TOMA EL NUMERO DE PUERTO DE LOS ARGUMENTOS
-    portno = atoi(argv[2]);
+    free(compressed);
+    free(lengths);
+    free(codecs);
+    free(*buffer);
+    *buffer = out;
+    return total;
+}
+
+/*
+ * Se conecta a hostname:portno, con TLS si tls no es 0.
+ * Devuelve el contexto TLS, NULL sin TLS.
+ */
+SSL_CTX *connect_server(struct connection *conn, char *hostname, int portno, int tls, char *ca)
+{
+    int sockfd;
+    // sockaddr_in replaces sockaddr,it is easier to use- with sockaddr you would have to write the ip adress bytes in an ordered manner <<
+    struct sockaddr_in serv_addr;
+    struct hostent *server;
 
     // CREA EL FILE DESCRIPTOR DEL SOCKET PARA LA CONEXION
     sockfd = socket(AF_INET, SOCK_STREAM, 0);
@@ -90,7 +153,7 @@ int main(int argc, char *argv[])
 
     // TOMA LA DIRECCION DEL SERVER DE LOS ARGUMENTOS
     // gethostbyname is deprecated, use getaddrinfo()
-    server = gethostbyname(argv[1]);
+    server = gethostbyname(hostname);
     if (server == NULL)
     {
         fprintf(stderr, "ERROR, no such host\n");
@@ -111,15 +174,254 @@ int main(int argc, char *argv[])
     if (connect(sockfd, &serv_addr, sizeof(serv_addr)) < 0)
         error("ERROR connecting");
 
+    conn->fd = sockfd;
+    conn->ssl = NULL;
+    SSL_CTX *tls_ctx = NULL;
+    if (tls)
+    {
+        tls_ctx = tls_client_context(ca);
+        if (tls_ctx == NULL || tls_connect(conn, tls_ctx, hostname) == -1)
+        {
+            fprintf(stderr, "ERROR, handshake TLS fallido\n");
+            exit(1);
+        }
+        tls_report(conn);
+    }
+    return tls_ctx;
+}
+
+/*
+ * Pide al servidor su copia de name (TCP_DOWNLOAD) y la guarda en el
+ * directorio actual si el hash coincide. Devuelve -1 si no la tiene o
+ * llegó mal.
+ */
+int download_file(struct connection *conn, char *name)
+{
+    struct file_info file_info;
+    bzero(&file_info, sizeof(file_info));
+    char *short_name = strrchr(name, '/');
+    short_name = (short_name == NULL) ? name : short_name + 1;
+    strncpy(file_info.name, short_name, sizeof(file_info.name) - 1);
+    file_info.mode = TCP_DOWNLOAD;
+    if (conn_write(conn, &file_info, sizeof(file_info)) != sizeof(file_info))
+        error("ERROR writing to socket");
+
+    if (read_full(conn, &file_info, sizeof(file_info)) == -1)
+        error("ERROR reading from socket");
+    if (file_info.size < 0 || file_info.codec != CODEC_RAW || file_info.payload_size != file_info.size)
+    {
+        fprintf(stderr, "El servidor no tiene %s\n", short_name);
+        return -1;
+    }
+    printf("Recibiendo archivo %s, tamaño %d bytes\n", short_name, file_info.size);
+
+    char *data = malloc(file_info.size > 0 ? file_info.size : 1);
+    if (data == NULL)
+        error("ERROR allocating file");
+    if (read_full(conn, data, file_info.size) == -1)
+    {
+        fprintf(stderr, "ERROR, la conexión se cortó\n");
+        free(data);
+        return -1;
+    }
+    metrics_add(METRIC_BYTES_RECEIVED, file_info.size);
+
+    unsigned char hash[HASH_SIZE];
+    calculate_sha256((unsigned char *)data, file_info.size, hash);
+    printHex(hash);
+    if (memcmp(hash, file_info.sha256_hash, HASH_SIZE) != 0)
+    {
+        fprintf(stderr, "ERROR, el hash no coincide\n");
+        free(data);
+        return -1;
+    }
+
+    // con otro nombre y después se renombra, así un error no pisa la copia
+    // que ya teníamos
+    char tmp_name[sizeof(file_info.name) + 8];
+    snprintf(tmp_name, sizeof(tmp_name), "%s.part", short_name);
+    FILE *file = fopen(tmp_name, "w");
+    int result = 0;
+    if (file == NULL || (file_info.size > 0 && fwrite(data, file_info.size, 1, file) != 1) ||
+        fclose(file) != 0 || rename(tmp_name, short_name) == -1)
+    {
+        perror("ERROR saving file");
+        remove(tmp_name);
+        result = -1;
+    }
+    else
+        printf("Archivo guardado como %s\n", short_name);
+    free(data);
+    return result;
+}
+
+void usage(char *program)
+{
+    fprintf(stderr, "usage %s [-d] [-c codec] [-j threads] [-t [-a ca.pem]] [-r] hostname port file\n", program);
+    exit(0);
+}
+
+int main(int argc, char *argv[])
+{
+    int codec = CODEC_RAW;
+    int delta = 0;
+    int nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    int tls = 0;
+    char *ca = NULL;
+    int download = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "dc:j:ta:r")) != -1)
+    {
+        switch (opt)
+        {
+        case 'c':
+            codec = codec_from_name(optarg);
+            if (codec == -1)
+            {
+                fprintf(stderr, "Codec desconocido %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'j':
+            nthreads = atoi(optarg);
+            break;
+        case 'd':
+            delta = 1;
+            break;
+        case 't':
+            tls = 1;
+            break;
+        case 'a':
+            ca = optarg;
+            break;
+        case 'r':
+            download = 1;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if (argc - optind < 3)
+        usage(argv[0]);
+    argv += optind - 1;
+    metrics_init("tcpclient");
+
+    // descarga: el último parámetro es el archivo que pedimos
+    if (download)
+    {
+        struct timespec begin;
+        clock_gettime(CLOCK_MONOTONIC, &begin);
+        struct connection conn;
+        SSL_CTX *tls_ctx = connect_server(&conn, argv[1], atoi(argv[2]), tls, ca);
+        int result = download_file(&conn, argv[3]);
+        conn_close(&conn);
+        SSL_CTX_free(tls_ctx);
+
+        struct timespec end;
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        printf("Tiempo transcurrido por conexión: %f ms\n",
+               (end.tv_sec - begin.tv_sec) * 1000.0 + (end.tv_nsec - begin.tv_nsec) / 1e6);
+        return result == -1;
+    }
+
+    int n;
+    FILE *file; // file descritor
+    // info del archivo a enviar
+    struct file_info file_info;
+    char *buffer;
+    char *data;
+    char *payload;
+    char response[256];
+
+    // El último parámetro es el archivo a enviar
+    file = fopen(argv[3], "r");
+    if (file == NULL)
+    {
+        printf("Error al abrir el archivo\n");
+        exit(1);
+    }
+
+    bzero(&file_info, sizeof(file_info));
+    // Posicionarse al final del archivo
+    fseek(file, 0, SEEK_END);
+
+    // Obtener el tamaño del archivo y el nombre y guardarlo en el struct
+    file_info.size = ftell(file);
+
+    strncpy(file_info.name, argv[3], sizeof(file_info.name) - 1);
+    file_info.codec = codec;
+    printf("Enviar archivo %s, tamaño %d bytes\n", file_info.name, file_info.size);
+
+    // Volver al inicio del archivo
+    fseek(file, 0, SEEK_SET);
+
+    // reservar memoria para el archivo
+    data = malloc(file_info.size > 0 ? file_info.size : 1);
+    if (data == NULL)
+    {
+        printf("Error al reservar memoria\n");
+        exit(1);
+    }
+
+    fread(data, file_info.size, 1, file);
+
+    calculate_sha256((unsigned char *)data, file_info.size, file_info.sha256_hash);
+    file_info.mode = TCP_FULL;
+    file_info.payload_size = file_info.size;
+
+    printHex(file_info.sha256_hash);
+
+    struct connection conn;
+    SSL_CTX *tls_ctx = connect_server(&conn, argv[1], atoi(argv[2]), tls, ca);
+
     // Inicio cronometro ----------------------------
-    clock_t begin = clock();
+    struct timespec begin, end;
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+
+    payload = data;
+    if (delta)
+    {
+        payload = fetch_delta(&conn, &file_info, data);
+        if (payload == NULL)
+            payload = data;
+    }
+
+    // el archivo entero sin comprimir sale directo del page cache con
+    // sendfile, también cifrado si el kernel tiene kTLS
+    int send_file = file_info.mode == TCP_FULL && file_info.codec == CODEC_RAW;
+
+    // file_info seguido del payload, salvo que vaya con sendfile
+    size_t buffer_size = sizeof(file_info) + (send_file ? 0 : file_info.payload_size);
+    buffer = malloc(buffer_size);
+    if (buffer == NULL)
+    {
+        printf("Error al reservar memoria\n");
+        exit(1);
+    }
+    memcpy(buffer, &file_info, sizeof(file_info));
+    memcpy(buffer + sizeof(file_info), payload, buffer_size - sizeof(file_info));
 
-    long int bytes_sent = 0;
     // cantidad total de bytes a enviar
-    const int TOTAL_BYTES = file_info.size + sizeof(file_info);
+    int TOTAL_BYTES = file_info.payload_size + sizeof(file_info);
+    if (file_info.codec != CODEC_RAW)
+        TOTAL_BYTES = compress_file(&buffer, &file_info, nthreads);
+
+    long int bytes_sent = 0;
     printf("Total bytes a enviar: %d \n", TOTAL_BYTES);
     int bytes_to_send;
-  
+
+    if (send_file)
+    {
+        if (conn_write(&conn, &file_info, sizeof(file_info)) != sizeof(file_info))
+            error("ERROR writing to socket");
+        bytes_sent = sizeof(file_info);
+        if (conn_send_file(&conn, fileno(file), data, file_info.size) != file_info.size)
+            error("ERROR writing to socket");
+        bytes_sent += file_info.size;
+    }
+
     while (bytes_sent < TOTAL_BYTES)
     {
         // Si quedan más de DATA_SIZE_TO_SEND bytes por enviar, envía DATA_SIZE_TO_SEND bytes, sino los que falten
@@ -128,34 +430,44 @@ int main(int argc, char *argv[])
         else
             bytes_to_send = TOTAL_BYTES - bytes_sent;
 
-        n = write(sockfd, buffer + bytes_sent, bytes_to_send);
+        uint64_t write_start = metrics_now_us();
+        n = conn_write(&conn, buffer + bytes_sent, bytes_to_send);
+        metrics_record(HISTOGRAM_SEND_US, metrics_now_us() - write_start);
+        metrics_inc(METRIC_SOCKET_WRITES);
         
         //if there is an error writing, we should try again but lets not add -1 to bytes_sent
         if (n < 0)
             error("ERROR writing to socket1");
-        else bytes_sent += n;
+        else
+        {
+            bytes_sent += n;
+            metrics_add(METRIC_BYTES_SENT, n);
+        }
     }
 
     printf("Archivo %s, escritos en socket %ld bytes \n", argv[3], bytes_sent);
-    
-    if (n < 0)
-        error("ERROR writing to socket");
 
     // ESPERA RECIBIR UNA RESPUESTA
-    n = recv(sockfd, buffer, 255, 0);
+    n = conn_read(&conn, response, sizeof(response) - 1);
     if (n < 0)
         error("ERROR reading from socket");
+    response[n] = '\0';
 
-    close(sockfd);
+    conn_close(&conn);
+    SSL_CTX_free(tls_ctx);
 
     // Terminó la conexión, finaliza el cronometro
-    clock_t end = clock();
-    double time_spent = (double)(end - begin) / CLOCKS_PER_SEC;
+    // tiempo real, no de CPU: clock() no cuenta el tiempo bloqueado en el socket
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double time_spent = (end.tv_sec - begin.tv_sec) * 1000.0 + (end.tv_nsec - begin.tv_nsec) / 1e6;
 
-    printf("Tiempo transcurrido por conexión: %f \n", (time_spent * 1000) / 2);
+    printf("Tiempo transcurrido por conexión: %f ms\n", time_spent);
 
     printf("%s\n", response);
     // terminamos de usar el socket, liberamos memoria y cerramos el archivo
+    if (payload != data)
+        free(payload);
+    free(data);
     free(buffer);
     fclose(file);
     return 0;
@@ -6,8 +6,17 @@
 #include <netinet/in.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 #include <openssl/sha.h>
+#include <unistd.h>
 #include "server.h"
+#include "tls.h"
+#include "../UDP/include/compress.h"
+#include "../UDP/include/delta.h"
+#include "../UDP/include/file_cache.h"
+#include "../UDP/include/metrics.h"
+#include "../UDP/include/pool.h"
+#include "../UDP/include/status.h"
 
 #define BUFFER_SIZE 10000000
 
@@ -17,15 +26,211 @@ void error(char *msg)
     exit(1);
 }
 
+// lee exactamente len bytes, devuelve -1 si la conexión se corta antes
+int read_full(struct connection *conn, void *buf, size_t len)
+{
+    size_t done = 0;
+    while (done < len)
+    {
+        int n = conn_read(conn, (char *)buf + done, len - done);
+        metrics_inc(METRIC_SOCKET_READS);
+        if (n <= 0)
+            return -1;
+        metrics_record(HISTOGRAM_READ_BYTES, n);
+        metrics_add(METRIC_BYTES_RECEIVED, n);
+        done += n;
+    }
+    return 0;
+}
+
+/*
+ * Recibe el archivo como chunks comprimidos por separado y los descomprime
+ * a medida que llegan. Devuelve la cantidad de bytes descomprimidos.
+ */
+int receive_chunks(struct connection *conn, char *buffer, int size, int slot)
+{
+    char chunk[CHUNK_SIZE];
+    int bytes_read = 0;
+
+    while (bytes_read < size)
+    {
+        struct chunk_header header;
+        if (read_full(conn, &header, sizeof(header)) == -1 || header.length > CHUNK_SIZE)
+            break;
+        if (read_full(conn, chunk, header.length) == -1)
+            break;
+
+        size_t expected = size - bytes_read;
+        if (expected > CHUNK_SIZE)
+            expected = CHUNK_SIZE;
+
+        long n = decompress_block(header.codec, chunk, header.length, buffer + bytes_read, expected);
+        if (n != (long)expected)
+        {
+            fprintf(stderr, "Chunk corrupto en el byte %d\n", bytes_read);
+            break;
+        }
+        bytes_read += n;
+        status_progress(slot, bytes_read, -1, -1);
+    }
+    return bytes_read;
+}
+
+// el archivo se guarda en el directorio actual: sólo nos quedamos con el
+// nombre, sin la ruta que haya mandado el cliente. NULL si no es válido
+char *local_name(struct file_info *file_info)
+{
+    file_info->name[sizeof(file_info->name) - 1] = '\0';
+    char *name = strrchr(file_info->name, '/');
+    name = (name == NULL) ? file_info->name : name + 1;
+    if (name[0] == '\0' || strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+        return NULL;
+    return name;
+}
+
+/*
+ * Responde a TCP_SIGNATURES con las firmas de nuestra copia del archivo.
+ * La copia queda en *base para aplicarle el delta que llegue después.
+ */
+void send_signatures(struct connection *conn, char *name, char **base, size_t *base_size)
+{
+    struct signature_header header;
+    struct block_signature *sigs = NULL;
+    bzero(&header, sizeof(header));
+
+    *base = (name != NULL) ? delta_load_base(name, base_size) : NULL;
+    if (*base != NULL && *base_size <= BUFFER_SIZE)
+    {
+        header.nblocks = delta_nblocks(*base_size, DELTA_BLOCK_SIZE);
+        header.old_size = *base_size;
+        sigs = malloc((header.nblocks + 1) * sizeof(struct block_signature));
+        if (sigs == NULL)
+            error("ERROR allocating signatures");
+        compute_signatures(*base, *base_size, DELTA_BLOCK_SIZE, sigs);
+    }
+    printf("Enviando %u firmas de %s\n", header.nblocks, name != NULL ? name : "?");
+
+    if (conn_write(conn, &header, sizeof(header)) != sizeof(header) ||
+        (header.nblocks > 0 &&
+         conn_write(conn, sigs, header.nblocks * sizeof(struct block_signature)) < 0))
+        perror("ERROR writing signatures");
+    free(sigs);
+}
+
+// escribe el archivo recibido con otro nombre y lo renombra, así un error
+// nunca pisa la copia que usa el próximo delta
+void save_file(char *name, char *data, int size)
+{
+    char tmp_name[sizeof(((struct file_info *)0)->name) + 8];
+    snprintf(tmp_name, sizeof(tmp_name), "%s.part", name);
+
+    FILE *file = fopen(tmp_name, "w");
+    if (file == NULL)
+    {
+        perror("fopen");
+        return;
+    }
+    if ((size > 0 && fwrite(data, size, 1, file) != 1) || fclose(file) != 0 ||
+        rename(tmp_name, name) == -1)
+    {
+        perror("ERROR saving file");
+        remove(tmp_name);
+        return;
+    }
+    printf("Archivo guardado como %s\n", name);
+}
+
+/*
+ * Responde a TCP_DOWNLOAD con nuestra copia de name, desde el cache de
+ * archivos: sale con sendfile (o kTLS) del page cache, sin leerla ni
+ * calcularle el hash otra vez.
+ */
+void send_download(struct connection *conn, char *name, struct sockaddr_in *peer, int peer_len)
+{
+    struct file_info reply;
+    bzero(&reply, sizeof(reply));
+    reply.size = -1;
+    reply.mode = TCP_DOWNLOAD;
+    reply.codec = CODEC_RAW;
+
+    struct cached_file *file = (name != NULL) ? file_cache_get(name) : NULL;
+    if (file != NULL && file->size <= INT_MAX)
+    {
+        strncpy(reply.name, name, sizeof(reply.name) - 1);
+        reply.size = file->size;
+        reply.payload_size = file->size;
+        memcpy(reply.sha256_hash, file->sha256, HASH_SIZE);
+    }
+    if (conn_write(conn, &reply, sizeof(reply)) != sizeof(reply))
+    {
+        perror("ERROR writing to socket");
+        file_cache_release(file);
+        return;
+    }
+    if (reply.size == -1)
+    {
+        printf("Archivo %s no disponible para descarga\n", name != NULL ? name : "?");
+        file_cache_release(file);
+        return;
+    }
+
+    printf("Enviando archivo %s, tamaño %d bytes\n", reply.name, reply.size);
+    int slot = status_begin((struct sockaddr *)peer, peer_len, reply.name, reply.size, -1);
+    if (conn_send_file(conn, file->fd, file->data, file->size) != (ssize_t)file->size)
+        perror("ERROR sending file");
+    else
+        status_progress(slot, file->size, -1, -1);
+    status_end(slot);
+    file_cache_release(file);
+}
+
+void usage(char *program)
+{
+    fprintf(stderr, "usage %s [-t cert.pem -k key.pem] port\n", program);
+    exit(1);
+}
+
 int main(int argc, char *argv[])
 {
-    if (argc < 2)
+    char *cert = NULL;
+    char *key = NULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "t:k:")) != -1)
+    {
+        switch (opt)
+        {
+        case 't':
+            cert = optarg;
+            break;
+        case 'k':
+            key = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (argc - optind < 1)
     {
         fprintf(stderr, "ERROR, no port provided\n");
-        exit(1);
+        usage(argv[0]);
     }
+    if ((cert == NULL) != (key == NULL))
+        usage(argv[0]);
+
+    // con certificado las conexiones van cifradas
+    SSL_CTX *tls_ctx = NULL;
+    if (cert != NULL && (tls_ctx = tls_server_context(cert, key)) == NULL)
+        exit(1);
+    metrics_init("tcpserver");
+    status_init("tcpserver");
+    file_cache_init();
     int sockfd, newsockfd, portno, clilen;
-    char *buffer = malloc(BUFFER_SIZE);
+    // en huge pages; no hace falta limpiarlo entre conexiones porque sólo se
+    // usan los bytes recibidos en cada una
+    char *buffer = pool_alloc(BUFFER_SIZE);
+    if (buffer == NULL)
+        error("ERROR allocating buffer");
     struct sockaddr_in serv_addr, cli_addr;
     int n, bytes_read, total_bytes;
     char response[256];
@@ -45,7 +250,7 @@ int main(int argc, char *argv[])
     bzero((char *)&serv_addr, sizeof(serv_addr));
     // ASIGNA EL PUERTO PASADO POR ARGUMENTO
     // ASIGNA LA IP EN DONDE ESCUCHA (SU PROPIA IP)
-    portno = atoi(argv[1]);
+    portno = atoi(argv[optind]);
     serv_addr.sin_family = AF_INET;
     serv_addr.sin_addr.s_addr = INADDR_ANY;
     serv_addr.sin_port = htons(portno);
@@ -79,49 +284,140 @@ int main(int argc, char *argv[])
         // DEVUELVE UN NUEVO DESCRIPTOR POR EL CUAL SE VAN A REALIZAR LAS COMUNICACIONES
         if (newsockfd < 0)
             error("ERROR on accept");
-        bzero(buffer, BUFFER_SIZE);
+
+        struct connection conn = {newsockfd, NULL};
+        if (tls_ctx != NULL)
+        {
+            if (tls_accept(&conn, tls_ctx) == -1)
+            {
+                fprintf(stderr, "Handshake TLS fallido\n");
+                conn_close(&conn);
+                continue;
+            }
+            tls_report(&conn);
+        }
 
         // la primera lectura será del tamaño del struct que representa el tamaño del archivo
         total_bytes = sizeof(file_info);
 
         bzero(&file_info, sizeof(file_info));
-        // lee el struct file_size
-        read(newsockfd, &file_info, sizeof(file_info));
+        // lee el struct file_size; si la conexión se corta antes no hay nada que hacer
+        if (read_full(&conn, &file_info, sizeof(file_info)) == -1)
+        {
+            fprintf(stderr, "Conexión cerrada antes del file_info\n");
+            conn_close(&conn);
+            continue;
+        }
+        char *name = local_name(&file_info);
+
+        // descarga: mandamos nuestra copia y listo
+        if (file_info.mode == TCP_DOWNLOAD)
+        {
+            send_download(&conn, name, &cli_addr, clilen);
+            conn_close(&conn);
+            metrics_flush();
+            continue;
+        }
+
+        // modo delta: primero mandamos las firmas y después llega el file_info real
+        char *base = NULL;
+        size_t base_size = 0;
+        if (file_info.mode == TCP_SIGNATURES)
+        {
+            send_signatures(&conn, name, &base, &base_size);
+            bzero(&file_info, sizeof(file_info));
+            if (read_full(&conn, &file_info, sizeof(file_info)) == -1)
+            {
+                fprintf(stderr, "Conexión cerrada después de las firmas\n");
+                free(base);
+                conn_close(&conn);
+                continue;
+            }
+            name = local_name(&file_info);
+        }
+
         printf("Recibiendo archivo %s, tamaño %d bytes\n", file_info.name, file_info.size);
         printHex(file_info.sha256_hash);
         
-        total_bytes = file_info.size;
+        if (file_info.size < 0 || file_info.size > BUFFER_SIZE || !codec_supported(file_info.codec) ||
+            file_info.payload_size < 0 || file_info.payload_size > BUFFER_SIZE ||
+            (file_info.mode != TCP_FULL && file_info.mode != TCP_DELTA) ||
+            (file_info.mode == TCP_FULL && file_info.payload_size != file_info.size) ||
+            (file_info.mode == TCP_DELTA && base == NULL))
+        {
+            fprintf(stderr, "Archivo rechazado: tamaño %d, codec %d, modo %d\n", file_info.size, file_info.codec, file_info.mode);
+            free(base);
+            conn_close(&conn);
+            continue;
+        }
+
+        total_bytes = file_info.payload_size;
         bytes_read = 0;
+        int slot = status_begin((struct sockaddr *)&cli_addr, clilen, file_info.name, total_bytes, -1);
+
+        if (file_info.codec != CODEC_RAW)
+            bytes_read = receive_chunks(&conn, buffer, total_bytes, slot);
 
         // LEE EL MENSAJE DEL CLIENTE
-        while ((n = read(newsockfd, buffer + bytes_read, total_bytes - bytes_read)) > 0)
+        while (file_info.codec == CODEC_RAW && (n = conn_read(&conn, buffer + bytes_read, total_bytes - bytes_read)) > 0)
         {
 
             if (n < 0)
                 error("ERROR reading from socket");
 
+            metrics_inc(METRIC_SOCKET_READS);
+            metrics_record(HISTOGRAM_READ_BYTES, n);
+            metrics_add(METRIC_BYTES_RECEIVED, n);
             bytes_read += n;
+            status_progress(slot, bytes_read, -1, -1);
         }
+        status_end(slot);
         printf("Recibidos %d bytes total \n", bytes_read);
-        
+
+        // reconstruye el archivo a partir de nuestra copia y el delta
+        char *data = buffer;
+        if (file_info.mode == TCP_DELTA)
+        {
+            data = pool_alloc(file_info.size);
+            if (data == NULL)
+                error("ERROR allocating file");
+            if (delta_apply(buffer, bytes_read, base, base_size, DELTA_BLOCK_SIZE, data, file_info.size) == -1)
+            {
+                fprintf(stderr, "Delta inválido\n");
+                bzero(data, file_info.size);
+            }
+            bytes_read = file_info.size;
+        }
    
         // calcula el hash del archivo recibido
-        calculate_sha256(buffer, bytes_read, calculated_hash);
+        calculate_sha256((unsigned char *)data, bytes_read, calculated_hash);
         printHex(calculated_hash);
      
         compareHash(file_info.sha256_hash, calculated_hash);
 
+        // lo guardamos como base del próximo delta
+        if (name != NULL && memcmp(file_info.sha256_hash, calculated_hash, HASH_SIZE) == 0)
+            save_file(name, data, file_info.size);
+
+        if (data != buffer)
+            pool_free(data);
+        free(base);
+
         // RESPONDE AL CLIENTE
-        n = send(newsockfd, "I got your message", 18, 0);
+        n = conn_write(&conn, "I got your message", 18);
         if (n < 0)
             error("ERROR writing to socket");
 
         // cerramos el socket de la conexion actual
 
-        close(newsockfd);
+        conn_close(&conn);
+
+        // el servidor no termina nunca: dejamos el acumulado de cada conexión
+        metrics_flush();
     }
 
-    free(buffer);
+    pool_free(buffer);
+    SSL_CTX_free(tls_ctx);
     return 0;
 }
 
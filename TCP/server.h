@@ -13,6 +13,45 @@ struct file_info
     int size;
     char name[20];
     unsigned char sha256_hash[HASH_SIZE]; 
+    // enum CODEC of the chunks that follow, see compress.h
+    int codec;
+    // enum TCP_MODE
+    int mode;
+    // bytes que siguen: el archivo, o el delta en modo TCP_DELTA
+    int payload_size;
+};
+
+enum TCP_MODE
+{
+    TCP_FULL = 0,
+    // pide las firmas de la copia del servidor, después llega otro file_info
+    TCP_SIGNATURES = 1,
+    // el payload es un delta contra la copia del servidor, ver delta.h
+    TCP_DELTA = 2,
+    // pide la copia del servidor de name: responde con un file_info del
+    // archivo (size -1 si no lo tiene) seguido del archivo sin comprimir
+    TCP_DOWNLOAD = 3,
+};
+
+// bloques en los que se divide la copia del servidor para el delta
+#define DELTA_BLOCK_SIZE 4096
+
+// respuesta a TCP_SIGNATURES, seguida de nblocks struct block_signature
+// nblocks es 0 si el servidor no tiene el archivo
+struct signature_header
+{
+    unsigned int nblocks;
+    unsigned int old_size;
+};
+
+// with compression the file goes out in chunks of CHUNK_SIZE bytes,
+// each compressed on its own and preceded by its header
+#define CHUNK_SIZE 65536
+
+struct chunk_header
+{
+    unsigned int length;
+    unsigned char codec;
 };
 
 
@@ -0,0 +1,187 @@
+#include <limits.h>
+#include <openssl/err.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <sys/sendfile.h>
+#include <unistd.h>
+#include "tls.h"
+#include "../UDP/include/metrics.h"
+
+// bytes por llamada a sendfile
+#define SENDFILE_CHUNK (1 << 20)
+
+// cifrados que kTLS puede manejar; AES-GCM aprovecha AES-NI
+#define TLS_CIPHERS "ECDHE-ECDSA-AES128-GCM-SHA256:ECDHE-RSA-AES128-GCM-SHA256:" \
+                    "ECDHE-ECDSA-AES256-GCM-SHA384:ECDHE-RSA-AES256-GCM-SHA384"
+
+static SSL_CTX *new_context(const SSL_METHOD *method)
+{
+    SSL_CTX *ctx = SSL_CTX_new(method);
+    if (ctx == NULL)
+    {
+        ERR_print_errors_fp(stderr);
+        return NULL;
+    }
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+#if OPENSSL_VERSION_NUMBER < 0x30200000L
+    // antes de OpenSSL 3.2 kTLS sólo descifra TLS 1.2, y el que recibe el
+    // archivo es el servidor
+    SSL_CTX_set_max_proto_version(ctx, TLS1_2_VERSION);
+#endif
+    SSL_CTX_set_cipher_list(ctx, TLS_CIPHERS);
+    SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+    return ctx;
+}
+
+SSL_CTX *tls_server_context(const char *cert, const char *key)
+{
+    SSL_CTX *ctx = new_context(TLS_server_method());
+    if (ctx == NULL)
+        return NULL;
+
+    if (SSL_CTX_use_certificate_chain_file(ctx, cert) != 1 ||
+        SSL_CTX_use_PrivateKey_file(ctx, key, SSL_FILETYPE_PEM) != 1 ||
+        SSL_CTX_check_private_key(ctx) != 1)
+    {
+        ERR_print_errors_fp(stderr);
+        SSL_CTX_free(ctx);
+        return NULL;
+    }
+    return ctx;
+}
+
+SSL_CTX *tls_client_context(const char *ca)
+{
+    SSL_CTX *ctx = new_context(TLS_client_method());
+    if (ctx == NULL)
+        return NULL;
+
+    if (ca == NULL)
+    {
+        fprintf(stderr, "Aviso: no se verifica el certificado del servidor\n");
+        return ctx;
+    }
+    if (SSL_CTX_load_verify_locations(ctx, ca, NULL) != 1)
+    {
+        ERR_print_errors_fp(stderr);
+        SSL_CTX_free(ctx);
+        return NULL;
+    }
+    SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
+    return ctx;
+}
+
+int tls_connect(struct connection *conn, SSL_CTX *ctx, const char *hostname)
+{
+    SSL *ssl = SSL_new(ctx);
+    if (ssl == NULL)
+    {
+        ERR_print_errors_fp(stderr);
+        return -1;
+    }
+    SSL_set_fd(ssl, conn->fd);
+    SSL_set_tlsext_host_name(ssl, hostname);
+    // con verificación, el certificado tiene que ser de este host
+    if (SSL_CTX_get_verify_mode(ctx) & SSL_VERIFY_PEER)
+        SSL_set1_host(ssl, hostname);
+
+    if (SSL_connect(ssl) != 1)
+    {
+        ERR_print_errors_fp(stderr);
+        SSL_free(ssl);
+        return -1;
+    }
+    conn->ssl = ssl;
+    return 0;
+}
+
+int tls_accept(struct connection *conn, SSL_CTX *ctx)
+{
+    SSL *ssl = SSL_new(ctx);
+    if (ssl == NULL)
+    {
+        ERR_print_errors_fp(stderr);
+        return -1;
+    }
+    SSL_set_fd(ssl, conn->fd);
+
+    if (SSL_accept(ssl) != 1)
+    {
+        ERR_print_errors_fp(stderr);
+        SSL_free(ssl);
+        return -1;
+    }
+    conn->ssl = ssl;
+    return 0;
+}
+
+void tls_report(struct connection *conn)
+{
+    printf("%s %s, kTLS envío: %s, recepción: %s\n", SSL_get_version(conn->ssl),
+           SSL_get_cipher_name(conn->ssl),
+           BIO_get_ktls_send(SSL_get_wbio(conn->ssl)) ? "sí" : "no",
+           BIO_get_ktls_recv(SSL_get_rbio(conn->ssl)) ? "sí" : "no");
+}
+
+ssize_t conn_read(struct connection *conn, void *buf, size_t len)
+{
+    if (conn->ssl == NULL || len == 0)
+        return read(conn->fd, buf, len);
+
+    int n = SSL_read(conn->ssl, buf, len > INT_MAX ? INT_MAX : len);
+    if (n > 0)
+        return n;
+    // el otro extremo cerró el TLS
+    return SSL_get_error(conn->ssl, n) == SSL_ERROR_ZERO_RETURN ? 0 : -1;
+}
+
+ssize_t conn_write(struct connection *conn, const void *buf, size_t len)
+{
+    if (conn->ssl == NULL)
+        return write(conn->fd, buf, len);
+
+    int n = SSL_write(conn->ssl, buf, len > INT_MAX ? INT_MAX : len);
+    return n > 0 ? n : -1;
+}
+
+ssize_t conn_send_file(struct connection *conn, int fd, const char *data, size_t len)
+{
+    // sin kTLS el cifrado lo hace OpenSSL, que necesita los datos en memoria
+    bool zero_copy = conn->ssl == NULL || BIO_get_ktls_send(SSL_get_wbio(conn->ssl));
+    size_t sent = 0;
+
+    while (sent < len)
+    {
+        size_t chunk = len - sent > SENDFILE_CHUNK ? SENDFILE_CHUNK : len - sent;
+        uint64_t start = metrics_now_us();
+        ssize_t n;
+        if (!zero_copy)
+            n = conn_write(conn, data + sent, chunk);
+        else if (conn->ssl != NULL)
+            n = SSL_sendfile(conn->ssl, fd, sent, chunk, 0);
+        else
+        {
+            off_t offset = sent;
+            n = sendfile(conn->fd, fd, &offset, chunk);
+        }
+        metrics_record(HISTOGRAM_SEND_US, metrics_now_us() - start);
+        metrics_inc(METRIC_SOCKET_WRITES);
+
+        if (n <= 0)
+            return -1;
+        sent += n;
+        metrics_add(METRIC_BYTES_SENT, n);
+    }
+    return sent;
+}
+
+void conn_close(struct connection *conn)
+{
+    if (conn->ssl != NULL)
+    {
+        SSL_shutdown(conn->ssl);
+        SSL_free(conn->ssl);
+        conn->ssl = NULL;
+    }
+    close(conn->fd);
+}
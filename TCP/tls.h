@@ -0,0 +1,46 @@
+#ifndef TLS_H_
+#define TLS_H_
+
+#include <openssl/ssl.h>
+#include <sys/types.h>
+
+/*
+ * Modo cifrado: el handshake TLS lo hace OpenSSL y, si el kernel tiene el
+ * módulo tls, el cifrado de los registros queda en kTLS. Así el archivo
+ * puede seguir saliendo con sendfile, sin pasar por un buffer del programa.
+ * Sin kTLS funciona igual pero cifrando en OpenSSL.
+ */
+
+// extremo de una conexión; ssl es NULL si va en texto plano
+struct connection
+{
+    int fd;
+    SSL *ssl;
+};
+
+SSL_CTX *tls_server_context(const char *cert, const char *key);
+
+// ca es el certificado con el que se verifica al servidor, NULL no verifica
+SSL_CTX *tls_client_context(const char *ca);
+
+// devuelven -1 si falla el handshake
+int tls_connect(struct connection *conn, SSL_CTX *ctx, const char *hostname);
+int tls_accept(struct connection *conn, SSL_CTX *ctx);
+
+// muestra la versión, el cifrado y si cada sentido va por kTLS
+void tls_report(struct connection *conn);
+
+ssize_t conn_read(struct connection *conn, void *buf, size_t len);
+ssize_t conn_write(struct connection *conn, const void *buf, size_t len);
+
+/*
+ * Envía len bytes del archivo fd desde el offset 0: con sendfile en texto
+ * plano o sobre kTLS, y si no desde data, que tiene el mismo contenido.
+ * Devuelve los bytes enviados, -1 si falla.
+ */
+ssize_t conn_send_file(struct connection *conn, int fd, const char *data, size_t len);
+
+// cierra el TLS si lo hay y el socket
+void conn_close(struct connection *conn);
+
+#endif
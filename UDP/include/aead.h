@@ -0,0 +1,102 @@
+#ifndef AEAD_H_
+#define AEAD_H_
+
+#include <openssl/evp.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Authenticated encryption of pages.
+ *
+ * Each upload agrees on a fresh key: the client sends an X25519 key share in
+ * the metadata, the server answers with its own, and both run HKDF-SHA256
+ * over the shared secret. A pre-shared key, when both ends have one, is mixed
+ * into the HKDF input so a man in the middle cannot derive the key either.
+ *
+ * Every page is sealed on its own with AES-256-GCM (AES-NI) or
+ * ChaCha20-Poly1305: the page number is the nonce, and the page number,
+ * codec and length are authenticated with it. A key is never reused across
+ * uploads, so nonces never repeat.
+ */
+
+#define AEAD_KEY_SIZE 32
+#define AEAD_TAG_SIZE 16
+#define AEAD_PUBLIC_KEY_SIZE 32
+#define AEAD_MAX_PSK_SIZE 64
+#define AEAD_MAX_THREADS 8
+
+enum CIPHER {
+  CIPHER_NONE = 0,
+  CIPHER_AES_GCM = 1,
+  CIPHER_CHACHA20_POLY1305 = 2,
+};
+
+int cipher_supported(int cipher);
+int cipher_from_name(const char *name);
+const char *cipher_name(int cipher);
+
+/*
+ * Reads a pre-shared key of up to AEAD_MAX_PSK_SIZE bytes from @param path.
+ * Returns its length, -1 if it cannot be read or is empty.
+ */
+int aead_load_psk(const char *path, unsigned char *psk);
+
+/*
+ * An X25519 key pair for one handshake
+ */
+struct key_share {
+  EVP_PKEY *pkey;
+  unsigned char public_key[AEAD_PUBLIC_KEY_SIZE];
+};
+
+int key_share_generate(struct key_share *share);
+void key_share_free(struct key_share *share);
+
+/*
+ * Derives the session key from our share and the peer's public key.
+ * Both ends pass the client and server public keys in the same order.
+ * Returns -1 if the peer key is invalid.
+ */
+int aead_derive_key(struct key_share *own, const unsigned char *peer_public,
+                    const unsigned char *client_public,
+                    const unsigned char *server_public,
+                    const unsigned char *psk, size_t psk_len,
+                    unsigned char *key);
+
+/*
+ * Cipher state keyed once per upload; one per thread
+ */
+struct aead {
+  EVP_CIPHER_CTX *ctx;
+};
+
+int aead_init(struct aead *aead, int cipher, const unsigned char *key,
+              bool encrypt);
+void aead_free(struct aead *aead);
+
+/*
+ * Seals @param len bytes of page @param pagenumber into @param out, which
+ * takes len + AEAD_TAG_SIZE bytes. Returns the sealed length.
+ */
+long aead_seal(struct aead *aead, int pagenumber, int codec, const char *in,
+               size_t len, char *out);
+
+/*
+ * Opens a sealed page into @param out, which may be @param in.
+ * Returns the plaintext length, or -1 if the page is not authentic.
+ */
+long aead_open(struct aead *aead, int pagenumber, int codec, const char *in,
+               size_t len, char *out);
+
+/*
+ * Seals @param count pages numbered from @param first_page on up to
+ * @param nthreads threads. Page i is read from src + i * stride, lengths[i]
+ * bytes with codec codecs[i] (stride bytes and CODEC_RAW when they are
+ * NULL), and sealed into dst + i * (stride + AEAD_TAG_SIZE).
+ */
+void aead_seal_pages(int cipher, const unsigned char *key, int first_page,
+                     int count, const char *src, size_t stride,
+                     const unsigned int *lengths, const unsigned char *codecs,
+                     char *dst, int nthreads);
+
+#endif
@@ -0,0 +1,40 @@
+#ifndef COMPRESS_H_
+#define COMPRESS_H_
+
+#include <stddef.h>
+
+/*
+ * Block compression shared by the UDP pages and the TCP chunks.
+ * Every block is compressed on its own so a lost page can be retransmitted
+ * and decompressed without its neighbours. Blocks that do not shrink are
+ * kept raw.
+ */
+
+#define COMPRESS_MAX_THREADS 8
+
+enum CODEC {
+  CODEC_RAW = 0,
+  CODEC_DEFLATE = 1,
+};
+
+int codec_supported(int codec);
+int codec_from_name(const char *name);
+const char *codec_name(int codec);
+
+/*
+ * Compresses @param src in blocks of @param block_size on up to
+ * @param nthreads threads. Block i is written to dst + i * block_size,
+ * with its length in lengths[i] and the codec it ended up with in codecs[i].
+ */
+void compress_blocks(int codec, const char *src, size_t src_len,
+                     size_t block_size, char *dst, unsigned int *lengths,
+                     unsigned char *codecs, int nthreads);
+
+/*
+ * Returns the decompressed length, or -1 if the block is corrupt or does
+ * not fit in @param dst_len bytes
+ */
+long decompress_block(int codec, const char *src, size_t src_len, char *dst,
+                      size_t dst_len);
+
+#endif
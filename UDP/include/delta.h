@@ -0,0 +1,66 @@
+#ifndef DELTA_H_
+#define DELTA_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * rsync style delta transfer.
+ *
+ * The receiver splits its current copy of a file in blocks and sends a weak
+ * rolling checksum plus a truncated SHA-256 for each one. The sender scans
+ * the new file with the rolling checksum and encodes it as a stream of block
+ * references and literal byte ranges, which is then transferred like any
+ * other file and applied against the old copy.
+ */
+
+#define DELTA_STRONG_SIZE 16
+
+struct block_signature {
+  uint32_t weak;
+  unsigned char strong[DELTA_STRONG_SIZE];
+};
+
+enum DELTA_RECORD {
+  DELTA_LITERAL = 0,
+  DELTA_COPY = 1,
+};
+
+/*
+ * DELTA_COPY: copy `length` blocks of the old file starting at block `index`
+ * DELTA_LITERAL: `length` bytes of new data follow the record
+ */
+struct delta_record {
+  uint32_t type;
+  uint32_t index;
+  uint32_t length;
+};
+
+uint32_t weak_checksum(const unsigned char *data, size_t len);
+
+size_t delta_nblocks(size_t size, size_t block_size);
+void compute_signatures(const char *data, size_t size, size_t block_size,
+                        struct block_signature *sigs);
+
+/*
+ * Encodes @param data against the signatures of the old file.
+ * The stream is malloc'ed into @param *out; returns its length.
+ */
+size_t delta_encode(const char *data, size_t size,
+                    const struct block_signature *sigs, size_t nblocks,
+                    size_t block_size, size_t old_size, char **out);
+
+/*
+ * Rebuilds the new file into @param out, which holds @param out_size bytes.
+ * Returns -1 if the stream is malformed or does not add up to out_size.
+ */
+int delta_apply(const char *delta, size_t delta_len, const char *old,
+                size_t old_size, size_t block_size, char *out,
+                size_t out_size);
+
+/*
+ * Reads the receiver's current copy of @param name, NULL if there is none
+ */
+char *delta_load_base(const char *name, size_t *size);
+
+#endif
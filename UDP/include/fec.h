@@ -0,0 +1,41 @@
+#ifndef FEC_H_
+#define FEC_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Forward error correction over groups of pages.
+ *
+ * Every group of data_pages pages is followed by parity_pages parity pages.
+ * With a single parity page the parity is a plain XOR of the group; with more
+ * than one a systematic Reed-Solomon code over GF(2^8) (Cauchy matrix) is
+ * used, so any parity_pages losses inside a group can be repaired.
+ */
+
+#define FEC_MAX_DATA_PAGES 64
+#define FEC_MAX_PARITY_PAGES 8
+
+enum FEC_MODE {
+  FEC_NONE = 0,
+  FEC_XOR = 1,
+  FEC_RS = 2,
+};
+
+void fec_init(void);
+int fec_validate(int mode, int data_pages, int parity_pages);
+
+/*
+ * Helpers mapping page numbers to groups; parity pages are numbered after the
+ * last data page: npages + group * parity_pages + j
+ */
+int fec_ngroups(int npages, int data_pages);
+int fec_group_size(int group, int npages, int data_pages);
+
+void fec_encode(int mode, int k, int m, char *const *data, char **parity,
+                size_t page_size);
+int fec_decode(int mode, int k, int m, char **data, const bool *data_present,
+               char *const *parity, const bool *parity_present,
+               size_t page_size);
+
+#endif
@@ -0,0 +1,67 @@
+#ifndef FILE_CACHE_H_
+#define FILE_CACHE_H_
+
+#include <openssl/sha.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <time.h>
+
+/*
+ * Hot files served to downloads, shared by the UDP and TCP servers.
+ *
+ * A file is mapped read-only the first time it is asked for and hashed
+ * once; later requests send it straight from the mapping, without reading
+ * or hashing it again. Every lookup checks the file still has the same
+ * inode, size and modification time, so an upload that replaces it is
+ * picked up. Once the mapped bytes go over the budget the least recently
+ * used files nobody is sending are unmapped.
+ *
+ * TRANSFER_CACHE_MB sets the budget. Not thread safe: both servers send
+ * from a single thread.
+ */
+
+#define FILE_CACHE_DEFAULT_MB 256
+#define FILE_CACHE_NAME_SIZE 64
+
+struct cached_file {
+  char name[FILE_CACHE_NAME_SIZE];
+  // kept open for sendfile
+  int fd;
+  // NULL for an empty file
+  const char *data;
+  size_t size;
+  unsigned char sha256[SHA256_DIGEST_LENGTH];
+  // page count at the page size last asked for
+  int page_size;
+  int npages;
+
+  dev_t dev;
+  ino_t ino;
+  struct timespec mtime;
+  // senders using it; it is only unmapped at 0
+  int refs;
+  // replaced on disk, out of the LRU list and dropped at the last release
+  bool stale;
+  // LRU list, most recently used first
+  struct cached_file *prev;
+  struct cached_file *next;
+};
+
+/*
+ * Reads the budget from the environment
+ */
+void file_cache_init(void);
+
+/*
+ * The file @param name of the working directory, mapped and hashed.
+ * Returns NULL if it is not a regular file that can be read.
+ * Every file returned has to be given back with file_cache_release.
+ */
+struct cached_file *file_cache_get(const char *name);
+
+int file_cache_npages(struct cached_file *file, int page_size);
+
+void file_cache_release(struct cached_file *file);
+
+#endif
@@ -5,6 +5,7 @@
 #include <netinet/in.h>
 #include <openssl/sha.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -14,19 +15,69 @@
 #include <time.h>
 #include <unistd.h>
 
+#include "aead.h"
+#include "compress.h"
+#include "delta.h"
+#include "fec.h"
+#include "file_cache.h"
+#include "metrics.h"
+#include "pool.h"
+#include "status.h"
+
 #define HASH_SIZE 32
 
 #define FILENAME_SIZE 50
 #define BURST_SIZE 40
 
+/*
+ * Pages are sized at runtime: the client probes the path MTU and the page
+ * size is negotiated in file_metadata.page_size
+ */
 #define MTU_SIZE 1500
-#define PAGE_SIZE (MTU_SIZE - sizeof(int))
+#define JUMBO_MTU_SIZE 9000
+#define MIN_MTU_SIZE 576
+// IPv4 + UDP headers
+#define IP_UDP_HEADER_SIZE 28
+#define MAX_DATAGRAM_SIZE (JUMBO_MTU_SIZE - IP_UDP_HEADER_SIZE)
+
+#define PAGE_HEADER_SIZE (offsetof(struct file_page, data))
+#define MTU_TO_PAGE_SIZE(mtu)                                                  \
+  ((int)((mtu) - IP_UDP_HEADER_SIZE - PAGE_HEADER_SIZE))
+#define DEFAULT_PAGE_SIZE MTU_TO_PAGE_SIZE(MTU_SIZE)
+#define MIN_PAGE_SIZE MTU_TO_PAGE_SIZE(MIN_MTU_SIZE)
+#define MAX_PAGE_SIZE MTU_TO_PAGE_SIZE(JUMBO_MTU_SIZE)
 
 #define TIMEOUT_SEC 0
 #define TIMEOUT_USEC 100000
 
 #define MAX_RETRIES 3
 
+// NACK mode: report gaps every NACK_INTERVAL pages, give up after
+// IDLE_TIMEOUTS consecutive select timeouts
+#define NACK_INTERVAL 256
+#define NACK_MAX_GAPS 180
+#define IDLE_TIMEOUTS 50
+
+// page numbers reserved for control messages
+#define METADATA_PAGE -94
+#define NCF_PAGE -95
+#define SIGNATURE_PAGE -96
+#define PROBE_PAGE -97
+#define NACK_PAGE -98
+#define EOT_PAGE -99
+
+/*
+ * Multicast: receivers hold a NACK back a random 0..MCAST_NACK_BACKOFF_MS,
+ * and drop it if the sender confirms (NCF_PAGE) it is already repairing
+ * those pages for someone else. The sender repairs a page at most once every
+ * MCAST_REPAIR_HOLDOFF_MS however many receivers ask for it.
+ */
+#define MCAST_NACK_BACKOFF_MS 20
+#define MCAST_NACK_HOLDOFF_MS 50
+#define MCAST_REPAIR_HOLDOFF_MS 20
+#define MCAST_TTL 8
+#define MCAST_MAX_RECEIVERS 256
+
 /*
  * Hashing function declarations
  * TODO: update SHA functions-- deprecated as of openssl 3.0
@@ -37,26 +88,72 @@ void calculate_sha256(const unsigned char *data, size_t data_len,
                       unsigned char *sha256_hash);
 void printHex(unsigned char *hash);
 void compareHash(unsigned char *hash1, unsigned char *hash2);
+ssize_t send_page_data(int sockfd, const struct sockaddr *dest_addr,
+                       socklen_t addrlen, int pagenumber, int codec,
+                       const char *data, size_t len);
+
+/*
+ * Wall clock milliseconds since @param start, taken with CLOCK_MONOTONIC
+ */
+double elapsed_ms(const struct timespec *start);
+
+/*
+ * Whether the @param numbytes datagram in @param buf is a file_metadata.
+ * Compressed pages vary in length, so the size alone cannot tell.
+ */
+bool is_metadata(const void *buf, int numbytes);
 
 /*
  *Basic metadata for each file, along with its hash string
  */
 struct file_metadata {
+  // METADATA_PAGE, so it is never taken for a page
+  int pagenumber;
   unsigned int size;
   unsigned int npages;
   int page_size;
   char name[FILENAME_SIZE];
   unsigned char sha256_hash[HASH_SIZE];
+  // negotiated forward error correction, see fec.h
+  unsigned char fec_mode;
+  unsigned char fec_data_pages;
+  unsigned char fec_parity_pages;
+  // enum RELIABILITY
+  unsigned char reliability;
+  // enum CODEC pages may be compressed with, see compress.h
+  unsigned char codec;
+  // enum TRANSFER; with TRANSFER_DELTA the pages carry a delta stream
+  // of payload_size bytes instead of the file itself
+  unsigned char transfer;
+  // enum CIPHER pages are sealed with, see aead.h
+  unsigned char cipher;
+  // enum REQUEST
+  unsigned char request;
+  unsigned int payload_size;
+  // X25519 key share: the client's in the metadata, the server's in the reply
+  unsigned char public_key[AEAD_PUBLIC_KEY_SIZE];
 };
 
-typedef struct {
-  char data[PAGE_SIZE];
-  int pagenumber;
-} file_page_t;
-
+/*
+ * A page on the wire: the header followed by length bytes of data that
+ * expand to file_metadata.page_size bytes once decompressed
+ */
 struct file_page {
-  char data[PAGE_SIZE];
   int pagenumber;
+  unsigned short length;
+  unsigned char codec;
+  char data[];
+};
+
+typedef struct file_page file_page_t;
+
+/*
+ * Path MTU probe, padded with zeros up to size bytes.
+ * The server echoes the header back with the size it actually received.
+ */
+struct mtu_probe {
+  int pagenumber; // PROBE_PAGE
+  int size;
 };
 
 struct response {
@@ -64,9 +161,90 @@ struct response {
   signed char ack;
 };
 
+/*
+ * Server reply to the metadata, carrying the settings it accepted
+ */
+struct handshake_reply {
+  struct response response;
+  struct file_metadata metadata;
+};
+
+/*
+ * Delta mode: asks for the block signatures of the server's copy of a file,
+ * SIGNATURES_PER_REPLY blocks of block_size bytes starting at first_block
+ */
+#define SIGNATURES_PER_REPLY 64
+
+struct signature_request {
+  int pagenumber; // SIGNATURE_PAGE
+  int first_block;
+  int block_size;
+  char name[FILENAME_SIZE];
+};
+
+/*
+ * nblocks is 0 when the server has no copy of the file
+ */
+struct signature_reply {
+  int pagenumber; // SIGNATURE_PAGE
+  int first_block;
+  int count;
+  unsigned int nblocks;
+  unsigned int old_size;
+  struct block_signature sigs[SIGNATURES_PER_REPLY];
+};
+
+/*
+ * Range of consecutive pages the server is missing
+ */
+struct gap {
+  int first;
+  int count;
+};
+
+/*
+ * Sent by the server in NACK mode instead of per page acks. In multicast
+ * the sender echoes the gaps it is about to repair to the group as NCF_PAGE.
+ */
+struct nack_report {
+  int pagenumber; // NACK_PAGE or NCF_PAGE
+  signed char ack; // NACK
+  int ngaps;
+  struct gap gaps[NACK_MAX_GAPS];
+};
+
 enum ACK {
   ACK = 1,
+  NACK = 2,
   END_OF_TRANSMISSION = -1,
 };
 
+/*
+ * RELIABILITY_ACK: the server acks every page
+ * RELIABILITY_NACK: the server only reports gaps, and completion at the end
+ * RELIABILITY_MULTICAST: pages go to a multicast group once; every receiver
+ * reports its gaps like in NACK mode, with suppression, and its completion
+ */
+enum RELIABILITY {
+  RELIABILITY_ACK = 0,
+  RELIABILITY_NACK = 1,
+  RELIABILITY_MULTICAST = 2,
+};
+
+enum TRANSFER {
+  TRANSFER_FULL = 0,
+  TRANSFER_DELTA = 1,
+};
+
+/*
+ * REQUEST_UPLOAD: the client sends the file
+ * REQUEST_DOWNLOAD: the client asks for the server's copy of name; the
+ * handshake reply carries its size and hash, then the server sends the pages
+ * and the client acks them
+ */
+enum REQUEST {
+  REQUEST_UPLOAD = 0,
+  REQUEST_DOWNLOAD = 1,
+};
+
 #endif
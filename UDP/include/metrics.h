@@ -0,0 +1,92 @@
+#ifndef METRICS_H_
+#define METRICS_H_
+
+#include <stdint.h>
+
+/*
+ * Transfer telemetry shared by the UDP and TCP programs.
+ *
+ * Every thread updates its own counters and histograms, so the hot path
+ * never takes a lock or a contended cache line; readers add the shards up.
+ * Histograms are log-linear (HDR style): 16 sub-buckets per power of two,
+ * about 6% relative error over the whole 64 bit range.
+ *
+ * Set TRANSFER_METRICS to a file ("-" for stderr) to get a JSON summary when
+ * the program exits, and TRANSFER_METRICS_INTERVAL to a number of
+ * milliseconds to also get periodic snapshots, one JSON object per line.
+ * Every line also carries the page faults and resident memory of the process.
+ */
+
+enum METRIC {
+  METRIC_PAGES_SENT,
+  METRIC_PAGES_RETRANSMITTED,
+  METRIC_PARITY_PAGES_SENT,
+  METRIC_BYTES_SENT,
+  METRIC_ACKS_RECEIVED,
+  METRIC_DUPLICATE_ACKS,
+  METRIC_NACK_REPORTS_RECEIVED,
+  METRIC_PAGES_RECEIVED,
+  METRIC_DUPLICATE_PAGES,
+  METRIC_CORRUPT_PAGES,
+  METRIC_FEC_RECOVERED_PAGES,
+  METRIC_BYTES_RECEIVED,
+  METRIC_ACKS_SENT,
+  METRIC_NACK_REPORTS_SENT,
+  METRIC_SELECT_TIMEOUTS,
+  METRIC_SOCKET_WRITES,
+  METRIC_SOCKET_READS,
+  METRIC_COMPRESSED_BLOCKS,
+  METRIC_COMPRESS_IN_BYTES,
+  METRIC_COMPRESS_OUT_BYTES,
+  METRIC_POOL_MAPS,
+  METRIC_POOL_HUGETLB_MAPS,
+  METRIC_POOL_REUSED,
+  METRIC_POOL_ZEROED_BYTES,
+  METRIC_SEALED_PAGES,
+  METRIC_AUTH_FAILURES,
+  METRIC_NACKS_SUPPRESSED,
+  METRIC_MULTICAST_REPAIRS,
+  METRIC_UNICAST_REPAIRS,
+  METRIC_CACHE_HITS,
+  METRIC_CACHE_MISSES,
+  METRIC_CACHE_EVICTIONS,
+  // multicast reports from an address that never answered the announcement
+  METRIC_UNKNOWN_RECEIVER_REPLIES,
+  METRIC_COUNT,
+};
+
+enum HISTOGRAM {
+  // first transmission to ack, retransmitted pages are not sampled (Karn)
+  HISTOGRAM_ACK_RTT_US,
+  // gap between two pages arriving at the server
+  HISTOGRAM_PAGE_INTERARRIVAL_US,
+  // time spent in a single send/write on the data path
+  HISTOGRAM_SEND_US,
+  // bytes returned by a single read of the TCP server
+  HISTOGRAM_READ_BYTES,
+  HISTOGRAM_COUNT,
+};
+
+/*
+ * Reads the environment and registers the exit hook that writes the summary.
+ * @param program names the process in the output.
+ */
+void metrics_init(const char *program);
+
+void metrics_add(enum METRIC metric, uint64_t n);
+void metrics_record(enum HISTOGRAM histogram, uint64_t value);
+
+#define metrics_inc(metric) metrics_add((metric), 1)
+
+/*
+ * CLOCK_MONOTONIC microseconds, for histogram samples
+ */
+uint64_t metrics_now_us(void);
+
+/*
+ * Writes a summary of the totals so far, for programs that outlive a
+ * transfer. Does nothing unless TRANSFER_METRICS is set.
+ */
+void metrics_flush(void);
+
+#endif
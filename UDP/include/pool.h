@@ -0,0 +1,34 @@
+#ifndef POOL_H_
+#define POOL_H_
+
+#include <stddef.h>
+
+/*
+ * Recycled buffers for per-session state, shared by the UDP and TCP servers.
+ *
+ * Buffers come from anonymous mappings rounded up to a power of two. Those
+ * of 2 MB or more are backed by huge pages: MAP_HUGETLB when the system has
+ * some reserved, transparent huge pages otherwise. A freed buffer is kept
+ * for the next session of its size class instead of going back to the
+ * kernel, so later sessions take no page faults. The pool remembers how far
+ * each buffer was used, so pool_calloc only clears what a previous session
+ * could have written: the rest is still zero from the kernel.
+ */
+
+// largest amount of free memory kept for reuse
+#define POOL_CACHE_BYTES (256u << 20)
+
+/*
+ * Returns a buffer of at least @param size bytes with undefined contents,
+ * or NULL if it could not be mapped.
+ */
+void *pool_alloc(size_t size);
+
+/*
+ * Same as pool_alloc but the first @param size bytes are zero
+ */
+void *pool_calloc(size_t size);
+
+void pool_free(void *buf);
+
+#endif
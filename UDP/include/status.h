@@ -0,0 +1,43 @@
+#ifndef STATUS_H_
+#define STATUS_H_
+
+#include <stdint.h>
+#include <sys/socket.h>
+
+/*
+ * Live view of the transfers a server has in flight, shared by the UDP and
+ * TCP servers.
+ *
+ * The data path only writes its own slot of a fixed table, guarded by a
+ * sequence counter: no lock and no system call. A separate thread answers
+ * on the Unix socket named by TRANSFER_STATUS with a JSON copy of the table,
+ * retrying a slot that changed while it was being read, so a slow or stuck
+ * reader can never hold a transfer back.
+ */
+
+#define STATUS_MAX_SESSIONS 32
+
+/*
+ * Starts the status thread if TRANSFER_STATUS is set.
+ * @param program names the process in the output.
+ */
+void status_init(const char *program);
+
+/*
+ * Claims a slot for a transfer of @param size bytes coming from @param peer.
+ * @param total_pages is -1 for protocols without pages.
+ * Returns the slot, or -1 if the table is full; every other call accepts -1.
+ */
+int status_begin(const struct sockaddr *peer, socklen_t peer_len,
+                 const char *file, uint64_t size, int64_t total_pages);
+
+/*
+ * Publishes the progress so far. @param retransmits is -1 when the protocol
+ * does not see them (TCP retransmits inside the kernel).
+ */
+void status_progress(int slot, uint64_t bytes, int64_t pages,
+                     int64_t retransmits);
+
+void status_end(int slot);
+
+#endif
@@ -0,0 +1,68 @@
+#ifndef TIMER_WHEEL_H_
+#define TIMER_WHEEL_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Hierarchical timer wheel: scheduling, cancelling and expiring a timer are
+ * O(1) however many are pending, which lets the client keep a
+ * retransmission deadline per page in flight.
+ *
+ * Time is counted in ticks chosen by the caller. Level 0 has one slot per
+ * tick for the next WHEEL_SLOTS ticks, every level above covers WHEEL_SLOTS
+ * times more time per slot, and its timers cascade down as they get close.
+ */
+
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4
+
+struct timer {
+  struct timer *next;
+  // NULL while the timer is not scheduled
+  struct timer **pprev;
+  uint64_t expires;
+  // whatever the caller needs to handle the expiry
+  void *owner;
+  int id;
+};
+
+struct timer_wheel {
+  uint64_t now;
+  struct timer *slots[WHEEL_LEVELS][WHEEL_SLOTS];
+  int pending;
+};
+
+void wheel_init(struct timer_wheel *wheel, uint64_t now);
+void timer_init(struct timer *timer, void *owner, int id);
+
+static inline bool timer_pending(const struct timer *timer) {
+  return timer->pprev != NULL;
+}
+
+/*
+ * (Re)schedules @param timer to expire at tick @param expires.
+ * Deadlines in the past expire on the next wheel_advance.
+ */
+void wheel_schedule(struct timer_wheel *wheel, struct timer *timer,
+                    uint64_t expires);
+
+void wheel_cancel(struct timer_wheel *wheel, struct timer *timer);
+
+/*
+ * Moves the wheel to tick @param now, calling @param expire for every timer
+ * that came due. The timer is already unscheduled, so the callback may
+ * schedule it again.
+ */
+void wheel_advance(struct timer_wheel *wheel, uint64_t now,
+                   void (*expire)(struct timer *timer));
+
+/*
+ * Ticks until the wheel next has work to do, an expiry or a cascade;
+ * -1 when nothing is scheduled
+ */
+int64_t wheel_timeout(const struct timer_wheel *wheel);
+
+#endif
@@ -0,0 +1,310 @@
+#include "../include/aead.h"
+#include "../include/metrics.h"
+
+#include <openssl/err.h>
+#include <openssl/kdf.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#define NONCE_SIZE 12
+// page number, codec and length
+#define AAD_SIZE 9
+#define HKDF_INFO "udp file pages"
+
+struct seal_job {
+  int cipher;
+  const unsigned char *key;
+  int first_page;
+  int count;
+  const char *src;
+  size_t stride;
+  const unsigned int *lengths;
+  const unsigned char *codecs;
+  char *dst;
+  int first;
+  int step;
+};
+
+int cipher_supported(int cipher) {
+  return cipher == CIPHER_NONE || cipher == CIPHER_AES_GCM ||
+         cipher == CIPHER_CHACHA20_POLY1305;
+}
+
+int cipher_from_name(const char *name) {
+  if (strcasecmp(name, "none") == 0) {
+    return CIPHER_NONE;
+  }
+  if (strcasecmp(name, "aes-gcm") == 0 || strcasecmp(name, "aes") == 0) {
+    return CIPHER_AES_GCM;
+  }
+  if (strcasecmp(name, "chacha20-poly1305") == 0 ||
+      strcasecmp(name, "chacha20") == 0) {
+    return CIPHER_CHACHA20_POLY1305;
+  }
+  return -1;
+}
+
+const char *cipher_name(int cipher) {
+  switch (cipher) {
+  case CIPHER_NONE:
+    return "none";
+  case CIPHER_AES_GCM:
+    return "aes-256-gcm";
+  case CIPHER_CHACHA20_POLY1305:
+    return "chacha20-poly1305";
+  default:
+    return "unknown";
+  }
+}
+
+static const EVP_CIPHER *evp_cipher(int cipher) {
+  switch (cipher) {
+  case CIPHER_AES_GCM:
+    return EVP_aes_256_gcm();
+  case CIPHER_CHACHA20_POLY1305:
+    return EVP_chacha20_poly1305();
+  default:
+    return NULL;
+  }
+}
+
+int aead_load_psk(const char *path, unsigned char *psk) {
+  FILE *file = fopen(path, "r");
+  if (file == NULL) {
+    perror(path);
+    return -1;
+  }
+  size_t len = fread(psk, 1, AEAD_MAX_PSK_SIZE, file);
+  fclose(file);
+  return len > 0 ? (int)len : -1;
+}
+
+int key_share_generate(struct key_share *share) {
+  size_t len = AEAD_PUBLIC_KEY_SIZE;
+  share->pkey = EVP_PKEY_Q_keygen(NULL, NULL, "X25519");
+  if (share->pkey == NULL ||
+      EVP_PKEY_get_raw_public_key(share->pkey, share->public_key, &len) !=
+          1) {
+    ERR_print_errors_fp(stderr);
+    key_share_free(share);
+    return -1;
+  }
+  return 0;
+}
+
+void key_share_free(struct key_share *share) {
+  EVP_PKEY_free(share->pkey);
+  share->pkey = NULL;
+}
+
+/*
+ * X25519 with the peer key. OpenSSL refuses low order points, which would
+ * give an all zero secret.
+ */
+static int shared_secret(struct key_share *own,
+                         const unsigned char *peer_public,
+                         unsigned char *secret) {
+  EVP_PKEY *peer = EVP_PKEY_new_raw_public_key(EVP_PKEY_X25519, NULL,
+                                               peer_public,
+                                               AEAD_PUBLIC_KEY_SIZE);
+  EVP_PKEY_CTX *ctx = EVP_PKEY_CTX_new(own->pkey, NULL);
+  size_t len = AEAD_PUBLIC_KEY_SIZE;
+  int ok = peer != NULL && ctx != NULL && EVP_PKEY_derive_init(ctx) == 1 &&
+           EVP_PKEY_derive_set_peer(ctx, peer) == 1 &&
+           EVP_PKEY_derive(ctx, secret, &len) == 1;
+  EVP_PKEY_CTX_free(ctx);
+  EVP_PKEY_free(peer);
+  return ok ? 0 : -1;
+}
+
+int aead_derive_key(struct key_share *own, const unsigned char *peer_public,
+                    const unsigned char *client_public,
+                    const unsigned char *server_public,
+                    const unsigned char *psk, size_t psk_len,
+                    unsigned char *key) {
+  unsigned char ikm[AEAD_PUBLIC_KEY_SIZE + AEAD_MAX_PSK_SIZE];
+  unsigned char salt[2 * AEAD_PUBLIC_KEY_SIZE];
+
+  if (psk_len > AEAD_MAX_PSK_SIZE || shared_secret(own, peer_public, ikm)) {
+    return -1;
+  }
+  memcpy(ikm + AEAD_PUBLIC_KEY_SIZE, psk, psk_len);
+  memcpy(salt, client_public, AEAD_PUBLIC_KEY_SIZE);
+  memcpy(salt + AEAD_PUBLIC_KEY_SIZE, server_public, AEAD_PUBLIC_KEY_SIZE);
+
+  EVP_PKEY_CTX *ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_HKDF, NULL);
+  size_t len = AEAD_KEY_SIZE;
+  int ok = ctx != NULL && EVP_PKEY_derive_init(ctx) == 1 &&
+           EVP_PKEY_CTX_set_hkdf_md(ctx, EVP_sha256()) == 1 &&
+           EVP_PKEY_CTX_set1_hkdf_salt(ctx, salt, sizeof(salt)) == 1 &&
+           EVP_PKEY_CTX_set1_hkdf_key(ctx, ikm,
+                                      AEAD_PUBLIC_KEY_SIZE + psk_len) == 1 &&
+           EVP_PKEY_CTX_add1_hkdf_info(ctx, (unsigned char *)HKDF_INFO,
+                                       strlen(HKDF_INFO)) == 1 &&
+           EVP_PKEY_derive(ctx, key, &len) == 1;
+  EVP_PKEY_CTX_free(ctx);
+  memset(ikm, 0, sizeof(ikm));
+  if (!ok) {
+    ERR_print_errors_fp(stderr);
+    return -1;
+  }
+  return 0;
+}
+
+int aead_init(struct aead *aead, int cipher, const unsigned char *key,
+              bool encrypt) {
+  aead->ctx = EVP_CIPHER_CTX_new();
+  if (aead->ctx == NULL || evp_cipher(cipher) == NULL ||
+      EVP_CipherInit_ex(aead->ctx, evp_cipher(cipher), NULL, key, NULL,
+                        encrypt) != 1) {
+    ERR_print_errors_fp(stderr);
+    aead_free(aead);
+    return -1;
+  }
+  return 0;
+}
+
+void aead_free(struct aead *aead) {
+  EVP_CIPHER_CTX_free(aead->ctx);
+  aead->ctx = NULL;
+}
+
+static void put_be32(unsigned char *dst, uint32_t value) {
+  dst[0] = value >> 24;
+  dst[1] = value >> 16;
+  dst[2] = value >> 8;
+  dst[3] = value;
+}
+
+/*
+ * Sets the nonce for @param pagenumber, keeping the key schedule, and feeds
+ * the associated data
+ */
+static int start_page(struct aead *aead, int pagenumber, int codec,
+                      size_t len) {
+  unsigned char nonce[NONCE_SIZE] = {0};
+  unsigned char aad[AAD_SIZE];
+  int outl;
+
+  put_be32(nonce + NONCE_SIZE - 4, pagenumber);
+  put_be32(aad, pagenumber);
+  aad[4] = codec;
+  put_be32(aad + 5, len);
+
+  return EVP_CipherInit_ex(aead->ctx, NULL, NULL, NULL, nonce, -1) == 1 &&
+                 EVP_CipherUpdate(aead->ctx, NULL, &outl, aad, AAD_SIZE) == 1
+             ? 0
+             : -1;
+}
+
+long aead_seal(struct aead *aead, int pagenumber, int codec, const char *in,
+               size_t len, char *out) {
+  int outl, finl;
+  if (start_page(aead, pagenumber, codec, len) == -1 ||
+      EVP_CipherUpdate(aead->ctx, (unsigned char *)out, &outl,
+                       (const unsigned char *)in, len) != 1 ||
+      EVP_CipherFinal_ex(aead->ctx, (unsigned char *)out + outl, &finl) !=
+          1 ||
+      EVP_CIPHER_CTX_ctrl(aead->ctx, EVP_CTRL_AEAD_GET_TAG, AEAD_TAG_SIZE,
+                          out + len) != 1) {
+    return -1;
+  }
+  metrics_inc(METRIC_SEALED_PAGES);
+  return len + AEAD_TAG_SIZE;
+}
+
+long aead_open(struct aead *aead, int pagenumber, int codec, const char *in,
+               size_t len, char *out) {
+  int outl, finl;
+  if (len < AEAD_TAG_SIZE) {
+    metrics_inc(METRIC_AUTH_FAILURES);
+    return -1;
+  }
+  len -= AEAD_TAG_SIZE;
+
+  // the tag sits after the data, an in place open does not overwrite it
+  if (start_page(aead, pagenumber, codec, len) == -1 ||
+      EVP_CipherUpdate(aead->ctx, (unsigned char *)out, &outl,
+                       (const unsigned char *)in, len) != 1 ||
+      EVP_CIPHER_CTX_ctrl(aead->ctx, EVP_CTRL_AEAD_SET_TAG, AEAD_TAG_SIZE,
+                          (void *)(in + len)) != 1 ||
+      EVP_CipherFinal_ex(aead->ctx, (unsigned char *)out + outl, &finl) !=
+          1) {
+    metrics_inc(METRIC_AUTH_FAILURES);
+    return -1;
+  }
+  return len;
+}
+
+static void *seal_worker(void *arg) {
+  struct seal_job *job = arg;
+  struct aead aead;
+  if (aead_init(&aead, job->cipher, job->key, true) == -1) {
+    fprintf(stderr, "Could not set up %s\n", cipher_name(job->cipher));
+    exit(EXIT_FAILURE);
+  }
+
+  size_t sealed_stride = job->stride + AEAD_TAG_SIZE;
+  for (int i = job->first; i < job->count; i += job->step) {
+    size_t len = job->lengths != NULL ? job->lengths[i] : job->stride;
+    int codec = job->codecs != NULL ? job->codecs[i] : 0;
+    // a page that cannot be sealed would be sent as garbage and rejected
+    // on every retransmission
+    if (aead_seal(&aead, job->first_page + i, codec,
+                  job->src + (size_t)i * job->stride, len,
+                  job->dst + (size_t)i * sealed_stride) == -1) {
+      fprintf(stderr, "Could not seal page %d with %s\n",
+              job->first_page + i, cipher_name(job->cipher));
+      exit(EXIT_FAILURE);
+    }
+  }
+  aead_free(&aead);
+  return NULL;
+}
+
+void aead_seal_pages(int cipher, const unsigned char *key, int first_page,
+                     int count, const char *src, size_t stride,
+                     const unsigned int *lengths, const unsigned char *codecs,
+                     char *dst, int nthreads) {
+  pthread_t threads[AEAD_MAX_THREADS];
+  struct seal_job jobs[AEAD_MAX_THREADS];
+
+  // a thread is not worth starting for less than a few hundred pages
+  if (nthreads > count / 256) {
+    nthreads = count / 256;
+  }
+  if (nthreads < 1) {
+    nthreads = 1;
+  }
+  if (nthreads > AEAD_MAX_THREADS) {
+    nthreads = AEAD_MAX_THREADS;
+  }
+
+  for (int t = 0; t < nthreads; t++) {
+    jobs[t] = (struct seal_job){cipher, key,     first_page, count,
+                                src,    stride,  lengths,    codecs,
+                                dst,    t,       nthreads};
+  }
+
+  // same split as compress_blocks: the calling thread takes the first share
+  int started = 1;
+  for (int t = 1; t < nthreads; t++) {
+    if (pthread_create(&threads[t], NULL, seal_worker, &jobs[t]) != 0) {
+      perror("pthread_create");
+      break;
+    }
+    started++;
+  }
+  for (int t = started; t < nthreads; t++) {
+    seal_worker(&jobs[t]);
+  }
+  seal_worker(&jobs[0]);
+
+  for (int t = 1; t < started; t++) {
+    pthread_join(threads[t], NULL);
+  }
+}
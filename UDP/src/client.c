@@ -4,7 +4,15 @@
  * Author: Thomas Rusiecki
  */
 
+#define _GNU_SOURCE
 #include "../include/library.h"
+#include "../include/timer_wheel.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/epoll.h>
 
 /*
  * Function to bind socket to server
@@ -38,6 +46,132 @@ void init_connection(int *sockfd, struct addrinfo **res, const char *hostname,
   }
 }
 
+/*
+ * Everything the client sends pages from
+ */
+struct page_store {
+  char *file_buffer;
+  char *parity_buffer;
+  // every page compressed on its own, NULL when sending raw
+  char *compressed;
+  unsigned int *lengths;
+  unsigned char *codecs;
+  // every data and parity page sealed, page_size + AEAD_TAG_SIZE apart;
+  // NULL when not encrypting
+  char *sealed;
+  // per page, for the retransmission counter and the ack RTT samples
+  unsigned char *send_count;
+  uint64_t *sent_at;
+};
+
+/*
+ * Path MTU discovery: with DF set, sends probes of decreasing size until the
+ * server echoes one back. Returns the largest page size that fits in an
+ * unfragmented datagram, never above @param max_mtu, or -1 if nothing
+ * listens on the server port.
+ */
+int discover_page_size(int sockfd, struct addrinfo *res, int max_mtu) {
+  int pmtudisc = IP_PMTUDISC_DO;
+  if (setsockopt(sockfd, IPPROTO_IP, IP_MTU_DISCOVER, &pmtudisc,
+                 sizeof(pmtudisc)) == -1) {
+    perror("setsockopt IP_MTU_DISCOVER");
+  }
+
+  // connecting lets the kernel report its own path MTU estimate
+  if (connect(sockfd, res->ai_addr, res->ai_addrlen) == -1) {
+    perror("connect");
+    return DEFAULT_PAGE_SIZE;
+  }
+
+  int kernel_mtu;
+  socklen_t optlen = sizeof(kernel_mtu);
+  if (getsockopt(sockfd, IPPROTO_IP, IP_MTU, &kernel_mtu, &optlen) == 0 &&
+      kernel_mtu < max_mtu) {
+    max_mtu = kernel_mtu;
+  }
+
+  const int candidates[] = {max_mtu, JUMBO_MTU_SIZE, 4352, MTU_SIZE,
+                            1492,    1280,           MIN_MTU_SIZE};
+  int probe_buf[MAX_DATAGRAM_SIZE / sizeof(int)];
+  memset(probe_buf, 0, sizeof(probe_buf));
+  struct mtu_probe *probe = (struct mtu_probe *)probe_buf;
+
+  for (size_t c = 0; c < sizeof(candidates) / sizeof(candidates[0]); c++) {
+    int mtu = candidates[c];
+    if (mtu > max_mtu || mtu < MIN_MTU_SIZE || (c > 0 && mtu == max_mtu)) {
+      continue;
+    }
+    int size = mtu - IP_UDP_HEADER_SIZE;
+
+    for (int retries = 0; retries < MAX_RETRIES; retries++) {
+      probe->pagenumber = PROBE_PAGE;
+      probe->size = size;
+
+      if (send(sockfd, probe_buf, size, 0) == -1) {
+        if (errno == ECONNREFUSED) {
+          fprintf(stderr, "Connection refused by the server\n");
+          return -1;
+        }
+        // EMSGSIZE: the kernel already knows the path is smaller
+        if (errno != EMSGSIZE) {
+          perror("send probe");
+        }
+        break;
+      }
+
+      fd_set readfds;
+      FD_ZERO(&readfds);
+      FD_SET(sockfd, &readfds);
+      struct timeval timeout = {TIMEOUT_SEC, TIMEOUT_USEC};
+
+      if (select(sockfd + 1, &readfds, NULL, NULL, &timeout) <= 0) {
+        continue;
+      }
+
+      struct mtu_probe reply;
+      ssize_t numbytes = recv(sockfd, &reply, sizeof(reply), 0);
+      if (numbytes == -1 && errno == ECONNREFUSED) {
+        fprintf(stderr, "Connection refused by the server\n");
+        return -1;
+      }
+      if (numbytes != sizeof(reply) || reply.pagenumber != PROBE_PAGE) {
+        continue;
+      }
+      if (reply.size == size) {
+        printf("Path MTU %d bytes\n", mtu);
+        return MTU_TO_PAGE_SIZE(mtu);
+      }
+      // a late reply to a bigger probe; keep waiting for ours
+      if (reply.size > size) {
+        retries--;
+      }
+    }
+  }
+
+  printf("Path MTU discovery failed, using %d byte pages\n",
+         DEFAULT_PAGE_SIZE);
+  return DEFAULT_PAGE_SIZE;
+}
+
+/*
+ * Splits the payload in pages of file_metadata->page_size,
+ * zero padding the last one
+ */
+void paginate(struct file_metadata *file_metadata, char **buffer) {
+  size_t page_size = file_metadata->page_size;
+  size_t payload_size = file_metadata->payload_size;
+  file_metadata->npages = (payload_size + page_size - 1) / page_size;
+
+  size_t capacity = (size_t)file_metadata->npages * page_size;
+  char *resized = realloc(*buffer, capacity > 0 ? capacity : 1);
+  if (resized == NULL) {
+    perror("Error allocating memory");
+    exit(EXIT_FAILURE);
+  }
+  *buffer = resized;
+  memset(*buffer + payload_size, 0, capacity - payload_size);
+}
+
 /*
  * Load file onto @param **buffer
  * given @param *filemane
@@ -53,6 +187,7 @@ void load_file(struct file_metadata *file_metadata, const char *filename,
 
   fseek(file, 0, SEEK_END);
   file_metadata->size = ftell(file);
+  file_metadata->payload_size = file_metadata->size;
   fseek(file, 0, SEEK_SET);
 
   const char *short_filename = strrchr(filename, '/');
@@ -61,24 +196,20 @@ void load_file(struct file_metadata *file_metadata, const char *filename,
   strncpy(file_metadata->name, short_filename, FILENAME_SIZE - 1);
   file_metadata->name[FILENAME_SIZE - 1] = '\0';
 
-  file_metadata->npages = (file_metadata->size + PAGE_SIZE - 1) / PAGE_SIZE;
-
-  *buffer = malloc(file_metadata->npages * PAGE_SIZE);
-  if (*buffer == NULL) {
-    perror("Error allocating memory");
-    exit(EXIT_FAILURE);
-  }
-  memset(*buffer, 0, file_metadata->size);
+  *buffer = NULL;
+  paginate(file_metadata, buffer);
 
   fread(*buffer, file_metadata->size, 1, file);
   fclose(file);
 }
 
 /*
- * Sends the file metadata to the server, and waits for reply
+ * Sends the file metadata to the server, and waits for reply.
+ * Returns -1 if the server turns the request down.
  */
 int send_file_metadata(int sockfd, struct file_metadata *file_info, int flags,
-                       const struct sockaddr *dest_addr, socklen_t addrlen) {
+                       const struct sockaddr *dest_addr, socklen_t addrlen,
+                       unsigned char *server_public) {
   int retries = 0;
   while (retries < MAX_RETRIES) {
     int nbytes = sendto(sockfd, file_info, sizeof(struct file_metadata), flags,
@@ -96,7 +227,7 @@ int send_file_metadata(int sockfd, struct file_metadata *file_info, int flags,
     FD_ZERO(&readfds);
     FD_SET(sockfd, &readfds);
     struct timeval timeout = {TIMEOUT_SEC, TIMEOUT_USEC};
-    struct response response;
+    struct handshake_reply reply;
 
     int retval = select(sockfd + 1, &readfds, NULL, NULL, &timeout);
     if (retval == -1) {
@@ -110,13 +241,41 @@ int send_file_metadata(int sockfd, struct file_metadata *file_info, int flags,
       continue;
     }
 
-    if (recvfrom(sockfd, &response, sizeof(response), flags, NULL, NULL) !=
-        -1) {
-      if (response.ack == ACK || response.pagenumber == -1) {
+    if (recvfrom(sockfd, &reply, sizeof(reply), flags, NULL, NULL) ==
+        sizeof(reply)) {
+      if (reply.response.ack == ACK && reply.response.pagenumber == -1) {
         printf("ACK received\n");
         printf("Server ready to receive file\n");
+
+        // the server may turn down the error correction we asked for
+        file_info->fec_mode = reply.metadata.fec_mode;
+        file_info->fec_data_pages = reply.metadata.fec_data_pages;
+        file_info->fec_parity_pages = reply.metadata.fec_parity_pages;
+        file_info->reliability = reply.metadata.reliability;
+        file_info->page_size = reply.metadata.page_size;
+        file_info->codec = reply.metadata.codec;
+        file_info->transfer = reply.metadata.transfer;
+        file_info->cipher = reply.metadata.cipher;
+        // the client share goes out again on a retry, the server's is kept
+        // apart
+        memcpy(server_public, reply.metadata.public_key,
+               AEAD_PUBLIC_KEY_SIZE);
+        // what a download is about to receive
+        if (file_info->request == REQUEST_DOWNLOAD) {
+          file_info->size = reply.metadata.size;
+          file_info->payload_size = reply.metadata.payload_size;
+          file_info->npages = reply.metadata.npages;
+          memcpy(file_info->sha256_hash, reply.metadata.sha256_hash,
+                 HASH_SIZE);
+        }
         return 0;
       }
+      if (reply.response.ack == NACK && reply.response.pagenumber == -1) {
+        printf("Request turned down\n");
+        // set when the server only takes encrypted transfers
+        file_info->cipher = reply.metadata.cipher;
+        return -1;
+      }
     }
 
     perror("Error receiving response from server, retrying");
@@ -127,161 +286,1572 @@ int send_file_metadata(int sockfd, struct file_metadata *file_info, int flags,
 }
 
 /*
- * Sends in a burst of pages the file to the server
- * and checks for acks back
+ * Delta mode: downloads the block signatures of the server's copy of the
+ * file, asking for up to BURST_SIZE replies at a time.
+ * Returns NULL if the server has no copy or stops answering.
  */
+struct block_signature *fetch_signatures(int sockfd, struct addrinfo *res,
+                                         struct file_metadata *file_info,
+                                         size_t *nblocks, size_t *old_size) {
+  struct signature_request request;
+  memset(&request, 0, sizeof(request));
+  request.pagenumber = SIGNATURE_PAGE;
+  request.block_size = file_info->page_size;
+  memcpy(request.name, file_info->name, FILENAME_SIZE - 1);
 
-void send_file(int sockfd, struct addrinfo *res, char *file_buffer,
-               bool *ack_array, int npages) {
-
-  int last_contiguous = -1;
-  int remaining_pages = npages;
-  int burst = BURST_SIZE;
-  int runs = 0;
-  int retries = 0;
+  struct signature_reply reply;
+  struct block_signature *sigs = NULL;
+  bool *have = NULL;
+  int nreplies = 1, received = 0, stalled = 0;
 
-  struct file_page page;
+  while (stalled < MAX_RETRIES) {
+    int asked = 0, got = 0;
+    for (int c = 0; c < nreplies && asked < BURST_SIZE; c++) {
+      if (have != NULL && have[c]) {
+        continue;
+      }
+      request.first_block = c * SIGNATURES_PER_REPLY;
+      if (sendto(sockfd, &request, sizeof(request), 0, res->ai_addr,
+                 res->ai_addrlen) == -1) {
+        perror("Error requesting signatures");
+        exit(EXIT_FAILURE);
+      }
+      asked++;
+    }
 
-  while (remaining_pages > 0 || retries < MAX_RETRIES) {
+    while (got < asked) {
+      fd_set readfds;
+      FD_ZERO(&readfds);
+      FD_SET(sockfd, &readfds);
+      struct timeval timeout = {TIMEOUT_SEC, TIMEOUT_USEC};
 
-    burst = (remaining_pages < BURST_SIZE) ? remaining_pages : BURST_SIZE;
-    // printf("Run #%d. Sending %d pages: ", runs, burst);
+      if (select(sockfd + 1, &readfds, NULL, NULL, &timeout) <= 0) {
+        break;
+      }
 
-    for (int i = 1; i <= burst; i++) {
-      int current_page = i + last_contiguous;
-      if (!ack_array[current_page]) {
-        page.pagenumber = current_page;
-        memcpy(page.data, file_buffer + current_page * PAGE_SIZE, PAGE_SIZE);
+      int numbytes = recvfrom(sockfd, &reply, sizeof(reply), 0, NULL, NULL);
+      if (numbytes < (int)offsetof(struct signature_reply, sigs) ||
+          reply.pagenumber != SIGNATURE_PAGE) {
+        continue;
+      }
 
-        if (sendto(sockfd, &page, sizeof(struct file_page), 0, res->ai_addr,
-                   res->ai_addrlen) == -1) {
-          perror("Error sending file page");
+      // the first reply tells how many blocks there are
+      if (have == NULL) {
+        if (reply.nblocks == 0) {
+          printf("Server has no copy of %s\n", file_info->name);
+          return NULL;
+        }
+        *nblocks = reply.nblocks;
+        *old_size = reply.old_size;
+        nreplies = (*nblocks + SIGNATURES_PER_REPLY - 1) / SIGNATURES_PER_REPLY;
+        sigs = malloc(*nblocks * sizeof(struct block_signature));
+        have = calloc(nreplies, sizeof(bool));
+        if (sigs == NULL || have == NULL) {
+          perror("malloc");
           exit(EXIT_FAILURE);
         }
-        // printf(" %d,", page.pagenumber);
-      } else {
-        burst++;
+      }
+
+      int c = reply.first_block / SIGNATURES_PER_REPLY;
+      int expected = *nblocks - (size_t)c * SIGNATURES_PER_REPLY;
+      if (expected > SIGNATURES_PER_REPLY) {
+        expected = SIGNATURES_PER_REPLY;
+      }
+      if (reply.first_block < 0 || reply.first_block % SIGNATURES_PER_REPLY ||
+          c >= nreplies || reply.nblocks != *nblocks ||
+          reply.count != expected ||
+          numbytes != (int)(offsetof(struct signature_reply, sigs) +
+                            expected * sizeof(struct block_signature))) {
+        continue;
+      }
+
+      got++;
+      if (!have[c]) {
+        have[c] = true;
+        memcpy(sigs + reply.first_block, reply.sigs,
+               expected * sizeof(struct block_signature));
+        if (++received == nreplies) {
+          free(have);
+          return sigs;
+        }
       }
     }
 
-    char reply[MTU_SIZE];
-    struct response *response = (struct response *)reply;
+    stalled = (got == 0) ? stalled + 1 : 0;
+  }
 
-    // loop till no more incoming datagrams on os buffer
-    int current_page, numbytes, index, retval;
+  fprintf(stderr, "No signatures from server, sending the whole file\n");
+  free(sigs);
+  free(have);
+  return NULL;
+}
 
-    while (1) {
-      fd_set readfds;
-      FD_ZERO(&readfds);
-      FD_SET(sockfd, &readfds);
+/*
+ * Encodes the file against the server's copy.
+ * Returns NULL when the delta would not be smaller than the file.
+ */
+char *build_delta(int sockfd, struct addrinfo *res,
+                  struct file_metadata *file_info, char *file_buffer) {
+  size_t nblocks, old_size;
+  struct block_signature *sigs =
+      fetch_signatures(sockfd, res, file_info, &nblocks, &old_size);
+  if (sigs == NULL) {
+    return NULL;
+  }
 
-      struct timeval timeout = {TIMEOUT_SEC, 0};
+  char *delta_buffer;
+  size_t delta_len =
+      delta_encode(file_buffer, file_info->size, sigs, nblocks,
+                   file_info->page_size, old_size, &delta_buffer);
+  free(sigs);
 
-      retval = select(sockfd + 1, &readfds, NULL, NULL, &timeout);
+  if (delta_len >= file_info->size) {
+    printf("Delta is not smaller than the file, sending it whole\n");
+    free(delta_buffer);
+    return NULL;
+  }
 
-      if (retval == -1) {
-        perror("select");
-      } else if (retval == 0) {
-        // No more datagrams to read
-        // printf("Timeout: No se recibieron más acks\n");
-        break;
-      }
+  printf("Delta against server copy: %zu bytes instead of %u\n", delta_len,
+         file_info->size);
+  file_info->transfer = TRANSFER_DELTA;
+  file_info->payload_size = delta_len;
+  return delta_buffer;
+}
 
-      // Receive file_page
-      numbytes = recvfrom(sockfd, reply, sizeof(reply) - 1, 0, NULL, NULL);
-      if (numbytes == -1) {
-        perror("recvfrom");
-        exit(EXIT_FAILURE);
-      }
+/*
+ * Parse the -f data:parity option. One parity page means XOR parity,
+ * more than one means Reed-Solomon.
+ */
+void parse_fec(struct file_metadata *file_info, const char *arg) {
+  int data_pages, parity_pages;
 
-      current_page = response[0].pagenumber;
-      if (!ack_array[current_page] && response[0].ack == ACK) {
+  if (sscanf(arg, "%d:%d", &data_pages, &parity_pages) != 2) {
+    fprintf(stderr, "Invalid FEC setting %s, expected data:parity\n", arg);
+    exit(EXIT_FAILURE);
+  }
 
-        ack_array[current_page] = true;
-        remaining_pages--;
-      }
+  int mode = (parity_pages == 1) ? FEC_XOR : FEC_RS;
+  if (fec_validate(mode, data_pages, parity_pages) == -1) {
+    fprintf(stderr, "Unsupported FEC setting %d:%d (max %d:%d)\n", data_pages,
+            parity_pages, FEC_MAX_DATA_PAGES, FEC_MAX_PARITY_PAGES);
+    exit(EXIT_FAILURE);
+  }
 
-      if (current_page == -99 && (response[00].ack == END_OF_TRANSMISSION)) {
-        printf("EOT");
-        return;
-      }
+  file_info->fec_mode = mode;
+  file_info->fec_data_pages = data_pages;
+  file_info->fec_parity_pages = parity_pages;
+}
 
-      // update last_contigou state
-      index = last_contiguous + 1;
-      while (ack_array[index]) {
-        last_contiguous++;
-        index++;
-      }
+/*
+ * Computes the parity pages of every group of the file.
+ * Returns NULL when error correction is off.
+ */
+char *build_parity(struct file_metadata *file_info, char *file_buffer) {
+  if (file_info->fec_mode == FEC_NONE) {
+    return NULL;
+  }
 
-      // printf("Received ack: %d\n", current_page);
-    }
-    runs++;
+  int k = file_info->fec_data_pages;
+  int m = file_info->fec_parity_pages;
+  int ngroups = fec_ngroups(file_info->npages, k);
 
-    if (remaining_pages == 0 && last_contiguous + 1 == npages) {
-      printf("DONE client side");
-      return;
+  size_t page_size = file_info->page_size;
+  char *parity_buffer = malloc((size_t)ngroups * m * page_size);
+  if (parity_buffer == NULL) {
+    perror("malloc");
+    exit(EXIT_FAILURE);
+  }
+
+  char *data[FEC_MAX_DATA_PAGES];
+  char *parity[FEC_MAX_PARITY_PAGES];
+
+  for (int g = 0; g < ngroups; g++) {
+    int group_size = fec_group_size(g, file_info->npages, k);
+    for (int i = 0; i < group_size; i++) {
+      data[i] = file_buffer + (size_t)(g * k + i) * page_size;
+    }
+    for (int j = 0; j < m; j++) {
+      parity[j] = parity_buffer + (size_t)(g * m + j) * page_size;
     }
+    fec_encode(file_info->fec_mode, group_size, m, data, parity, page_size);
   }
+
+  return parity_buffer;
 }
 
-int main(int argc, char *argv[]) {
+/*
+ * Compresses every page on its own, on @param nthreads threads.
+ * Pages that do not shrink are flagged raw.
+ */
+void compress_pages(struct file_metadata *file_info, struct page_store *store,
+                    int nthreads) {
+  if (file_info->codec == CODEC_RAW) {
+    return;
+  }
+
+  size_t npages = file_info->npages;
+  size_t page_size = file_info->page_size;
 
-  if (argc != 4) {
-    fprintf(stderr, "Usage: %s hostname port file\n", argv[0]);
+  store->compressed = malloc(npages * page_size);
+  store->lengths = malloc(npages * sizeof(unsigned int));
+  store->codecs = malloc(npages * sizeof(unsigned char));
+  if ((store->compressed == NULL || store->lengths == NULL ||
+       store->codecs == NULL) &&
+      npages > 0) {
+    perror("malloc");
     exit(EXIT_FAILURE);
   }
 
-  // socket file structures
-  int sockfd = -1;
-  struct addrinfo *res = NULL;
+  compress_blocks(file_info->codec, store->file_buffer, npages * page_size,
+                  page_size, store->compressed, store->lengths, store->codecs,
+                  nthreads);
+
+  size_t total = 0;
+  for (size_t i = 0; i < npages; i++) {
+    total += store->lengths[i];
+  }
+  printf("Compressed %zu pages with %s to %zu bytes\n", npages,
+         codec_name(file_info->codec), total);
+}
+
+void free_compressed(struct page_store *store) {
+  free(store->compressed);
+  free(store->lengths);
+  free(store->codecs);
+  store->compressed = NULL;
+  store->lengths = NULL;
+  store->codecs = NULL;
+}
+
+/*
+ * Seals every data and parity page on @param nthreads threads once the key
+ * is agreed. A retransmission resends the same sealed copy.
+ */
+void seal_pages(struct file_metadata *file_info, struct page_store *store,
+                const unsigned char *key, int nthreads) {
+  int npages = file_info->npages;
+  int nparity = 0;
+  if (store->parity_buffer != NULL) {
+    nparity = fec_ngroups(npages, file_info->fec_data_pages) *
+              file_info->fec_parity_pages;
+  }
+
+  size_t page_size = file_info->page_size;
+  size_t sealed_size = page_size + AEAD_TAG_SIZE;
+  store->sealed = pool_alloc(((size_t)npages + nparity) * sealed_size);
+  if (store->sealed == NULL) {
+    perror("malloc");
+    exit(EXIT_FAILURE);
+  }
+
+  const char *pages = (store->compressed != NULL) ? store->compressed
+                                                   : store->file_buffer;
+  aead_seal_pages(file_info->cipher, key, 0, npages, pages, page_size,
+                  store->lengths, store->codecs, store->sealed, nthreads);
+  if (nparity > 0) {
+    aead_seal_pages(file_info->cipher, key, npages, nparity,
+                    store->parity_buffer, page_size, NULL, NULL,
+                    store->sealed + (size_t)npages * sealed_size, nthreads);
+  }
+  printf("Sealed %d pages with %s\n", npages + nparity,
+         cipher_name(file_info->cipher));
+}
+
+// the idle timer period, and the retransmission timeout before the first
+// RTT sample
+#define TIMEOUT_MS (TIMEOUT_SEC * 1000 + TIMEOUT_USEC / 1000)
+#define MIN_RTO_MS 10
+#define MAX_RTO_MS 1000
+// replies read per recvmmsg call
+#define REPLY_BATCH 64
+#define MAX_EVENTS 64
+// page timers use the page number as id
+#define IDLE_TIMER -1
+
+enum UPLOAD_STATE { UPLOAD_SENDING, UPLOAD_DONE, UPLOAD_FAILED };
+
+/*
+ * A server that joined a multicast upload
+ */
+struct receiver {
+  struct sockaddr_storage addr;
+  socklen_t addr_len;
+  bool done;
+};
+
+/*
+ * One file on its way to one server
+ */
+struct upload {
+  const char *hostname;
+  const char *port;
+  const char *filename;
 
-  // file info data
+  int sockfd;
+  struct addrinfo *res;
   struct file_metadata file_info;
-  memset(&file_info, 0, sizeof(struct file_metadata));
+  char *file_buffer;
+  char *delta_buffer;
+  struct page_store store;
+  struct timespec begin;
+  enum UPLOAD_STATE state;
 
-  // heap buffers; file buffer could be as large as heap allows
-  char *file_buffer = NULL;
-  bool *ack_array = NULL;
+  int npages;
+  // first page that was never sent
+  int next_page;
+  // the socket buffer filled up, waiting for EPOLLOUT
+  bool blocked;
+  // idle timer expiries since the last reply
+  int idle;
+  struct timer idle_timer;
 
-  init_connection(&sockfd, &res, argv[1], argv[2]);
+  // ACK mode: a retransmission deadline per unacked page
+  bool *ack_array;
+  struct timer *page_timers;
+  int in_flight;
+  int acked;
+  // RFC 6298 estimator fed by the ack RTT samples
+  double srtt_ms;
+  double rttvar_ms;
+  int rto_ms;
 
-  set_socket_buffers(sockfd);
-  load_file(&file_info, argv[3], &file_buffer);
+  // multicast: res is the group, the receivers answer from their own address
+  struct receiver *receivers;
+  int nreceivers;
+  int done_receivers;
+  // receivers to wait for before the upload is done
+  int expected;
+};
 
-  calculate_sha256(file_buffer, file_info.size, file_info.sha256_hash);
-  printHex(file_info.sha256_hash);
+static struct timer_wheel wheel;
+static int epfd;
+static int active_uploads;
 
-  printf("Sending file %s, size %d bytes, %d pages\n", file_info.name,
-         file_info.size, file_info.npages);
+static uint64_t now_ms(void) { return metrics_now_us() / 1000; }
 
-  /*
-   * INIT TRANSMISSION
-   */
-  clock_t begin = clock();
+/*
+ * Whether a send error is fatal. ECONNREFUSED is the ICMP error of an
+ * earlier datagram, usually the server exiting right after its EOT. A full
+ * socket buffer loses the page just like the network would.
+ */
+static bool send_error(ssize_t sent) {
+  return sent == -1 && errno != ECONNREFUSED && errno != EAGAIN &&
+         errno != EWOULDBLOCK && errno != ENOBUFS;
+}
+
+static bool buffer_full(ssize_t sent) {
+  return sent == -1 &&
+         (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS);
+}
+
+/*
+ * Sends the parity pages of @param group right after its last data page.
+ * Returns -1 if the socket buffer filled up.
+ */
+int send_parity(int sockfd, const struct sockaddr *dest, socklen_t dest_len,
+                struct file_metadata *file_info, struct page_store *store,
+                int group) {
+  int m = file_info->fec_parity_pages;
+  size_t page_size = file_info->page_size;
+
+  for (int j = 0; j < m; j++) {
+    int pagenumber = file_info->npages + group * m + j;
+    const char *data =
+        store->parity_buffer + (size_t)(group * m + j) * page_size;
+    size_t len = page_size;
+    if (store->sealed != NULL) {
+      data = store->sealed + (size_t)pagenumber * (page_size + AEAD_TAG_SIZE);
+      len += AEAD_TAG_SIZE;
+    }
+    ssize_t sent = send_page_data(sockfd, dest, dest_len, pagenumber,
+                                  CODEC_RAW, data, len);
+    if (send_error(sent)) {
+      perror("Error sending parity page");
+      exit(EXIT_FAILURE);
+    }
+    if (buffer_full(sent)) {
+      return -1;
+    }
+    metrics_inc(METRIC_PARITY_PAGES_SENT);
+    metrics_add(METRIC_BYTES_SENT, PAGE_HEADER_SIZE + len);
+  }
+  return 0;
+}
+
+/*
+ * Sends a single data page.
+ * Returns -1 if the socket buffer filled up.
+ */
+int send_page(int sockfd, const struct sockaddr *dest, socklen_t dest_len,
+              struct file_metadata *file_info, struct page_store *store,
+              int pagenumber) {
+  size_t page_size = file_info->page_size;
+  size_t offset = (size_t)pagenumber * page_size;
+  const char *data = store->file_buffer + offset;
+  size_t len = page_size;
+  int codec = CODEC_RAW;
+  uint64_t start = metrics_now_us();
+
+  if (store->compressed != NULL) {
+    data = store->compressed + offset;
+    len = store->lengths[pagenumber];
+    codec = store->codecs[pagenumber];
+  }
+  if (store->sealed != NULL) {
+    data = store->sealed + (size_t)pagenumber * (page_size + AEAD_TAG_SIZE);
+    len += AEAD_TAG_SIZE;
+  }
+  ssize_t sent =
+      send_page_data(sockfd, dest, dest_len, pagenumber, codec, data, len);
+
+  if (send_error(sent)) {
+    perror("Error sending file page");
+    exit(EXIT_FAILURE);
+  }
+
+  uint64_t now = metrics_now_us();
+  metrics_record(HISTOGRAM_SEND_US, now - start);
+  metrics_inc(METRIC_SOCKET_WRITES);
+  metrics_inc(METRIC_PAGES_SENT);
+  if (sent > 0) {
+    metrics_add(METRIC_BYTES_SENT, sent);
+  }
+  if (store->send_count[pagenumber] > 0) {
+    metrics_inc(METRIC_PAGES_RETRANSMITTED);
+  }
+  if (store->send_count[pagenumber] < UCHAR_MAX) {
+    store->send_count[pagenumber]++;
+  }
+  store->sent_at[pagenumber] = now;
+  return buffer_full(sent) ? -1 : 0;
+}
+
+/*
+ * Allocates the per page send bookkeeping once the page count is final
+ */
+void init_send_state(struct page_store *store, int npages) {
+  store->send_count = calloc(npages + 1, sizeof(unsigned char));
+  store->sent_at = calloc(npages + 1, sizeof(uint64_t));
+  if (store->send_count == NULL || store->sent_at == NULL) {
+    perror("malloc");
+    exit(EXIT_FAILURE);
+  }
+}
+
+/*
+ * The receiver at @param addr, NULL if it never joined
+ */
+static struct receiver *find_receiver(struct upload *upload,
+                                      const struct sockaddr_storage *addr,
+                                      socklen_t addr_len) {
+  for (int i = 0; i < upload->nreceivers; i++) {
+    struct receiver *receiver = &upload->receivers[i];
+    if (receiver->addr_len == addr_len &&
+        memcmp(&receiver->addr, addr, addr_len) == 0) {
+      return receiver;
+    }
+  }
+  return NULL;
+}
 
-  send_file_metadata(sockfd, &file_info, 0, res->ai_addr, res->ai_addrlen);
+/*
+ * Whether @param reply accepts the file we announced
+ */
+static bool valid_join(const struct upload *upload, const char *reply,
+                       size_t len) {
+  const struct handshake_reply *join = (const struct handshake_reply *)reply;
+  return len == sizeof(struct handshake_reply) &&
+         join->response.ack == ACK && join->response.pagenumber == -1 &&
+         join->metadata.reliability == RELIABILITY_MULTICAST &&
+         join->metadata.npages == upload->file_info.npages &&
+         memcmp(join->metadata.name, upload->file_info.name,
+                FILENAME_SIZE) == 0;
+}
+
+/*
+ * Adds the receiver at @param addr once it answered the announcement.
+ * Returns NULL when there is no room for another one.
+ */
+static struct receiver *add_receiver(struct upload *upload,
+                                     const struct sockaddr_storage *addr,
+                                     socklen_t addr_len) {
+  struct receiver *receiver = find_receiver(upload, addr, addr_len);
+  if (receiver != NULL || upload->nreceivers == MCAST_MAX_RECEIVERS) {
+    return receiver;
+  }
+  receiver = &upload->receivers[upload->nreceivers++];
+  memcpy(&receiver->addr, addr, addr_len);
+  receiver->addr_len = addr_len;
+  receiver->done = false;
+  return receiver;
+}
 
-  ack_array = malloc(file_info.npages * sizeof(bool));
-  if (ack_array == NULL) {
+/*
+ * Multicast: every receiver has a path of its own, so pages stay within an
+ * Ethernet MTU instead of probing one, and the socket is left unconnected
+ * to hear from all of them
+ */
+static void setup_multicast(struct upload *upload, int max_mtu) {
+  struct sockaddr_in *group = (struct sockaddr_in *)upload->res->ai_addr;
+  if (!IN_MULTICAST(ntohl(group->sin_addr.s_addr))) {
+    fprintf(stderr, "%s is not a multicast group\n", upload->hostname);
+    exit(EXIT_FAILURE);
+  }
+  int ttl = MCAST_TTL;
+  if (setsockopt(upload->sockfd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl,
+                 sizeof(ttl)) == -1) {
+    perror("setsockopt IP_MULTICAST_TTL");
+  }
+  upload->file_info.page_size =
+      MTU_TO_PAGE_SIZE(max_mtu < MTU_SIZE ? max_mtu : MTU_SIZE);
+
+  upload->receivers = calloc(MCAST_MAX_RECEIVERS, sizeof(struct receiver));
+  if (upload->receivers == NULL) {
     perror("malloc");
     exit(EXIT_FAILURE);
   }
-  memset(ack_array, 0, file_info.npages * sizeof(bool));
+}
+
+/*
+ * Multicast handshake: announces the file to the group and collects the
+ * receivers that join, until the expected number did or MAX_RETRIES
+ * announcements go unanswered. Receivers that miss it join later, when the
+ * announcement is repeated at the end of the upload.
+ */
+static void announce(struct upload *upload) {
+  int retries = 0;
+  while (retries < MAX_RETRIES && upload->nreceivers < upload->expected) {
+    if (sendto(upload->sockfd, &upload->file_info,
+               sizeof(struct file_metadata), 0, upload->res->ai_addr,
+               upload->res->ai_addrlen) == -1) {
+      perror("Error sending file metadata");
+      exit(EXIT_FAILURE);
+    }
+
+    while (upload->nreceivers < upload->expected) {
+      fd_set readfds;
+      FD_ZERO(&readfds);
+      FD_SET(upload->sockfd, &readfds);
+      struct timeval timeout = {TIMEOUT_SEC, TIMEOUT_USEC};
+
+      int retval = select(upload->sockfd + 1, &readfds, NULL, NULL, &timeout);
+      if (retval == -1) {
+        perror("select");
+        exit(EXIT_FAILURE);
+      } else if (retval == 0) {
+        retries++;
+        break;
+      }
+
+      struct handshake_reply reply;
+      struct sockaddr_storage addr;
+      socklen_t addr_len = sizeof(addr);
+      ssize_t numbytes = recvfrom(upload->sockfd, &reply, sizeof(reply), 0,
+                                  (struct sockaddr *)&addr, &addr_len);
+      if (numbytes > 0 && valid_join(upload, (char *)&reply, numbytes)) {
+        add_receiver(upload, &addr, addr_len);
+      }
+    }
+  }
+
+  printf("%d of %d receivers joined\n", upload->nreceivers, upload->expected);
+  if (upload->nreceivers == 0) {
+    fprintf(stderr, "No receivers in %s:%s\n", upload->hostname,
+            upload->port);
+    exit(EXIT_FAILURE);
+  }
+}
+
+/*
+ * Everything before the first page: path MTU, loading the file, the delta,
+ * parity, compression and the handshake. Runs one upload at a time, the
+ * pages of all of them are then sent together.
+ */
+void prepare_upload(struct upload *upload, int max_mtu, int nthreads,
+                    bool delta, const unsigned char *psk, int psk_len) {
+  struct file_metadata *file_info = &upload->file_info;
+  struct page_store *store = &upload->store;
+
+  init_connection(&upload->sockfd, &upload->res, upload->hostname,
+                  upload->port);
+
+  set_socket_buffers(upload->sockfd);
+  if (file_info->reliability == RELIABILITY_MULTICAST) {
+    setup_multicast(upload, max_mtu);
+  } else {
+    file_info->page_size =
+        discover_page_size(upload->sockfd, upload->res, max_mtu);
+    if (file_info->page_size == -1) {
+      exit(EXIT_FAILURE);
+    }
+  }
+  // the tag of a sealed page has to fit in the datagram too
+  if (file_info->cipher != CIPHER_NONE) {
+    file_info->page_size -= AEAD_TAG_SIZE;
+  }
+  load_file(file_info, upload->filename, &upload->file_buffer);
 
-  send_file(sockfd, res, file_buffer, ack_array, file_info.npages);
+  calculate_sha256(upload->file_buffer, file_info->size,
+                   file_info->sha256_hash);
+  printHex(file_info->sha256_hash);
+
+  // pages carry either the file or its delta against the server's copy
+  store->file_buffer = upload->file_buffer;
+  if (delta) {
+    upload->delta_buffer = build_delta(upload->sockfd, upload->res, file_info,
+                                       upload->file_buffer);
+    if (upload->delta_buffer != NULL) {
+      paginate(file_info, &upload->delta_buffer);
+      store->file_buffer = upload->delta_buffer;
+    }
+  }
+
+  printf("Sending file %s to %s:%s, size %d bytes, %d pages of %d bytes\n",
+         file_info->name, upload->hostname, upload->port, file_info->size,
+         file_info->npages, file_info->page_size);
 
   /*
-   *Finished transmission
+   * INIT TRANSMISSION
    */
-  clock_t end = clock();
-  double time_spent = (double)(end - begin) / CLOCKS_PER_SEC;
+  clock_gettime(CLOCK_MONOTONIC, &upload->begin);
 
-  printf("Tiempo transcurrido por conexión: %f \n", (time_spent * 1000) / 2);
+  // parity and compression are ready before the handshake so the server
+  // never waits on them
+  store->parity_buffer = build_parity(file_info, store->file_buffer);
+  compress_pages(file_info, store, nthreads);
 
-  free(file_buffer);
-  free(ack_array);
-  freeaddrinfo(res);
-  close(sockfd);
+  // a fresh key share per upload, so no two uploads share a key
+  struct key_share share = {NULL, {0}};
+  unsigned char server_public[AEAD_PUBLIC_KEY_SIZE];
+  if (file_info->cipher != CIPHER_NONE) {
+    if (key_share_generate(&share) == -1) {
+      exit(EXIT_FAILURE);
+    }
+    memcpy(file_info->public_key, share.public_key, AEAD_PUBLIC_KEY_SIZE);
+  }
 
-  return 0;
+  int requested_page_size = file_info->page_size;
+  int requested_transfer = file_info->transfer;
+  int requested_cipher = file_info->cipher;
+  if (file_info->reliability == RELIABILITY_MULTICAST) {
+    announce(upload);
+  } else if (send_file_metadata(upload->sockfd, file_info, 0,
+                                upload->res->ai_addr, upload->res->ai_addrlen,
+                                server_public) == -1) {
+    fprintf(stderr, "%s:%s turned down %s\n", upload->hostname, upload->port,
+            upload->filename);
+    exit(EXIT_FAILURE);
+  }
+
+  // never fall back to plaintext
+  if (file_info->cipher != requested_cipher) {
+    fprintf(stderr, "Server turned down %s encryption\n",
+            cipher_name(requested_cipher));
+    exit(EXIT_FAILURE);
+  }
+  unsigned char key[AEAD_KEY_SIZE];
+  if (file_info->cipher != CIPHER_NONE &&
+      aead_derive_key(&share, server_public, share.public_key, server_public,
+                      psk, psk_len, key) == -1) {
+    fprintf(stderr, "Invalid key share from server\n");
+    exit(EXIT_FAILURE);
+  }
+  key_share_free(&share);
+
+  bool repaginate = false;
+
+  // the server lost its copy in the meantime: send the whole file
+  if (file_info->transfer != requested_transfer) {
+    printf("Server turned down the delta\n");
+    file_info->payload_size = file_info->size;
+    repaginate = true;
+  }
+
+  // the server settled on another page size: split the file again
+  if (file_info->page_size != requested_page_size) {
+    printf("Server asked for %d byte pages\n", file_info->page_size);
+    repaginate = true;
+  }
+
+  if (repaginate) {
+    char **payload = (file_info->transfer == TRANSFER_DELTA)
+                         ? &upload->delta_buffer
+                         : &upload->file_buffer;
+    paginate(file_info, payload);
+    store->file_buffer = *payload;
+    free(store->parity_buffer);
+    free_compressed(store);
+    store->parity_buffer = build_parity(file_info, store->file_buffer);
+    compress_pages(file_info, store, nthreads);
+  }
+
+  if (file_info->codec == CODEC_RAW) {
+    free_compressed(store);
+  }
+
+  if (file_info->fec_mode == FEC_NONE) {
+    free(store->parity_buffer);
+    store->parity_buffer = NULL;
+  } else {
+    printf("FEC: %d parity pages every %d pages\n",
+           file_info->fec_parity_pages, file_info->fec_data_pages);
+  }
+
+  if (file_info->cipher != CIPHER_NONE) {
+    seal_pages(file_info, store, key, nthreads);
+    memset(key, 0, sizeof(key));
+  }
+
+  int npages = upload->npages = file_info->npages;
+  init_send_state(store, npages);
+  if (file_info->reliability == RELIABILITY_ACK) {
+    upload->ack_array = calloc(npages + 1, sizeof(bool));
+    upload->page_timers = malloc((npages + 1) * sizeof(struct timer));
+    if (upload->ack_array == NULL || upload->page_timers == NULL) {
+      perror("malloc");
+      exit(EXIT_FAILURE);
+    }
+    for (int p = 0; p < npages; p++) {
+      timer_init(&upload->page_timers[p], upload, p);
+    }
+  }
+  upload->rto_ms = TIMEOUT_MS;
+  upload->state = UPLOAD_SENDING;
+}
+
+void free_upload(struct upload *upload) {
+  free(upload->file_buffer);
+  free(upload->delta_buffer);
+  free(upload->store.parity_buffer);
+  free_compressed(&upload->store);
+  pool_free(upload->store.sealed);
+  free(upload->store.send_count);
+  free(upload->store.sent_at);
+  free(upload->ack_array);
+  free(upload->page_timers);
+  free(upload->receivers);
+  if (upload->res != NULL) {
+    freeaddrinfo(upload->res);
+  }
+  if (upload->sockfd != -1) {
+    close(upload->sockfd);
+  }
+}
+
+static void watch_output(struct upload *upload, bool on) {
+  struct epoll_event event;
+  event.events = EPOLLIN | (on ? EPOLLOUT : 0);
+  event.data.ptr = upload;
+  if (epoll_ctl(epfd, EPOLL_CTL_MOD, upload->sockfd, &event) == -1) {
+    perror("epoll_ctl");
+    exit(EXIT_FAILURE);
+  }
+}
+
+static void finish_upload(struct upload *upload, enum UPLOAD_STATE state) {
+  upload->state = state;
+  active_uploads--;
+  epoll_ctl(epfd, EPOLL_CTL_DEL, upload->sockfd, NULL);
+
+  wheel_cancel(&wheel, &upload->idle_timer);
+  if (upload->page_timers != NULL) {
+    for (int p = 0; p < upload->npages; p++) {
+      wheel_cancel(&wheel, &upload->page_timers[p]);
+    }
+  }
+
+  printf("Upload of %s to %s:%s %s\n", upload->file_info.name,
+         upload->hostname, upload->port,
+         state == UPLOAD_DONE ? "done" : "failed");
+  printf("Tiempo transcurrido por conexión: %f ms\n",
+         elapsed_ms(&upload->begin));
+}
+
+static void blocked(struct upload *upload) {
+  upload->blocked = true;
+  watch_output(upload, true);
+}
+
+/*
+ * Sends the next page for the first time, then the parity of its group
+ * when it is the last page of one
+ */
+static void send_new_page(struct upload *upload) {
+  struct file_metadata *file_info = &upload->file_info;
+  struct page_store *store = &upload->store;
+  int page = upload->next_page++;
+  int full = send_page(upload->sockfd, upload->res->ai_addr,
+                       upload->res->ai_addrlen, file_info, store, page);
+
+  if (file_info->reliability == RELIABILITY_ACK) {
+    upload->in_flight++;
+    wheel_schedule(&wheel, &upload->page_timers[page],
+                   now_ms() + upload->rto_ms);
+  }
+
+  int k = file_info->fec_data_pages;
+  if (store->parity_buffer != NULL &&
+      (page % k == k - 1 || page == upload->npages - 1)) {
+    full |= send_parity(upload->sockfd, upload->res->ai_addr,
+                        upload->res->ai_addrlen, file_info, store, page / k);
+  }
+  if (full) {
+    blocked(upload);
+  }
+}
+
+/*
+ * ACK mode keeps up to BURST_SIZE unacked pages in flight. NACK mode streams,
+ * BURST_SIZE pages per round so the other uploads get their turn.
+ */
+static void fill_window(struct upload *upload) {
+  int limit = BURST_SIZE;
+  if (upload->file_info.reliability == RELIABILITY_ACK) {
+    limit -= upload->in_flight;
+  }
+  for (int i = 0; i < limit && upload->next_page < upload->npages &&
+                  !upload->blocked;
+       i++) {
+    send_new_page(upload);
+  }
+}
+
+static void update_rto(struct upload *upload, double rtt_ms) {
+  if (upload->srtt_ms == 0) {
+    upload->srtt_ms = rtt_ms;
+    upload->rttvar_ms = rtt_ms / 2;
+  } else {
+    double error = upload->srtt_ms - rtt_ms;
+    upload->rttvar_ms =
+        0.75 * upload->rttvar_ms + 0.25 * (error < 0 ? -error : error);
+    upload->srtt_ms = 0.875 * upload->srtt_ms + 0.125 * rtt_ms;
+  }
+
+  double variance = 4 * upload->rttvar_ms;
+  int rto = (int)(upload->srtt_ms + (variance < 1 ? 1 : variance)) + 1;
+  upload->rto_ms = rto < MIN_RTO_MS ? MIN_RTO_MS
+                   : rto > MAX_RTO_MS ? MAX_RTO_MS
+                                      : rto;
+}
+
+static void handle_ack(struct upload *upload, struct response *response) {
+  int page = response->pagenumber;
+  int npages = upload->npages;
+
+  if (page == EOT_PAGE && response->ack == END_OF_TRANSMISSION) {
+    finish_upload(upload, UPLOAD_DONE);
+    return;
+  }
+  if (page < 0 || page >= npages || response->ack != ACK) {
+    return;
+  }
+
+  metrics_inc(METRIC_ACKS_RECEIVED);
+  if (upload->ack_array[page]) {
+    metrics_inc(METRIC_DUPLICATE_ACKS);
+    return;
+  }
+  upload->ack_array[page] = true;
+  upload->acked++;
+  upload->in_flight--;
+  wheel_cancel(&wheel, &upload->page_timers[page]);
+
+  // Karn: an ack for a resent page could belong to any copy
+  if (upload->store.send_count[page] == 1) {
+    uint64_t rtt = metrics_now_us() - upload->store.sent_at[page];
+    metrics_record(HISTOGRAM_ACK_RTT_US, rtt);
+    update_rto(upload, rtt / 1000.0);
+  }
+
+  if (upload->acked == npages) {
+    finish_upload(upload, UPLOAD_DONE);
+  }
+}
+
+static bool valid_nack_report(struct nack_report *report, size_t len) {
+  return len >= offsetof(struct nack_report, gaps) &&
+         report->pagenumber == NACK_PAGE && report->ngaps >= 0 &&
+         report->ngaps <= NACK_MAX_GAPS &&
+         len >= offsetof(struct nack_report, gaps) +
+                    report->ngaps * sizeof(struct gap);
+}
+
+/*
+ * Resends the pages in the gaps of @param report to @param dest.
+ * A multicast sender leaves out the pages it sent a moment ago for another
+ * receiver. Returns the pages resent.
+ */
+static int resend_gaps(struct upload *upload, struct nack_report *report,
+                       const struct sockaddr *dest, socklen_t dest_len) {
+  bool multicast = upload->file_info.reliability == RELIABILITY_MULTICAST;
+  uint64_t now = metrics_now_us();
+  int resent = 0;
+
+  // pages never sent yet are on their way anyway
+  for (int i = 0; i < report->ngaps && !upload->blocked; i++) {
+    struct gap *gap = &report->gaps[i];
+    if (gap->first < 0 || gap->count < 0 ||
+        gap->first > upload->next_page - gap->count) {
+      continue;
+    }
+    for (int p = gap->first; p < gap->first + gap->count; p++) {
+      if (multicast &&
+          now - upload->store.sent_at[p] < MCAST_REPAIR_HOLDOFF_MS * 1000) {
+        continue;
+      }
+      if (send_page(upload->sockfd, dest, dest_len, &upload->file_info,
+                    &upload->store, p) == -1) {
+        blocked(upload);
+        break;
+      }
+      resent++;
+    }
+  }
+  return resent;
+}
+
+static void handle_nack_report(struct upload *upload, char *reply,
+                               size_t len) {
+  struct nack_report *report = (struct nack_report *)reply;
+
+  if (report->pagenumber == EOT_PAGE && report->ack == END_OF_TRANSMISSION) {
+    finish_upload(upload, UPLOAD_DONE);
+    return;
+  }
+  if (!valid_nack_report(report, len)) {
+    return;
+  }
+  metrics_inc(METRIC_NACK_REPORTS_RECEIVED);
+  resend_gaps(upload, report, upload->res->ai_addr, upload->res->ai_addrlen);
+}
+
+/*
+ * Multicast: tells the group which gaps are about to be repaired (NCF_PAGE),
+ * as many as fit in a page, so the receivers missing the same pages keep
+ * their reports to themselves
+ */
+static void confirm_repairs(struct upload *upload,
+                            struct nack_report *report) {
+  struct nack_report ncf;
+  size_t room = (PAGE_HEADER_SIZE + upload->file_info.page_size -
+                 offsetof(struct nack_report, gaps)) /
+                sizeof(struct gap);
+
+  ncf.pagenumber = NCF_PAGE;
+  ncf.ack = NACK;
+  ncf.ngaps = 0;
+  for (int i = 0; i < report->ngaps && (size_t)ncf.ngaps < room; i++) {
+    ncf.gaps[ncf.ngaps++] = report->gaps[i];
+  }
+  size_t len =
+      offsetof(struct nack_report, gaps) + ncf.ngaps * sizeof(struct gap);
+  if (sendto(upload->sockfd, &ncf, len, 0, upload->res->ai_addr,
+             upload->res->ai_addrlen) > 0) {
+    metrics_add(METRIC_BYTES_SENT, len);
+  }
+}
+
+/*
+ * Multicast: a receiver joined late, finished or reports gaps. While more
+ * than one receiver is still receiving, repairs go to the group after
+ * confirming them; the last one gets its repairs to itself.
+ */
+static void handle_receiver_reply(struct upload *upload, char *reply,
+                                  size_t len, struct sockaddr_storage *addr,
+                                  socklen_t addr_len) {
+  struct nack_report *report = (struct nack_report *)reply;
+  if (valid_join(upload, reply, len)) {
+    add_receiver(upload, addr, addr_len);
+    return;
+  }
+  struct receiver *receiver = find_receiver(upload, addr, addr_len);
+  if (receiver == NULL) {
+    // only an answer to the announcement makes a receiver
+    metrics_inc(METRIC_UNKNOWN_RECEIVER_REPLIES);
+    return;
+  }
+  if (len < sizeof(struct response)) {
+    return;
+  }
+
+  if (report->pagenumber == EOT_PAGE && report->ack == END_OF_TRANSMISSION) {
+    if (!receiver->done) {
+      receiver->done = true;
+      upload->done_receivers++;
+      printf("%d of %d receivers complete\n", upload->done_receivers,
+             upload->nreceivers);
+    }
+    if (upload->done_receivers == upload->nreceivers &&
+        upload->nreceivers >= upload->expected) {
+      finish_upload(upload, UPLOAD_DONE);
+    }
+    return;
+  }
+  if (receiver->done || !valid_nack_report(report, len)) {
+    return;
+  }
+  metrics_inc(METRIC_NACK_REPORTS_RECEIVED);
+
+  if (upload->nreceivers - upload->done_receivers > 1) {
+    confirm_repairs(upload, report);
+    metrics_add(METRIC_MULTICAST_REPAIRS,
+                resend_gaps(upload, report, upload->res->ai_addr,
+                            upload->res->ai_addrlen));
+  } else {
+    metrics_add(METRIC_UNICAST_REPAIRS,
+                resend_gaps(upload, report, (struct sockaddr *)addr,
+                            addr_len));
+  }
+}
+
+/*
+ * Reads every reply waiting on the socket, REPLY_BATCH per system call
+ */
+static void drain_replies(struct upload *upload) {
+  static char replies[REPLY_BATCH][MTU_SIZE];
+  struct mmsghdr msgs[REPLY_BATCH];
+  struct iovec iovs[REPLY_BATCH];
+  // a multicast upload hears from every receiver on one socket
+  struct sockaddr_storage addrs[REPLY_BATCH];
+
+  memset(msgs, 0, sizeof(msgs));
+  for (int i = 0; i < REPLY_BATCH; i++) {
+    iovs[i].iov_base = replies[i];
+    iovs[i].iov_len = MTU_SIZE;
+    msgs[i].msg_hdr.msg_iov = &iovs[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+
+  while (upload->state == UPLOAD_SENDING) {
+    for (int i = 0; i < REPLY_BATCH; i++) {
+      msgs[i].msg_hdr.msg_name = &addrs[i];
+      msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+    }
+    int n = recvmmsg(upload->sockfd, msgs, REPLY_BATCH, MSG_DONTWAIT, NULL);
+    metrics_inc(METRIC_SOCKET_READS);
+    if (n == -1) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        return;
+      }
+      // see send_error
+      if (errno == ECONNREFUSED || errno == EINTR) {
+        continue;
+      }
+      perror("recvmmsg");
+      exit(EXIT_FAILURE);
+    }
+    upload->idle = 0;
+
+    for (int i = 0; i < n && upload->state == UPLOAD_SENDING; i++) {
+      if (upload->file_info.reliability == RELIABILITY_NACK) {
+        handle_nack_report(upload, replies[i], msgs[i].msg_len);
+      } else if (upload->file_info.reliability == RELIABILITY_MULTICAST) {
+        handle_receiver_reply(upload, replies[i], msgs[i].msg_len, &addrs[i],
+                              msgs[i].msg_hdr.msg_namelen);
+      } else if (msgs[i].msg_len >= sizeof(struct response)) {
+        handle_ack(upload, (struct response *)replies[i]);
+      }
+    }
+  }
+}
+
+static void on_timer(struct timer *timer) {
+  struct upload *upload = timer->owner;
+  struct file_metadata *file_info = &upload->file_info;
+
+  if (timer->id == IDLE_TIMER) {
+    // while streaming a NACK mode server only reports now and then
+    bool waiting = file_info->reliability == RELIABILITY_ACK ||
+                   upload->next_page == upload->npages;
+    if (!waiting) {
+      upload->idle = 0;
+    } else if (++upload->idle >= IDLE_TIMEOUTS) {
+      if (file_info->reliability == RELIABILITY_MULTICAST) {
+        fprintf(stderr, "%d of %d receivers in %s:%s complete, giving up\n",
+                upload->done_receivers,
+                upload->nreceivers > upload->expected ? upload->nreceivers
+                                                      : upload->expected,
+                upload->hostname, upload->port);
+      } else {
+        fprintf(stderr, "No reply from %s:%s, giving up\n", upload->hostname,
+                upload->port);
+      }
+      finish_upload(upload, UPLOAD_FAILED);
+      return;
+    } else if (file_info->reliability == RELIABILITY_NACK) {
+      metrics_inc(METRIC_SELECT_TIMEOUTS);
+      // in case the completion report got lost, poke the server
+      struct response probe = {NACK_PAGE, NACK};
+      sendto(upload->sockfd, &probe, sizeof(probe), 0,
+             upload->res->ai_addr, upload->res->ai_addrlen);
+    } else if (file_info->reliability == RELIABILITY_MULTICAST) {
+      metrics_inc(METRIC_SELECT_TIMEOUTS);
+      // the announcement again: receivers report their gaps or completion,
+      // and receivers that missed it join now
+      sendto(upload->sockfd, file_info, sizeof(struct file_metadata), 0,
+             upload->res->ai_addr, upload->res->ai_addrlen);
+    }
+    wheel_schedule(&wheel, timer, now_ms() + TIMEOUT_MS);
+    return;
+  }
+
+  // ACK mode retransmission, backing off on every copy
+  int page = timer->id;
+  if (send_page(upload->sockfd, upload->res->ai_addr, upload->res->ai_addrlen,
+                file_info, &upload->store, page) == -1) {
+    blocked(upload);
+  }
+  int copies = upload->store.send_count[page];
+  long backoff = (long)upload->rto_ms << (copies < 7 ? copies - 1 : 6);
+  wheel_schedule(&wheel, timer,
+                 now_ms() + (backoff < MAX_RTO_MS ? backoff : MAX_RTO_MS));
+}
+
+/*
+ * Sends the pages of every upload from one thread: the sockets are
+ * non-blocking and watched with epoll, and each deadline (a page to resend,
+ * a server that went quiet) is a timer on the wheel, so the loop only wakes
+ * up when there is something to do.
+ */
+void run_uploads(struct upload *uploads, int nuploads) {
+  epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (epfd == -1) {
+    perror("epoll_create1");
+    exit(EXIT_FAILURE);
+  }
+  wheel_init(&wheel, now_ms());
+
+  for (int i = 0; i < nuploads; i++) {
+    struct upload *upload = &uploads[i];
+    int flags = fcntl(upload->sockfd, F_GETFL);
+    fcntl(upload->sockfd, F_SETFL, flags | O_NONBLOCK);
+
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = upload;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, upload->sockfd, &event) == -1) {
+      perror("epoll_ctl");
+      exit(EXIT_FAILURE);
+    }
+    timer_init(&upload->idle_timer, upload, IDLE_TIMER);
+    wheel_schedule(&wheel, &upload->idle_timer, now_ms() + TIMEOUT_MS);
+    active_uploads++;
+
+    // nothing to send: the server answers the handshake with its EOT
+    if (upload->npages == 0 &&
+        upload->file_info.reliability == RELIABILITY_ACK) {
+      finish_upload(upload, UPLOAD_DONE);
+    }
+  }
+
+  struct epoll_event events[MAX_EVENTS];
+  while (active_uploads > 0) {
+    bool streaming = false;
+    for (int i = 0; i < nuploads; i++) {
+      struct upload *upload = &uploads[i];
+      if (upload->state != UPLOAD_SENDING) {
+        continue;
+      }
+      fill_window(upload);
+      streaming |= upload->file_info.reliability != RELIABILITY_ACK &&
+                   !upload->blocked &&
+                   upload->next_page < upload->npages;
+    }
+
+    int timeout = streaming ? 0 : (int)wheel_timeout(&wheel);
+    int nevents = epoll_wait(epfd, events, MAX_EVENTS, timeout);
+    if (nevents == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("epoll_wait");
+      exit(EXIT_FAILURE);
+    }
+
+    for (int i = 0; i < nevents; i++) {
+      struct upload *upload = events[i].data.ptr;
+      if (upload->state != UPLOAD_SENDING) {
+        continue;
+      }
+      if ((events[i].events & EPOLLOUT) && upload->blocked) {
+        upload->blocked = false;
+        watch_output(upload, false);
+      }
+      if (events[i].events & (EPOLLIN | EPOLLERR)) {
+        drain_replies(upload);
+      }
+    }
+
+    wheel_advance(&wheel, now_ms(), on_timer);
+  }
+
+  close(epfd);
+}
+
+/*
+ * Write a downloaded file to the working directory, through a temporary
+ * name so a failed write never clobbers an older copy
+ */
+static int save_download(struct file_metadata *file_info, const char *data) {
+  char tmp_name[FILENAME_SIZE + 8];
+  snprintf(tmp_name, sizeof(tmp_name), "%s.part", file_info->name);
+
+  FILE *file = fopen(tmp_name, "w");
+  if (file == NULL) {
+    perror("fopen");
+    return -1;
+  }
+  if ((file_info->size > 0 && fwrite(data, file_info->size, 1, file) != 1) ||
+      fclose(file) != 0 || rename(tmp_name, file_info->name) == -1) {
+    perror("Error saving file");
+    remove(tmp_name);
+    return -1;
+  }
+  printf("Saved as %s\n", file_info->name);
+  return 0;
+}
+
+/*
+ * Receives the pages of a download, acking each one like the server does in
+ * an upload. Returns the pages received.
+ */
+static int receive_download(int sockfd, struct addrinfo *res,
+                            struct file_metadata *file_info, char *file_buf) {
+  int npages = file_info->npages;
+  size_t page_size = file_info->page_size;
+  bool *received = calloc(npages + 1, sizeof(bool));
+  int buf[MAX_DATAGRAM_SIZE / sizeof(int)];
+  struct file_page *page = (struct file_page *)buf;
+  int recvd = 0, idle = 0;
+
+  if (received == NULL) {
+    perror("malloc");
+    exit(EXIT_FAILURE);
+  }
+
+  while (recvd < npages && idle < IDLE_TIMEOUTS) {
+    fd_set readfds;
+    FD_ZERO(&readfds);
+    FD_SET(sockfd, &readfds);
+    struct timeval timeout = {TIMEOUT_SEC, TIMEOUT_USEC};
+
+    int retval = select(sockfd + 1, &readfds, NULL, NULL, &timeout);
+    if (retval == -1) {
+      perror("select");
+      exit(EXIT_FAILURE);
+    } else if (retval == 0) {
+      metrics_inc(METRIC_SELECT_TIMEOUTS);
+      idle++;
+      continue;
+    }
+
+    ssize_t numbytes = recvfrom(sockfd, buf, sizeof(buf), 0, NULL, NULL);
+    metrics_inc(METRIC_SOCKET_READS);
+    if (numbytes < (ssize_t)PAGE_HEADER_SIZE) {
+      continue;
+    }
+    idle = 0;
+
+    int p = page->pagenumber;
+    if (p < 0 || p >= npages || page->codec != CODEC_RAW ||
+        page->length != page_size ||
+        numbytes != (ssize_t)(PAGE_HEADER_SIZE + page_size)) {
+      metrics_inc(METRIC_CORRUPT_PAGES);
+      continue;
+    }
+    metrics_inc(METRIC_PAGES_RECEIVED);
+    metrics_add(METRIC_BYTES_RECEIVED, numbytes);
+
+    // the ack may have been lost: ack every copy
+    struct response ack = {p, ACK};
+    if (sendto(sockfd, &ack, sizeof(ack), 0, res->ai_addr,
+               res->ai_addrlen) == -1) {
+      perror("sendto");
+    }
+    metrics_inc(METRIC_ACKS_SENT);
+
+    if (received[p]) {
+      metrics_inc(METRIC_DUPLICATE_PAGES);
+      continue;
+    }
+    received[p] = true;
+    memcpy(file_buf + (size_t)p * page_size, page->data, page_size);
+    recvd++;
+  }
+
+  free(received);
+  return recvd;
+}
+
+/*
+ * The server stops resending once it has our EOT: repeat it while pages
+ * whose ack got lost keep coming
+ */
+static void end_download(int sockfd, struct addrinfo *res) {
+  int buf[MAX_DATAGRAM_SIZE / sizeof(int)];
+  struct response eot = {EOT_PAGE, END_OF_TRANSMISSION};
+  int idle = 0;
+  while (idle < MAX_RETRIES) {
+    if (sendto(sockfd, &eot, sizeof(eot), 0, res->ai_addr,
+               res->ai_addrlen) == -1) {
+      perror("sendto");
+    }
+
+    fd_set readfds;
+    FD_ZERO(&readfds);
+    FD_SET(sockfd, &readfds);
+    struct timeval timeout = {TIMEOUT_SEC, TIMEOUT_USEC};
+
+    if (select(sockfd + 1, &readfds, NULL, NULL, &timeout) <= 0) {
+      idle++;
+    } else if (recvfrom(sockfd, buf, sizeof(buf), 0, NULL, NULL) == -1) {
+      break;
+    }
+  }
+}
+
+/*
+ * Download mode: asks the server for its copy of @param filename and saves
+ * it in the working directory.
+ * Returns -1 if the server does not have it or the copy is not intact.
+ */
+int download_file(const char *hostname, const char *port,
+                  const char *filename, int max_mtu) {
+  struct file_metadata file_info;
+  unsigned char server_public[AEAD_PUBLIC_KEY_SIZE];
+  struct addrinfo *res;
+  struct timespec begin;
+  // until the last page arrived, without the EOT at the end
+  double elapsed = -1;
+  int sockfd = -1;
+  int result = -1;
+
+  memset(&file_info, 0, sizeof(struct file_metadata));
+  file_info.pagenumber = METADATA_PAGE;
+  file_info.request = REQUEST_DOWNLOAD;
+  const char *short_filename = strrchr(filename, '/');
+  short_filename = (short_filename == NULL) ? filename : short_filename + 1;
+  strncpy(file_info.name, short_filename, FILENAME_SIZE - 1);
+
+  init_connection(&sockfd, &res, hostname, port);
+  set_socket_buffers(sockfd);
+  file_info.page_size = discover_page_size(sockfd, res, max_mtu);
+  if (file_info.page_size == -1) {
+    freeaddrinfo(res);
+    close(sockfd);
+    return -1;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &begin);
+
+  if (send_file_metadata(sockfd, &file_info, 0, res->ai_addr,
+                         res->ai_addrlen, server_public) == -1) {
+    if (file_info.cipher != CIPHER_NONE) {
+      fprintf(stderr, "%s:%s has a pre-shared key and refuses downloads\n",
+              hostname, port);
+    } else {
+      fprintf(stderr, "%s:%s does not have %s\n", hostname, port,
+              file_info.name);
+    }
+  } else if (file_info.page_size < MIN_PAGE_SIZE ||
+             file_info.page_size > MAX_PAGE_SIZE ||
+             file_info.npages != (file_info.size + file_info.page_size - 1) /
+                                     file_info.page_size) {
+    fprintf(stderr, "Invalid download metadata from %s:%s\n", hostname,
+            port);
+  } else {
+    printf("Receiving file %s from %s:%s, size %u bytes, %d pages of %d "
+           "bytes\n",
+           file_info.name, hostname, port, file_info.size, file_info.npages,
+           file_info.page_size);
+    char *file_buf = malloc((size_t)file_info.npages * file_info.page_size + 1);
+    if (file_buf == NULL) {
+      perror("malloc");
+      exit(EXIT_FAILURE);
+    }
+
+    if (receive_download(sockfd, res, &file_info, file_buf) <
+        (int)file_info.npages) {
+      fprintf(stderr, "No pages from %s:%s, giving up\n", hostname, port);
+    } else {
+      elapsed = elapsed_ms(&begin);
+      end_download(sockfd, res);
+      unsigned char hash[HASH_SIZE];
+      calculate_sha256(file_buf, file_info.size, hash);
+      compareHash(hash, file_info.sha256_hash);
+      if (memcmp(hash, file_info.sha256_hash, HASH_SIZE) == 0 &&
+          save_download(&file_info, file_buf) == 0) {
+        result = 0;
+      }
+    }
+    free(file_buf);
+  }
+
+  printf("Download of %s from %s:%s %s\n", file_info.name, hostname, port,
+         result == 0 ? "done" : "failed");
+  printf("Tiempo transcurrido por conexión: %f ms\n",
+         elapsed >= 0 ? elapsed : elapsed_ms(&begin));
+  freeaddrinfo(res);
+  close(sockfd);
+  return result;
+}
+
+void usage(const char *program) {
+  fprintf(stderr,
+          "Usage: %s [-n] [-d] [-m mtu] [-f data:parity] [-c codec] "
+          "[-j threads] [-e cipher] [-k keyfile] [-g receivers] [-r] "
+          "hostname port file [hostname port file ...]\n",
+          program);
+  exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+
+  // options shared by every upload
+  struct file_metadata file_info;
+  memset(&file_info, 0, sizeof(struct file_metadata));
+  file_info.pagenumber = METADATA_PAGE;
+
+  // largest MTU worth probing for
+  int max_mtu = JUMBO_MTU_SIZE;
+  int nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+  int codec;
+  bool delta = false;
+  int cipher;
+  unsigned char psk[AEAD_MAX_PSK_SIZE];
+  int psk_len = 0;
+  int receivers = 0;
+  bool download = false;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "f:nm:c:j:de:k:g:r")) != -1) {
+    switch (opt) {
+    case 'f':
+      parse_fec(&file_info, optarg);
+      break;
+    case 'n':
+      file_info.reliability = RELIABILITY_NACK;
+      break;
+    case 'm':
+      max_mtu = atoi(optarg);
+      if (max_mtu < MIN_MTU_SIZE || max_mtu > JUMBO_MTU_SIZE) {
+        fprintf(stderr, "MTU must be between %d and %d\n", MIN_MTU_SIZE,
+                JUMBO_MTU_SIZE);
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case 'c':
+      codec = codec_from_name(optarg);
+      if (codec == -1) {
+        fprintf(stderr, "Unknown codec %s\n", optarg);
+        exit(EXIT_FAILURE);
+      }
+      file_info.codec = codec;
+      break;
+    case 'j':
+      nthreads = atoi(optarg);
+      break;
+    case 'd':
+      delta = true;
+      break;
+    case 'e':
+      cipher = cipher_from_name(optarg);
+      if (cipher == -1) {
+        fprintf(stderr, "Unknown cipher %s\n", optarg);
+        exit(EXIT_FAILURE);
+      }
+      file_info.cipher = cipher;
+      break;
+    case 'k':
+      psk_len = aead_load_psk(optarg, psk);
+      if (psk_len == -1) {
+        fprintf(stderr, "Could not read a key from %s\n", optarg);
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case 'r':
+      download = true;
+      break;
+    case 'g':
+      receivers = atoi(optarg);
+      if (receivers < 1 || receivers > MCAST_MAX_RECEIVERS) {
+        fprintf(stderr, "Receivers must be between 1 and %d\n",
+                MCAST_MAX_RECEIVERS);
+        exit(EXIT_FAILURE);
+      }
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+
+  if (argc - optind < 3 || (argc - optind) % 3 != 0) {
+    usage(argv[0]);
+  }
+  // a pre-shared key is only good for encrypting
+  if (psk_len > 0 && file_info.cipher == CIPHER_NONE) {
+    file_info.cipher = CIPHER_AES_GCM;
+  }
+  // the same pages go to every receiver: no per receiver key or base file
+  if (receivers > 0) {
+    if (file_info.cipher != CIPHER_NONE || delta) {
+      fprintf(stderr, "Multicast uploads cannot be encrypted or deltas\n");
+      exit(EXIT_FAILURE);
+    }
+    file_info.reliability = RELIABILITY_MULTICAST;
+  }
+
+  fec_init();
+  metrics_init("udpclient");
+
+  // the server sends its copy as it is, one file after another
+  if (download) {
+    if (file_info.cipher != CIPHER_NONE) {
+      fprintf(stderr, "Downloads are not encrypted, -e and -k do not apply\n");
+      exit(EXIT_FAILURE);
+    }
+    if (delta ||
+        file_info.fec_mode != FEC_NONE || file_info.codec != CODEC_RAW ||
+        file_info.reliability != RELIABILITY_ACK) {
+      fprintf(stderr, "Downloads only take -m\n");
+      exit(EXIT_FAILURE);
+    }
+    int failed = 0;
+    for (int i = optind; i < argc; i += 3) {
+      failed += download_file(argv[i], argv[i + 1], argv[i + 2], max_mtu) ==
+                -1;
+    }
+    return failed ? EXIT_FAILURE : 0;
+  }
+
+  int nuploads = (argc - optind) / 3;
+  struct upload *uploads = calloc(nuploads, sizeof(struct upload));
+  if (uploads == NULL) {
+    perror("malloc");
+    exit(EXIT_FAILURE);
+  }
+
+  for (int i = 0; i < nuploads; i++) {
+    char **args = argv + optind + 3 * i;
+    uploads[i].hostname = args[0];
+    uploads[i].port = args[1];
+    uploads[i].filename = args[2];
+    uploads[i].sockfd = -1;
+    uploads[i].file_info = file_info;
+    uploads[i].expected = receivers;
+    prepare_upload(&uploads[i], max_mtu, nthreads, delta, psk, psk_len);
+  }
+
+  run_uploads(uploads, nuploads);
+
+  /*
+   *Finished transmission
+   */
+  int failed = 0;
+  for (int i = 0; i < nuploads; i++) {
+    failed += uploads[i].state != UPLOAD_DONE;
+    free_upload(&uploads[i]);
+  }
+  free(uploads);
+
+  return failed ? EXIT_FAILURE : 0;
 }
@@ -0,0 +1,146 @@
+#include "../include/compress.h"
+#include "../include/metrics.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <zlib.h>
+
+struct compress_job {
+  int codec;
+  const char *src;
+  size_t src_len;
+  size_t block_size;
+  char *dst;
+  unsigned int *lengths;
+  unsigned char *codecs;
+  int first;
+  int stride;
+};
+
+int codec_supported(int codec) {
+  return codec == CODEC_RAW || codec == CODEC_DEFLATE;
+}
+
+int codec_from_name(const char *name) {
+  if (strcasecmp(name, "raw") == 0) {
+    return CODEC_RAW;
+  }
+  if (strcasecmp(name, "deflate") == 0 || strcasecmp(name, "zlib") == 0) {
+    return CODEC_DEFLATE;
+  }
+  return -1;
+}
+
+const char *codec_name(int codec) {
+  switch (codec) {
+  case CODEC_RAW:
+    return "raw";
+  case CODEC_DEFLATE:
+    return "deflate";
+  default:
+    return "unknown";
+  }
+}
+
+/*
+ * Compress a single block, falling back to a raw copy when it does not shrink
+ */
+static void compress_block(int codec, const char *src, size_t len, char *dst,
+                           unsigned int *length, unsigned char *used) {
+  metrics_inc(METRIC_COMPRESSED_BLOCKS);
+  metrics_add(METRIC_COMPRESS_IN_BYTES, len);
+  if (codec == CODEC_DEFLATE && len > 1) {
+    uLongf dst_len = len - 1;
+    if (compress2((Bytef *)dst, &dst_len, (const Bytef *)src, len,
+                  Z_BEST_SPEED) == Z_OK) {
+      *length = dst_len;
+      *used = CODEC_DEFLATE;
+      metrics_add(METRIC_COMPRESS_OUT_BYTES, dst_len);
+      return;
+    }
+  }
+
+  memcpy(dst, src, len);
+  *length = len;
+  *used = CODEC_RAW;
+  metrics_add(METRIC_COMPRESS_OUT_BYTES, len);
+}
+
+static void *compress_worker(void *arg) {
+  struct compress_job *job = arg;
+  size_t nblocks = (job->src_len + job->block_size - 1) / job->block_size;
+
+  for (size_t i = job->first; i < nblocks; i += job->stride) {
+    size_t offset = i * job->block_size;
+    size_t len = job->src_len - offset;
+    if (len > job->block_size) {
+      len = job->block_size;
+    }
+    compress_block(job->codec, job->src + offset, len, job->dst + offset,
+                   &job->lengths[i], &job->codecs[i]);
+  }
+  return NULL;
+}
+
+void compress_blocks(int codec, const char *src, size_t src_len,
+                     size_t block_size, char *dst, unsigned int *lengths,
+                     unsigned char *codecs, int nthreads) {
+  pthread_t threads[COMPRESS_MAX_THREADS];
+  struct compress_job jobs[COMPRESS_MAX_THREADS];
+
+  if (nthreads < 1) {
+    nthreads = 1;
+  }
+  if (nthreads > COMPRESS_MAX_THREADS) {
+    nthreads = COMPRESS_MAX_THREADS;
+  }
+
+  for (int t = 0; t < nthreads; t++) {
+    jobs[t] = (struct compress_job){codec,   src,    src_len, block_size, dst,
+                                   lengths, codecs, t,       nthreads};
+  }
+
+  // the calling thread takes the first share itself
+  int started = 1;
+  for (int t = 1; t < nthreads; t++) {
+    if (pthread_create(&threads[t], NULL, compress_worker, &jobs[t]) != 0) {
+      perror("pthread_create");
+      break;
+    }
+    started++;
+  }
+  // shares whose thread could not start are done here
+  for (int t = started; t < nthreads; t++) {
+    compress_worker(&jobs[t]);
+  }
+  compress_worker(&jobs[0]);
+
+  for (int t = 1; t < started; t++) {
+    pthread_join(threads[t], NULL);
+  }
+}
+
+long decompress_block(int codec, const char *src, size_t src_len, char *dst,
+                      size_t dst_len) {
+  switch (codec) {
+  case CODEC_RAW:
+    if (src_len > dst_len) {
+      return -1;
+    }
+    memcpy(dst, src, src_len);
+    return src_len;
+  case CODEC_DEFLATE: {
+    uLongf out_len = dst_len;
+    if (uncompress((Bytef *)dst, &out_len, (const Bytef *)src, src_len) !=
+        Z_OK) {
+      return -1;
+    }
+    return out_len;
+  }
+  default:
+    return -1;
+  }
+}
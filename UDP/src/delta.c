@@ -0,0 +1,249 @@
+#include "../include/delta.h"
+#include "../include/library.h"
+
+/*
+ * Output buffer that grows as records are appended
+ */
+struct delta_out {
+  char *data;
+  size_t len;
+  size_t capacity;
+};
+
+static void out_append(struct delta_out *out, const void *data, size_t len) {
+  if (out->len + len > out->capacity) {
+    size_t capacity = out->capacity ? out->capacity : 4096;
+    while (capacity < out->len + len) {
+      capacity *= 2;
+    }
+    char *grown = realloc(out->data, capacity);
+    if (grown == NULL) {
+      perror("realloc");
+      exit(EXIT_FAILURE);
+    }
+    out->data = grown;
+    out->capacity = capacity;
+  }
+  memcpy(out->data + out->len, data, len);
+  out->len += len;
+}
+
+static void emit_literal(struct delta_out *out, const char *data, size_t len) {
+  if (len == 0) {
+    return;
+  }
+  struct delta_record record = {DELTA_LITERAL, 0, len};
+  out_append(out, &record, sizeof(record));
+  out_append(out, data, len);
+}
+
+static void emit_copy(struct delta_out *out, uint32_t index, uint32_t count) {
+  if (count == 0) {
+    return;
+  }
+  struct delta_record record = {DELTA_COPY, index, count};
+  out_append(out, &record, sizeof(record));
+}
+
+/*
+ * rsync checksum: a is the byte sum, b the sum of the running a values
+ */
+uint32_t weak_checksum(const unsigned char *data, size_t len) {
+  uint32_t a = 0, b = 0;
+  for (size_t i = 0; i < len; i++) {
+    a += data[i];
+    b += (len - i) * data[i];
+  }
+  return (a & 0xffff) | (b << 16);
+}
+
+static void strong_checksum(const char *data, size_t len,
+                            unsigned char *strong) {
+  unsigned char hash[HASH_SIZE];
+  calculate_sha256((const unsigned char *)data, len, hash);
+  memcpy(strong, hash, DELTA_STRONG_SIZE);
+}
+
+size_t delta_nblocks(size_t size, size_t block_size) {
+  return (size + block_size - 1) / block_size;
+}
+
+void compute_signatures(const char *data, size_t size, size_t block_size,
+                        struct block_signature *sigs) {
+  size_t nblocks = delta_nblocks(size, block_size);
+  for (size_t i = 0; i < nblocks; i++) {
+    size_t len = size - i * block_size;
+    if (len > block_size) {
+      len = block_size;
+    }
+    const char *block = data + i * block_size;
+    sigs[i].weak = weak_checksum((const unsigned char *)block, len);
+    strong_checksum(block, len, sigs[i].strong);
+  }
+}
+
+size_t delta_encode(const char *data, size_t size,
+                    const struct block_signature *sigs, size_t nblocks,
+                    size_t block_size, size_t old_size, char **out_data) {
+  struct delta_out out = {NULL, 0, 0};
+
+  // only whole blocks can be matched
+  size_t full_blocks = old_size / block_size;
+  if (full_blocks > nblocks) {
+    full_blocks = nblocks;
+  }
+
+  // weak checksum -> block chains
+  size_t table_size = 1;
+  while (table_size < 2 * full_blocks) {
+    table_size <<= 1;
+  }
+  long *head = malloc(table_size * sizeof(long));
+  long *next = malloc((full_blocks + 1) * sizeof(long));
+  if (head == NULL || next == NULL) {
+    perror("malloc");
+    exit(EXIT_FAILURE);
+  }
+  for (size_t i = 0; i < table_size; i++) {
+    head[i] = -1;
+  }
+  for (size_t i = 0; i < full_blocks; i++) {
+    size_t slot = sigs[i].weak & (table_size - 1);
+    next[i] = head[slot];
+    head[slot] = i;
+  }
+
+  const unsigned char *bytes = (const unsigned char *)data;
+  size_t pos = 0, literal_start = 0;
+  uint32_t copy_index = 0, copy_count = 0;
+  uint32_t a = 0, b = 0;
+  bool have_sum = false;
+
+  while (full_blocks > 0 && pos + block_size <= size) {
+    if (!have_sum) {
+      uint32_t sum = weak_checksum(bytes + pos, block_size);
+      a = sum & 0xffff;
+      b = sum >> 16;
+      have_sum = true;
+    }
+
+    uint32_t weak = (a & 0xffff) | (b << 16);
+    long match = -1;
+    bool strong_done = false;
+    unsigned char strong[DELTA_STRONG_SIZE];
+
+    for (long i = head[weak & (table_size - 1)]; i != -1; i = next[i]) {
+      if (sigs[i].weak != weak) {
+        continue;
+      }
+      if (!strong_done) {
+        strong_checksum(data + pos, block_size, strong);
+        strong_done = true;
+      }
+      if (memcmp(strong, sigs[i].strong, DELTA_STRONG_SIZE) == 0) {
+        match = i;
+        break;
+      }
+    }
+
+    if (match != -1) {
+      emit_literal(&out, data + literal_start, pos - literal_start);
+      // runs of consecutive blocks become a single record
+      if (copy_count > 0 && literal_start == pos &&
+          (uint32_t)match == copy_index + copy_count) {
+        copy_count++;
+      } else {
+        emit_copy(&out, copy_index, copy_count);
+        copy_index = match;
+        copy_count = 1;
+      }
+      pos += block_size;
+      literal_start = pos;
+      have_sum = false;
+      continue;
+    }
+
+    // a literal is coming, so the pending copy run is over
+    if (copy_count > 0) {
+      emit_copy(&out, copy_index, copy_count);
+      copy_count = 0;
+    }
+
+    // roll the window one byte forward
+    if (pos + block_size < size) {
+      unsigned char old_byte = bytes[pos];
+      unsigned char new_byte = bytes[pos + block_size];
+      a = (a - old_byte + new_byte) & 0xffff;
+      b = (b - block_size * old_byte + a) & 0xffff;
+    }
+    pos++;
+  }
+
+  emit_copy(&out, copy_index, copy_count);
+  emit_literal(&out, data + literal_start, size - literal_start);
+
+  free(head);
+  free(next);
+  *out_data = out.data;
+  return out.len;
+}
+
+int delta_apply(const char *delta, size_t delta_len, const char *old,
+                size_t old_size, size_t block_size, char *out,
+                size_t out_size) {
+  size_t pos = 0, written = 0;
+
+  while (pos < delta_len) {
+    struct delta_record record;
+    if (delta_len - pos < sizeof(record)) {
+      return -1;
+    }
+    memcpy(&record, delta + pos, sizeof(record));
+    pos += sizeof(record);
+
+    if (record.type == DELTA_LITERAL) {
+      if (record.length > delta_len - pos ||
+          record.length > out_size - written) {
+        return -1;
+      }
+      memcpy(out + written, delta + pos, record.length);
+      pos += record.length;
+      written += record.length;
+    } else if (record.type == DELTA_COPY) {
+      size_t offset = (size_t)record.index * block_size;
+      size_t len = (size_t)record.length * block_size;
+      if (offset > old_size || len > old_size - offset ||
+          len > out_size - written) {
+        return -1;
+      }
+      memcpy(out + written, old + offset, len);
+      written += len;
+    } else {
+      return -1;
+    }
+  }
+
+  return (written == out_size) ? 0 : -1;
+}
+
+char *delta_load_base(const char *name, size_t *size) {
+  FILE *file = fopen(name, "r");
+  if (file == NULL) {
+    return NULL;
+  }
+
+  fseek(file, 0, SEEK_END);
+  long len = ftell(file);
+  fseek(file, 0, SEEK_SET);
+
+  char *data = malloc(len > 0 ? len : 1);
+  if (data == NULL || (len > 0 && fread(data, len, 1, file) != 1)) {
+    free(data);
+    fclose(file);
+    return NULL;
+  }
+  fclose(file);
+
+  *size = len;
+  return data;
+}
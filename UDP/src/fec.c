@@ -0,0 +1,314 @@
+#include "../include/fec.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define FEC_HAVE_SSSE3 1
+#endif
+
+/*
+ * GF(2^8) arithmetic, generator polynomial x^8 + x^4 + x^3 + x^2 + 1
+ */
+static unsigned char gf_exp[512];
+static unsigned char gf_log[256];
+
+/*
+ * Per coefficient products split by nibble: c * b == lo[b & 15] ^ hi[b >> 4].
+ * 16 entries per table is exactly what a pshufb lookup needs.
+ */
+static unsigned char gf_nibble_lo[256][16];
+static unsigned char gf_nibble_hi[256][16];
+
+static bool gf_ready = false;
+static bool use_ssse3 = false;
+
+static unsigned char gf_mul(unsigned char a, unsigned char b) {
+  if (a == 0 || b == 0) {
+    return 0;
+  }
+  return gf_exp[gf_log[a] + gf_log[b]];
+}
+
+static unsigned char gf_inv(unsigned char a) { return gf_exp[255 - gf_log[a]]; }
+
+void fec_init(void) {
+  if (gf_ready) {
+    return;
+  }
+
+  int x = 1;
+  for (int i = 0; i < 255; i++) {
+    gf_exp[i] = x;
+    gf_log[x] = i;
+    x <<= 1;
+    if (x & 0x100) {
+      x ^= 0x11d;
+    }
+  }
+  for (int i = 255; i < 512; i++) {
+    gf_exp[i] = gf_exp[i - 255];
+  }
+
+  for (int c = 0; c < 256; c++) {
+    for (int n = 0; n < 16; n++) {
+      gf_nibble_lo[c][n] = gf_mul(c, n);
+      gf_nibble_hi[c][n] = gf_mul(c, n << 4);
+    }
+  }
+
+#ifdef FEC_HAVE_SSSE3
+  use_ssse3 = __builtin_cpu_supports("ssse3");
+#endif
+  gf_ready = true;
+}
+
+/*
+ * Cauchy matrix coefficient for parity row j and data column i.
+ * Rows use x_j = 128 + j and columns y_i = i, so x_j ^ y_i is never zero
+ * and every square submatrix is invertible.
+ */
+static unsigned char cauchy_coef(int j, int i) {
+  return gf_inv((unsigned char)((128 + j) ^ i));
+}
+
+int fec_validate(int mode, int data_pages, int parity_pages) {
+  switch (mode) {
+  case FEC_NONE:
+    return 0;
+  case FEC_XOR:
+    return (data_pages >= 1 && data_pages <= FEC_MAX_DATA_PAGES &&
+            parity_pages == 1)
+               ? 0
+               : -1;
+  case FEC_RS:
+    return (data_pages >= 1 && data_pages <= FEC_MAX_DATA_PAGES &&
+            parity_pages >= 1 && parity_pages <= FEC_MAX_PARITY_PAGES)
+               ? 0
+               : -1;
+  default:
+    return -1;
+  }
+}
+
+int fec_ngroups(int npages, int data_pages) {
+  return (npages + data_pages - 1) / data_pages;
+}
+
+int fec_group_size(int group, int npages, int data_pages) {
+  int remaining = npages - group * data_pages;
+  return (remaining < data_pages) ? remaining : data_pages;
+}
+
+static void xor_region(unsigned char *dst, const unsigned char *src,
+                       size_t len) {
+  size_t i = 0;
+  for (; i + sizeof(uint64_t) <= len; i += sizeof(uint64_t)) {
+    uint64_t a, b;
+    memcpy(&a, dst + i, sizeof(a));
+    memcpy(&b, src + i, sizeof(b));
+    a ^= b;
+    memcpy(dst + i, &a, sizeof(a));
+  }
+  for (; i < len; i++) {
+    dst[i] ^= src[i];
+  }
+}
+
+#ifdef FEC_HAVE_SSSE3
+__attribute__((target("ssse3"))) static size_t
+mul_add_ssse3(unsigned char *dst, const unsigned char *src, unsigned char c,
+              size_t len) {
+  const __m128i tlo = _mm_loadu_si128((const __m128i *)gf_nibble_lo[c]);
+  const __m128i thi = _mm_loadu_si128((const __m128i *)gf_nibble_hi[c]);
+  const __m128i mask = _mm_set1_epi8(0x0f);
+  size_t i = 0;
+
+  for (; i + 16 <= len; i += 16) {
+    __m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+    __m128i lo = _mm_shuffle_epi8(tlo, _mm_and_si128(s, mask));
+    __m128i hi =
+        _mm_shuffle_epi8(thi, _mm_and_si128(_mm_srli_epi64(s, 4), mask));
+    __m128i d = _mm_loadu_si128((const __m128i *)(dst + i));
+    _mm_storeu_si128((__m128i *)(dst + i),
+                     _mm_xor_si128(d, _mm_xor_si128(lo, hi)));
+  }
+  return i;
+}
+#endif
+
+/*
+ * dst ^= c * src over a whole page
+ */
+static void mul_add_region(unsigned char *dst, const unsigned char *src,
+                           unsigned char c, size_t len) {
+  if (c == 0) {
+    return;
+  }
+  if (c == 1) {
+    xor_region(dst, src, len);
+    return;
+  }
+
+  size_t i = 0;
+#ifdef FEC_HAVE_SSSE3
+  if (use_ssse3) {
+    i = mul_add_ssse3(dst, src, c, len);
+  }
+#endif
+  const unsigned char *lo = gf_nibble_lo[c];
+  const unsigned char *hi = gf_nibble_hi[c];
+  for (; i < len; i++) {
+    dst[i] ^= lo[src[i] & 0x0f] ^ hi[src[i] >> 4];
+  }
+}
+
+/*
+ * Build m parity pages out of k data pages
+ */
+void fec_encode(int mode, int k, int m, char *const *data, char **parity,
+                size_t page_size) {
+  for (int j = 0; j < m; j++) {
+    unsigned char *p = (unsigned char *)parity[j];
+    memset(p, 0, page_size);
+    for (int i = 0; i < k; i++) {
+      unsigned char c = (mode == FEC_XOR) ? 1 : cauchy_coef(j, i);
+      mul_add_region(p, (const unsigned char *)data[i], c, page_size);
+    }
+  }
+}
+
+/*
+ * Invert an n x n matrix in place with Gauss-Jordan elimination
+ */
+static int gf_invert_matrix(unsigned char *a, int n) {
+  unsigned char inv[FEC_MAX_PARITY_PAGES * FEC_MAX_PARITY_PAGES];
+  memset(inv, 0, sizeof(inv));
+  for (int i = 0; i < n; i++) {
+    inv[i * n + i] = 1;
+  }
+
+  for (int col = 0; col < n; col++) {
+    int pivot = col;
+    while (pivot < n && a[pivot * n + col] == 0) {
+      pivot++;
+    }
+    if (pivot == n) {
+      return -1;
+    }
+    if (pivot != col) {
+      for (int c = 0; c < n; c++) {
+        unsigned char t = a[col * n + c];
+        a[col * n + c] = a[pivot * n + c];
+        a[pivot * n + c] = t;
+        t = inv[col * n + c];
+        inv[col * n + c] = inv[pivot * n + c];
+        inv[pivot * n + c] = t;
+      }
+    }
+
+    unsigned char scale = gf_inv(a[col * n + col]);
+    for (int c = 0; c < n; c++) {
+      a[col * n + c] = gf_mul(a[col * n + c], scale);
+      inv[col * n + c] = gf_mul(inv[col * n + c], scale);
+    }
+
+    for (int r = 0; r < n; r++) {
+      unsigned char f = a[r * n + col];
+      if (r == col || f == 0) {
+        continue;
+      }
+      for (int c = 0; c < n; c++) {
+        a[r * n + c] ^= gf_mul(f, a[col * n + c]);
+        inv[r * n + c] ^= gf_mul(f, inv[col * n + c]);
+      }
+    }
+  }
+
+  memcpy(a, inv, n * n);
+  return 0;
+}
+
+/*
+ * Rebuild the missing data pages of a group in place.
+ * Returns the number of pages recovered, or -1 if there are not enough
+ * parity pages to do it.
+ */
+int fec_decode(int mode, int k, int m, char **data, const bool *data_present,
+               char *const *parity, const bool *parity_present,
+               size_t page_size) {
+  int missing[FEC_MAX_PARITY_PAGES];
+  int rows[FEC_MAX_PARITY_PAGES];
+  int nmissing = 0, nrows = 0;
+
+  for (int i = 0; i < k; i++) {
+    if (!data_present[i]) {
+      if (nmissing == FEC_MAX_PARITY_PAGES) {
+        return -1;
+      }
+      missing[nmissing++] = i;
+    }
+  }
+  if (nmissing == 0) {
+    return 0;
+  }
+  for (int j = 0; j < m && nrows < nmissing; j++) {
+    if (parity_present[j]) {
+      rows[nrows++] = j;
+    }
+  }
+  if (nrows < nmissing) {
+    return -1;
+  }
+
+  if (mode == FEC_XOR) {
+    unsigned char *dst = (unsigned char *)data[missing[0]];
+    memcpy(dst, parity[rows[0]], page_size);
+    for (int i = 0; i < k; i++) {
+      if (i != missing[0]) {
+        xor_region(dst, (const unsigned char *)data[i], page_size);
+      }
+    }
+    return 1;
+  }
+
+  // rhs_r = parity_r minus the contribution of the pages we do have
+  unsigned char *rhs = malloc(nmissing * page_size);
+  if (rhs == NULL) {
+    return -1;
+  }
+  for (int r = 0; r < nmissing; r++) {
+    unsigned char *dst = rhs + r * page_size;
+    memcpy(dst, parity[rows[r]], page_size);
+    for (int i = 0; i < k; i++) {
+      if (data_present[i]) {
+        mul_add_region(dst, (const unsigned char *)data[i],
+                       cauchy_coef(rows[r], i), page_size);
+      }
+    }
+  }
+
+  unsigned char a[FEC_MAX_PARITY_PAGES * FEC_MAX_PARITY_PAGES];
+  for (int r = 0; r < nmissing; r++) {
+    for (int c = 0; c < nmissing; c++) {
+      a[r * nmissing + c] = cauchy_coef(rows[r], missing[c]);
+    }
+  }
+  if (gf_invert_matrix(a, nmissing) == -1) {
+    free(rhs);
+    return -1;
+  }
+
+  for (int c = 0; c < nmissing; c++) {
+    unsigned char *dst = (unsigned char *)data[missing[c]];
+    memset(dst, 0, page_size);
+    for (int r = 0; r < nmissing; r++) {
+      mul_add_region(dst, rhs + r * page_size, a[c * nmissing + r], page_size);
+    }
+  }
+
+  free(rhs);
+  return nmissing;
+}
@@ -0,0 +1,193 @@
+#define _GNU_SOURCE
+#include "../include/file_cache.h"
+#include "../include/metrics.h"
+
+#include <fcntl.h>
+#include <openssl/evp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static struct cached_file *head;
+static struct cached_file *tail;
+static size_t mapped_bytes;
+static size_t budget = (size_t)FILE_CACHE_DEFAULT_MB << 20;
+
+void file_cache_init(void) {
+  const char *mb = getenv("TRANSFER_CACHE_MB");
+  if (mb != NULL && atol(mb) > 0) {
+    budget = (size_t)atol(mb) << 20;
+  }
+}
+
+static void unlink_file(struct cached_file *file) {
+  if (file->prev != NULL) {
+    file->prev->next = file->next;
+  } else {
+    head = file->next;
+  }
+  if (file->next != NULL) {
+    file->next->prev = file->prev;
+  } else {
+    tail = file->prev;
+  }
+  file->prev = file->next = NULL;
+}
+
+static void push_front(struct cached_file *file) {
+  file->prev = NULL;
+  file->next = head;
+  if (head != NULL) {
+    head->prev = file;
+  } else {
+    tail = file;
+  }
+  head = file;
+}
+
+static void drop(struct cached_file *file) {
+  if (!file->stale) {
+    unlink_file(file);
+  }
+  if (file->data != NULL) {
+    munmap((void *)file->data, file->size);
+  }
+  close(file->fd);
+  mapped_bytes -= file->size;
+  free(file);
+}
+
+/*
+ * Unmaps the least recently used files nobody is sending until the mapped
+ * bytes fit the budget again
+ */
+static void evict(void) {
+  struct cached_file *file = tail;
+  while (mapped_bytes > budget && file != NULL) {
+    struct cached_file *prev = file->prev;
+    if (file->refs == 0) {
+      drop(file);
+      metrics_inc(METRIC_CACHE_EVICTIONS);
+    }
+    file = prev;
+  }
+}
+
+static bool unchanged(const struct cached_file *file, const struct stat *st) {
+  return file->dev == st->st_dev && file->ino == st->st_ino &&
+         file->size == (size_t)st->st_size &&
+         file->mtime.tv_sec == st->st_mtim.tv_sec &&
+         file->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+/*
+ * Maps and hashes @param name. Returns NULL if it cannot be read.
+ */
+static struct cached_file *load(const char *name) {
+  int fd = open(name, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    return NULL;
+  }
+  struct stat st;
+  struct cached_file *file = calloc(1, sizeof(struct cached_file));
+  if (file == NULL || fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+    free(file);
+    close(fd);
+    return NULL;
+  }
+
+  strcpy(file->name, name);
+  file->fd = fd;
+  file->size = st.st_size;
+  file->dev = st.st_dev;
+  file->ino = st.st_ino;
+  file->mtime = st.st_mtim;
+
+  if (file->size > 0) {
+    void *data = mmap(NULL, file->size, PROT_READ, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED) {
+      perror("mmap");
+      free(file);
+      close(fd);
+      return NULL;
+    }
+    // hashing reads all of it right away
+    madvise(data, file->size, MADV_WILLNEED);
+    file->data = data;
+  }
+
+  if (EVP_Digest(file->data != NULL ? file->data : "", file->size,
+                 file->sha256, NULL, EVP_sha256(), NULL) != 1) {
+    fprintf(stderr, "Could not hash %s\n", name);
+    if (file->data != NULL) {
+      munmap((void *)file->data, file->size);
+    }
+    free(file);
+    close(fd);
+    return NULL;
+  }
+  return file;
+}
+
+struct cached_file *file_cache_get(const char *name) {
+  struct stat st;
+  if (strlen(name) >= FILE_CACHE_NAME_SIZE || stat(name, &st) == -1) {
+    return NULL;
+  }
+
+  for (struct cached_file *file = head; file != NULL; file = file->next) {
+    if (strcmp(file->name, name) != 0) {
+      continue;
+    }
+    if (unchanged(file, &st)) {
+      unlink_file(file);
+      push_front(file);
+      file->refs++;
+      metrics_inc(METRIC_CACHE_HITS);
+      return file;
+    }
+    // replaced since: whoever is still sending the old copy keeps it
+    if (file->refs == 0) {
+      drop(file);
+    } else {
+      unlink_file(file);
+      file->stale = true;
+    }
+    break;
+  }
+
+  metrics_inc(METRIC_CACHE_MISSES);
+  struct cached_file *file = load(name);
+  if (file == NULL) {
+    return NULL;
+  }
+  file->refs = 1;
+  push_front(file);
+  mapped_bytes += file->size;
+  evict();
+  return file;
+}
+
+int file_cache_npages(struct cached_file *file, int page_size) {
+  if (file->page_size != page_size) {
+    file->page_size = page_size;
+    file->npages = (file->size + page_size - 1) / page_size;
+  }
+  return file->npages;
+}
+
+void file_cache_release(struct cached_file *file) {
+  if (file == NULL) {
+    return;
+  }
+  file->refs--;
+  if (file->stale && file->refs == 0) {
+    drop(file);
+    return;
+  }
+  // a file bigger than the budget is only kept while it is being sent
+  evict();
+}
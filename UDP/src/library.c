@@ -1,5 +1,7 @@
 #include "../include/library.h"
 
+#include <sys/uio.h>
+
 void printHex(unsigned char *hash) {
   int i;
   printf("Hash: ");
@@ -49,3 +51,43 @@ void compareHash(unsigned char *hash1, unsigned char *hash2) {
   }
   printf("Hashes coinciden\n\n");
 }
+
+/*
+ * Sends a page header and its data as one datagram, straight from
+ * the file buffer without copying it into a page first
+ */
+ssize_t send_page_data(int sockfd, const struct sockaddr *dest_addr,
+                       socklen_t addrlen, int pagenumber, int codec,
+                       const char *data, size_t len) {
+  struct file_page header;
+  header.pagenumber = pagenumber;
+  header.length = len;
+  header.codec = codec;
+
+  struct iovec iov[2];
+  iov[0].iov_base = &header;
+  iov[0].iov_len = PAGE_HEADER_SIZE;
+  iov[1].iov_base = (void *)data;
+  iov[1].iov_len = len;
+
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_name = (void *)dest_addr;
+  msg.msg_namelen = addrlen;
+  msg.msg_iov = iov;
+  msg.msg_iovlen = 2;
+
+  return sendmsg(sockfd, &msg, 0);
+}
+
+double elapsed_ms(const struct timespec *start) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) * 1000.0 +
+         (now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+bool is_metadata(const void *buf, int numbytes) {
+  return numbytes == sizeof(struct file_metadata) &&
+         ((const struct file_metadata *)buf)->pagenumber == METADATA_PAGE;
+}
@@ -0,0 +1,357 @@
+#define _GNU_SOURCE
+#include "../include/metrics.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#include <time.h>
+
+#define SUB_BUCKET_BITS 4
+#define SUB_BUCKETS (1 << SUB_BUCKET_BITS)
+#define HISTOGRAM_BUCKETS ((64 - SUB_BUCKET_BITS + 1) * SUB_BUCKETS)
+
+struct histogram {
+  uint64_t buckets[HISTOGRAM_BUCKETS];
+  uint64_t count;
+  uint64_t sum;
+  uint64_t min;
+  uint64_t max;
+};
+
+/*
+ * Everything one thread recorded. Only its owner writes it.
+ */
+struct shard {
+  uint64_t counters[METRIC_COUNT];
+  struct histogram histograms[HISTOGRAM_COUNT];
+  struct shard *next;
+};
+
+static const char *metric_names[METRIC_COUNT] = {
+    "pages_sent",           "pages_retransmitted",   "parity_pages_sent",
+    "bytes_sent",           "acks_received",         "duplicate_acks",
+    "nack_reports_received", "pages_received",       "duplicate_pages",
+    "corrupt_pages",        "fec_recovered_pages",   "bytes_received",
+    "acks_sent",            "nack_reports_sent",     "select_timeouts",
+    "socket_writes",        "socket_reads",          "compressed_blocks",
+    "compress_in_bytes",    "compress_out_bytes",    "pool_maps",
+    "pool_hugetlb_maps",    "pool_reused",           "pool_zeroed_bytes",
+    "sealed_pages",         "auth_failures",         "nacks_suppressed",
+    "multicast_repairs",    "unicast_repairs",       "cache_hits",
+    "cache_misses",         "cache_evictions",       "unknown_receiver_replies",
+};
+
+static const char *histogram_names[HISTOGRAM_COUNT] = {
+    "ack_rtt_us",
+    "page_interarrival_us",
+    "send_us",
+    "read_bytes",
+};
+
+// live shards, plus the totals of the threads that already exited
+static pthread_mutex_t shards_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct shard *shards;
+static struct shard retired;
+
+static pthread_key_t shard_key;
+static pthread_once_t shard_key_once = PTHREAD_ONCE_INIT;
+static __thread struct shard *local_shard;
+
+static const char *program_name = "unknown";
+static FILE *output;
+static uint64_t start_us;
+
+static pthread_t snapshot_thread;
+static bool snapshots_running;
+static long snapshot_interval_ms;
+static pthread_mutex_t snapshot_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t snapshot_cond = PTHREAD_COND_INITIALIZER;
+static bool snapshot_stop;
+
+uint64_t metrics_now_us(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static void reset_shard(struct shard *shard) {
+  memset(shard, 0, sizeof(struct shard));
+  for (int h = 0; h < HISTOGRAM_COUNT; h++) {
+    shard->histograms[h].min = UINT64_MAX;
+  }
+}
+
+static uint64_t load(const uint64_t *value) {
+  return __atomic_load_n(value, __ATOMIC_RELAXED);
+}
+
+// single writer: a relaxed store is enough for readers never to see a torn
+// value, and it needs no locked instruction
+static void store(uint64_t *value, uint64_t n) {
+  __atomic_store_n(value, n, __ATOMIC_RELAXED);
+}
+
+static void merge_shard(struct shard *dst, struct shard *src) {
+  for (int m = 0; m < METRIC_COUNT; m++) {
+    dst->counters[m] += load(&src->counters[m]);
+  }
+  for (int h = 0; h < HISTOGRAM_COUNT; h++) {
+    struct histogram *d = &dst->histograms[h], *s = &src->histograms[h];
+    for (int b = 0; b < HISTOGRAM_BUCKETS; b++) {
+      d->buckets[b] += load(&s->buckets[b]);
+    }
+    d->count += load(&s->count);
+    d->sum += load(&s->sum);
+    uint64_t min = load(&s->min), max = load(&s->max);
+    d->min = min < d->min ? min : d->min;
+    d->max = max > d->max ? max : d->max;
+  }
+}
+
+// a thread is exiting: fold its numbers into the retired totals
+static void retire_shard(void *arg) {
+  struct shard *shard = arg;
+  pthread_mutex_lock(&shards_lock);
+  for (struct shard **p = &shards; *p != NULL; p = &(*p)->next) {
+    if (*p == shard) {
+      *p = shard->next;
+      break;
+    }
+  }
+  merge_shard(&retired, shard);
+  pthread_mutex_unlock(&shards_lock);
+  free(shard);
+}
+
+static void create_shard_key(void) {
+  pthread_key_create(&shard_key, retire_shard);
+  reset_shard(&retired);
+}
+
+static struct shard *get_shard(void) {
+  if (local_shard != NULL) {
+    return local_shard;
+  }
+  pthread_once(&shard_key_once, create_shard_key);
+
+  struct shard *shard = malloc(sizeof(struct shard));
+  if (shard == NULL) {
+    perror("malloc");
+    exit(EXIT_FAILURE);
+  }
+  reset_shard(shard);
+
+  pthread_mutex_lock(&shards_lock);
+  shard->next = shards;
+  shards = shard;
+  pthread_mutex_unlock(&shards_lock);
+
+  pthread_setspecific(shard_key, shard);
+  local_shard = shard;
+  return shard;
+}
+
+void metrics_add(enum METRIC metric, uint64_t n) {
+  struct shard *shard = get_shard();
+  store(&shard->counters[metric], shard->counters[metric] + n);
+}
+
+static int bucket_index(uint64_t value) {
+  if (value < SUB_BUCKETS) {
+    return value;
+  }
+  int exponent = 63 - __builtin_clzll(value);
+  int sub = (value >> (exponent - SUB_BUCKET_BITS)) & (SUB_BUCKETS - 1);
+  return (exponent - SUB_BUCKET_BITS + 1) * SUB_BUCKETS + sub;
+}
+
+static uint64_t bucket_lower(int index) {
+  if (index < SUB_BUCKETS) {
+    return index;
+  }
+  int exponent = index / SUB_BUCKETS + SUB_BUCKET_BITS - 1;
+  uint64_t sub = index % SUB_BUCKETS;
+  return (SUB_BUCKETS + sub) << (exponent - SUB_BUCKET_BITS);
+}
+
+void metrics_record(enum HISTOGRAM histogram, uint64_t value) {
+  struct histogram *h = &get_shard()->histograms[histogram];
+  int b = bucket_index(value);
+  store(&h->buckets[b], h->buckets[b] + 1);
+  store(&h->count, h->count + 1);
+  store(&h->sum, h->sum + value);
+  if (value < h->min) {
+    store(&h->min, value);
+  }
+  if (value > h->max) {
+    store(&h->max, value);
+  }
+}
+
+/*
+ * Value at quantile @param q, reported as the middle of its bucket
+ */
+static uint64_t quantile(const struct histogram *h, double q) {
+  uint64_t target = (uint64_t)(q * h->count + 0.999999);
+  if (target == 0) {
+    target = 1;
+  }
+  uint64_t seen = 0;
+  for (int b = 0; b < HISTOGRAM_BUCKETS; b++) {
+    seen += h->buckets[b];
+    if (seen >= target) {
+      uint64_t lower = bucket_lower(b);
+      uint64_t upper =
+          (b + 1 < HISTOGRAM_BUCKETS) ? bucket_lower(b + 1) - 1 : UINT64_MAX;
+      uint64_t value = lower + (upper - lower) / 2;
+      if (value < h->min) {
+        value = h->min;
+      }
+      if (value > h->max) {
+        value = h->max;
+      }
+      return value;
+    }
+  }
+  return h->max;
+}
+
+/*
+ * Resident set size in KB, 0 if /proc is not there
+ */
+static long current_rss_kb(void) {
+  long pages = 0, resident = 0;
+  FILE *statm = fopen("/proc/self/statm", "r");
+  if (statm == NULL) {
+    return 0;
+  }
+  if (fscanf(statm, "%ld %ld", &pages, &resident) != 2) {
+    resident = 0;
+  }
+  fclose(statm);
+  return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static void write_json(FILE *out, const char *type) {
+  struct shard *total = malloc(sizeof(struct shard));
+  if (total == NULL) {
+    return;
+  }
+  pthread_once(&shard_key_once, create_shard_key);
+  pthread_mutex_lock(&shards_lock);
+  *total = retired;
+  for (struct shard *s = shards; s != NULL; s = s->next) {
+    merge_shard(total, s);
+  }
+  pthread_mutex_unlock(&shards_lock);
+
+  fprintf(out, "{\"program\": \"%s\", \"type\": \"%s\", \"elapsed_ms\": %.3f",
+          program_name, type, (metrics_now_us() - start_us) / 1000.0);
+
+  fprintf(out, ", \"counters\": {");
+  for (int m = 0; m < METRIC_COUNT; m++) {
+    fprintf(out, "%s\"%s\": %llu", m ? ", " : "", metric_names[m],
+            (unsigned long long)total->counters[m]);
+  }
+
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  fprintf(out,
+          "}, \"process\": {\"minor_faults\": %ld, \"major_faults\": %ld, "
+          "\"rss_kb\": %ld, \"max_rss_kb\": %ld",
+          usage.ru_minflt, usage.ru_majflt, current_rss_kb(),
+          usage.ru_maxrss);
+
+  fprintf(out, "}, \"histograms\": {");
+  for (int i = 0; i < HISTOGRAM_COUNT; i++) {
+    struct histogram *h = &total->histograms[i];
+    fprintf(out, "%s\"%s\": {\"count\": %llu", i ? ", " : "",
+            histogram_names[i], (unsigned long long)h->count);
+    if (h->count > 0) {
+      fprintf(out,
+              ", \"min\": %llu, \"mean\": %.1f, \"p50\": %llu, \"p90\": %llu, "
+              "\"p99\": %llu, \"p999\": %llu, \"max\": %llu",
+              (unsigned long long)h->min, (double)h->sum / h->count,
+              (unsigned long long)quantile(h, 0.5),
+              (unsigned long long)quantile(h, 0.9),
+              (unsigned long long)quantile(h, 0.99),
+              (unsigned long long)quantile(h, 0.999),
+              (unsigned long long)h->max);
+    }
+    fprintf(out, "}");
+  }
+  fprintf(out, "}}\n");
+  fflush(out);
+  free(total);
+}
+
+void metrics_flush(void) {
+  if (output != NULL) {
+    write_json(output, "summary");
+  }
+}
+
+static void *snapshot_loop(void *arg) {
+  (void)arg;
+  pthread_mutex_lock(&snapshot_lock);
+  while (!snapshot_stop) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += snapshot_interval_ms / 1000;
+    deadline.tv_nsec += (snapshot_interval_ms % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000;
+    }
+    if (pthread_cond_timedwait(&snapshot_cond, &snapshot_lock, &deadline) ==
+            0 &&
+        snapshot_stop) {
+      break;
+    }
+    write_json(output, "snapshot");
+  }
+  pthread_mutex_unlock(&snapshot_lock);
+  return NULL;
+}
+
+static void metrics_finish(void) {
+  if (snapshots_running) {
+    pthread_mutex_lock(&snapshot_lock);
+    snapshot_stop = true;
+    pthread_cond_signal(&snapshot_cond);
+    pthread_mutex_unlock(&snapshot_lock);
+    pthread_join(snapshot_thread, NULL);
+  }
+  write_json(output, "summary");
+  if (output != stderr) {
+    fclose(output);
+  }
+}
+
+void metrics_init(const char *program) {
+  program_name = program;
+  start_us = metrics_now_us();
+  get_shard();
+
+  const char *path = getenv("TRANSFER_METRICS");
+  if (path == NULL || path[0] == '\0') {
+    return;
+  }
+  output = (strcmp(path, "-") == 0) ? stderr : fopen(path, "a");
+  if (output == NULL) {
+    perror("TRANSFER_METRICS");
+    return;
+  }
+  atexit(metrics_finish);
+
+  const char *interval = getenv("TRANSFER_METRICS_INTERVAL");
+  snapshot_interval_ms = (interval != NULL) ? atol(interval) : 0;
+  if (snapshot_interval_ms > 0 &&
+      pthread_create(&snapshot_thread, NULL, snapshot_loop, NULL) == 0) {
+    snapshots_running = true;
+  }
+}
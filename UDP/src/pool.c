@@ -0,0 +1,138 @@
+#define _GNU_SOURCE
+#include "../include/pool.h"
+#include "../include/metrics.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+
+// size classes go from 64 KB up, one per power of two
+#define MIN_CLASS_SHIFT 16
+#define MAX_CLASS_SHIFT 47
+#define HUGE_PAGE_SIZE (2u << 20)
+// every buffer starts with its header, a cache line keeps the data aligned
+#define HEADER_SIZE 64
+
+struct buffer_header {
+  size_t mapped;
+  // how many bytes a user may have written since the kernel zeroed them
+  size_t dirty;
+  int shift;
+  struct buffer_header *next;
+};
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct buffer_header *free_lists[MAX_CLASS_SHIFT + 1];
+static size_t cached_bytes;
+
+static int class_shift(size_t size) {
+  int shift = MIN_CLASS_SHIFT;
+  while (shift < MAX_CLASS_SHIFT && ((size_t)1 << shift) < size) {
+    shift++;
+  }
+  return shift;
+}
+
+static struct buffer_header *map_buffer(int shift) {
+  size_t len = (size_t)1 << shift;
+  void *addr = MAP_FAILED;
+
+  // explicit huge pages only exist if the administrator reserved some
+  if (len >= HUGE_PAGE_SIZE) {
+    addr = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (addr != MAP_FAILED) {
+      metrics_inc(METRIC_POOL_HUGETLB_MAPS);
+    }
+  }
+  if (addr == MAP_FAILED) {
+    addr = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                -1, 0);
+    if (addr == MAP_FAILED) {
+      return NULL;
+    }
+    if (len >= HUGE_PAGE_SIZE) {
+      madvise(addr, len, MADV_HUGEPAGE);
+    }
+  }
+  metrics_inc(METRIC_POOL_MAPS);
+
+  struct buffer_header *header = addr;
+  header->mapped = len;
+  header->dirty = 0;
+  header->shift = shift;
+  header->next = NULL;
+  return header;
+}
+
+/*
+ * A buffer of the class fitting @param size, recycled when possible
+ */
+static struct buffer_header *take_buffer(size_t size) {
+  if (size > ((size_t)1 << MAX_CLASS_SHIFT) - HEADER_SIZE) {
+    return NULL;
+  }
+  int shift = class_shift(size + HEADER_SIZE);
+
+  pthread_mutex_lock(&pool_lock);
+  struct buffer_header *header = free_lists[shift];
+  if (header != NULL) {
+    free_lists[shift] = header->next;
+    cached_bytes -= header->mapped;
+  }
+  pthread_mutex_unlock(&pool_lock);
+
+  if (header != NULL) {
+    metrics_inc(METRIC_POOL_REUSED);
+    return header;
+  }
+  return map_buffer(shift);
+}
+
+void *pool_alloc(size_t size) {
+  struct buffer_header *header = take_buffer(size);
+  if (header == NULL) {
+    return NULL;
+  }
+  if (size > header->dirty) {
+    header->dirty = size;
+  }
+  return (char *)header + HEADER_SIZE;
+}
+
+void *pool_calloc(size_t size) {
+  struct buffer_header *header = take_buffer(size);
+  if (header == NULL) {
+    return NULL;
+  }
+  size_t clear = size < header->dirty ? size : header->dirty;
+  memset((char *)header + HEADER_SIZE, 0, clear);
+  metrics_add(METRIC_POOL_ZEROED_BYTES, clear);
+  if (size > header->dirty) {
+    header->dirty = size;
+  }
+  return (char *)header + HEADER_SIZE;
+}
+
+void pool_free(void *buf) {
+  if (buf == NULL) {
+    return;
+  }
+  struct buffer_header *header =
+      (struct buffer_header *)((char *)buf - HEADER_SIZE);
+
+  pthread_mutex_lock(&pool_lock);
+  bool keep = cached_bytes + header->mapped <= POOL_CACHE_BYTES;
+  if (keep) {
+    header->next = free_lists[header->shift];
+    free_lists[header->shift] = header;
+    cached_bytes += header->mapped;
+  }
+  pthread_mutex_unlock(&pool_lock);
+
+  if (!keep) {
+    munmap(header, header->mapped);
+  }
+}
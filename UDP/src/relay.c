@@ -0,0 +1,495 @@
+/*
+ * UDP impairment relay.
+ *
+ * Sits between udpclient and udpserver and forwards datagrams both ways,
+ * injecting seeded random loss, Gilbert-Elliott burst loss, delay and
+ * jitter, reordering, duplication and a bandwidth cap with a bounded queue.
+ * Each direction is impaired on its own. Same seed, same impairments, so a
+ * run can be repeated while tuning the retransmission logic without netem.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <math.h>
+#include <netdb.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define RELAY_BUFFER_SIZE 65536
+
+enum DIRECTION {
+  UP = 0,   // client -> server
+  DOWN = 1, // server -> client
+};
+
+/*
+ * Probabilities are percentages, times are milliseconds, rates kbit/s
+ */
+struct impairment {
+  double loss;
+  // Gilbert-Elliott: chance of entering and leaving the bad state, and the
+  // loss while in it
+  double burst_enter;
+  double burst_exit;
+  double burst_loss;
+  double delay;
+  double jitter;
+  // reordered packets are held back reorder_delay ms so later ones pass them
+  double reorder;
+  double reorder_delay;
+  double duplicate;
+  double rate;
+  // with a rate cap, packets that would wait longer than this are dropped
+  double queue;
+};
+
+struct relay_stats {
+  unsigned long in_packets;
+  unsigned long in_bytes;
+  unsigned long out_packets;
+  unsigned long out_bytes;
+  unsigned long lost;
+  unsigned long queue_drops;
+  unsigned long duplicated;
+  unsigned long reordered;
+};
+
+struct direction {
+  const char *name;
+  struct impairment impairment;
+  uint64_t rng;
+  bool bad_state;
+  // when the capped link finishes sending what is queued
+  double link_free;
+  struct relay_stats stats;
+};
+
+struct pending {
+  double release;
+  unsigned long seq;
+  int direction;
+  size_t len;
+  char *data;
+};
+
+/*
+ * Datagrams waiting for their release time, a min-heap on (release, seq)
+ */
+struct queue {
+  struct pending *items;
+  size_t len;
+  size_t capacity;
+  unsigned long next_seq;
+};
+
+struct profile {
+  const char *name;
+  const char *spec;
+};
+
+static const struct profile profiles[] = {
+    {"lossy", "loss=1"},
+    {"bursty", "burst=1:25:50"},
+    {"wan", "delay=20,jitter=2,rate=100000,queue=50"},
+    {"reorder", "reorder=5:5,dup=1"},
+    {"hostile", "loss=2,burst=0.5:20:50,delay=10,jitter=5,reorder=2:5,dup=1"},
+};
+
+static volatile sig_atomic_t stop = 0;
+
+static void handle_signal(int sig) {
+  (void)sig;
+  stop = 1;
+}
+
+static void usage(const char *program) {
+  fprintf(stderr,
+          "usage: %s [-s seed] [-p profile] [-a spec] [-u spec] [-d spec] "
+          "[-i idle_sec] listen_port host port\n"
+          "  spec: comma separated loss=PCT, burst=ENTER:EXIT:LOSS, delay=MS,\n"
+          "        jitter=MS, reorder=PCT[:MS], dup=PCT, rate=KBPS, queue=MS\n"
+          "  -a applies to both directions, -u to client->server, -d to "
+          "server->client\n"
+          "  profiles: lossy, bursty, wan, reorder, hostile\n",
+          program);
+  exit(EXIT_FAILURE);
+}
+
+static double now_ms(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000.0 + now.tv_nsec / 1e6;
+}
+
+// xorshift64*, uniform in [0, 1)
+static double next_random(uint64_t *state) {
+  *state ^= *state >> 12;
+  *state ^= *state << 25;
+  *state ^= *state >> 27;
+  return ((*state * 0x2545f4914f6cdd1dULL) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static bool chance(uint64_t *state, double percent) {
+  return percent > 0 && next_random(state) * 100 < percent;
+}
+
+static void parse_spec(struct impairment *imp, const char *spec) {
+  char *copy = strdup(spec);
+  for (char *tok = strtok(copy, ","); tok != NULL; tok = strtok(NULL, ",")) {
+    char *value = strchr(tok, '=');
+    if (value == NULL) {
+      fprintf(stderr, "Invalid impairment %s\n", tok);
+      exit(EXIT_FAILURE);
+    }
+    *value++ = '\0';
+
+    int n = 1;
+    if (strcmp(tok, "loss") == 0) {
+      imp->loss = atof(value);
+    } else if (strcmp(tok, "burst") == 0) {
+      n = sscanf(value, "%lf:%lf:%lf", &imp->burst_enter, &imp->burst_exit,
+                 &imp->burst_loss) == 3;
+    } else if (strcmp(tok, "delay") == 0) {
+      imp->delay = atof(value);
+    } else if (strcmp(tok, "jitter") == 0) {
+      imp->jitter = atof(value);
+    } else if (strcmp(tok, "reorder") == 0) {
+      n = sscanf(value, "%lf:%lf", &imp->reorder, &imp->reorder_delay) >= 1;
+    } else if (strcmp(tok, "dup") == 0) {
+      imp->duplicate = atof(value);
+    } else if (strcmp(tok, "rate") == 0) {
+      imp->rate = atof(value);
+    } else if (strcmp(tok, "queue") == 0) {
+      imp->queue = atof(value);
+    } else {
+      n = 0;
+    }
+    if (!n) {
+      fprintf(stderr, "Invalid impairment %s=%s\n", tok, value);
+      exit(EXIT_FAILURE);
+    }
+  }
+  free(copy);
+}
+
+static const char *profile_spec(const char *name) {
+  for (size_t i = 0; i < sizeof(profiles) / sizeof(profiles[0]); i++) {
+    if (strcmp(profiles[i].name, name) == 0) {
+      return profiles[i].spec;
+    }
+  }
+  fprintf(stderr, "Unknown profile %s\n", name);
+  exit(EXIT_FAILURE);
+}
+
+static bool before(const struct pending *a, const struct pending *b) {
+  return a->release < b->release ||
+         (a->release == b->release && a->seq < b->seq);
+}
+
+static void queue_push(struct queue *q, struct pending item) {
+  if (q->len == q->capacity) {
+    q->capacity = q->capacity ? q->capacity * 2 : 256;
+    q->items = realloc(q->items, q->capacity * sizeof(struct pending));
+    if (q->items == NULL) {
+      perror("realloc");
+      exit(EXIT_FAILURE);
+    }
+  }
+  item.seq = q->next_seq++;
+
+  size_t i = q->len++;
+  while (i > 0 && before(&item, &q->items[(i - 1) / 2])) {
+    q->items[i] = q->items[(i - 1) / 2];
+    i = (i - 1) / 2;
+  }
+  q->items[i] = item;
+}
+
+static struct pending queue_pop(struct queue *q) {
+  struct pending top = q->items[0];
+  struct pending last = q->items[--q->len];
+
+  size_t i = 0;
+  while (1) {
+    size_t child = 2 * i + 1;
+    if (child >= q->len) {
+      break;
+    }
+    if (child + 1 < q->len && before(&q->items[child + 1], &q->items[child])) {
+      child++;
+    }
+    if (!before(&q->items[child], &last)) {
+      break;
+    }
+    q->items[i] = q->items[child];
+    i = child;
+  }
+  if (q->len > 0) {
+    q->items[i] = last;
+  }
+  return top;
+}
+
+/*
+ * Decides the fate of a datagram and queues the copies that survive
+ */
+static void impair(struct direction *dir, int direction, struct queue *q,
+                   const char *data, size_t len, double now) {
+  struct impairment *imp = &dir->impairment;
+  dir->stats.in_packets++;
+  dir->stats.in_bytes += len;
+
+  if (dir->bad_state) {
+    dir->bad_state = !chance(&dir->rng, imp->burst_exit);
+  } else {
+    dir->bad_state = chance(&dir->rng, imp->burst_enter);
+  }
+  if ((dir->bad_state && chance(&dir->rng, imp->burst_loss)) ||
+      chance(&dir->rng, imp->loss)) {
+    dir->stats.lost++;
+    return;
+  }
+
+  int copies = 1;
+  if (chance(&dir->rng, imp->duplicate)) {
+    copies = 2;
+    dir->stats.duplicated++;
+  }
+
+  for (int c = 0; c < copies; c++) {
+    double delay = imp->delay;
+    if (imp->jitter > 0) {
+      delay += (next_random(&dir->rng) * 2 - 1) * imp->jitter;
+    }
+    if (chance(&dir->rng, imp->reorder)) {
+      delay += imp->reorder_delay > 0 ? imp->reorder_delay : 1;
+      dir->stats.reordered++;
+    }
+    double release = now + (delay > 0 ? delay : 0);
+
+    // serialize on the capped link: kbit/s is bits per millisecond
+    if (imp->rate > 0) {
+      double start = release > dir->link_free ? release : dir->link_free;
+      if (imp->queue > 0 && start - release > imp->queue) {
+        dir->stats.queue_drops++;
+        continue;
+      }
+      dir->link_free = start + len * 8 / imp->rate;
+      release = dir->link_free;
+    }
+
+    struct pending item = {release, 0, direction, len, malloc(len)};
+    if (item.data == NULL) {
+      perror("malloc");
+      exit(EXIT_FAILURE);
+    }
+    memcpy(item.data, data, len);
+    queue_push(q, item);
+  }
+}
+
+static void print_stats(struct direction *dirs) {
+  for (int d = UP; d <= DOWN; d++) {
+    struct relay_stats *s = &dirs[d].stats;
+    printf("relay %s in_packets=%lu in_bytes=%lu out_packets=%lu "
+           "out_bytes=%lu lost=%lu queue_drops=%lu duplicated=%lu "
+           "reordered=%lu\n",
+           dirs[d].name, s->in_packets, s->in_bytes, s->out_packets,
+           s->out_bytes, s->lost, s->queue_drops, s->duplicated,
+           s->reordered);
+  }
+  fflush(stdout);
+}
+
+static int bind_socket(const char *port) {
+  struct addrinfo hints, *res;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_DGRAM;
+  hints.ai_flags = AI_PASSIVE;
+
+  int rv = getaddrinfo(NULL, port, &hints, &res);
+  if (rv != 0) {
+    fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));
+    exit(EXIT_FAILURE);
+  }
+  int sockfd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+  if (sockfd == -1 || bind(sockfd, res->ai_addr, res->ai_addrlen) == -1) {
+    perror("relay: bind");
+    exit(EXIT_FAILURE);
+  }
+  freeaddrinfo(res);
+  return sockfd;
+}
+
+static void set_buffers(int sockfd) {
+  int size = 4 * 1024 * 1024;
+  setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+  setsockopt(sockfd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+}
+
+int main(int argc, char *argv[]) {
+  struct direction dirs[2];
+  memset(dirs, 0, sizeof(dirs));
+  dirs[UP].name = "up";
+  dirs[DOWN].name = "down";
+  uint64_t seed = 1;
+  double idle_ms = 0;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "s:p:a:u:d:i:")) != -1) {
+    switch (opt) {
+    case 's':
+      seed = strtoull(optarg, NULL, 10);
+      break;
+    case 'p':
+      parse_spec(&dirs[UP].impairment, profile_spec(optarg));
+      parse_spec(&dirs[DOWN].impairment, profile_spec(optarg));
+      break;
+    case 'a':
+      parse_spec(&dirs[UP].impairment, optarg);
+      parse_spec(&dirs[DOWN].impairment, optarg);
+      break;
+    case 'u':
+      parse_spec(&dirs[UP].impairment, optarg);
+      break;
+    case 'd':
+      parse_spec(&dirs[DOWN].impairment, optarg);
+      break;
+    case 'i':
+      idle_ms = atof(optarg) * 1000;
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  if (argc - optind < 3) {
+    usage(argv[0]);
+  }
+
+  // independent streams per direction, never the all zero xorshift state
+  dirs[UP].rng = seed * 0x9e3779b97f4a7c15ULL + 1;
+  dirs[DOWN].rng = seed * 0xbf58476d1ce4e5b9ULL + 2;
+
+  struct addrinfo hints, *server;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_DGRAM;
+  int rv = getaddrinfo(argv[optind + 1], argv[optind + 2], &hints, &server);
+  if (rv != 0) {
+    fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));
+    return EXIT_FAILURE;
+  }
+
+  int client_sock = bind_socket(argv[optind]);
+  int server_sock = socket(AF_INET, SOCK_DGRAM, 0);
+  if (server_sock == -1) {
+    perror("socket");
+    return EXIT_FAILURE;
+  }
+  set_buffers(client_sock);
+  set_buffers(server_sock);
+
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = handle_signal;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+
+  struct sockaddr_storage client_addr;
+  socklen_t client_len = 0;
+  struct queue queue = {NULL, 0, 0, 0};
+  char buf[RELAY_BUFFER_SIZE];
+  double last_packet = now_ms();
+
+  printf("Relay %s -> %s:%s\n", argv[optind], argv[optind + 1],
+         argv[optind + 2]);
+  fflush(stdout);
+
+  while (!stop) {
+    double now = now_ms();
+
+    // release everything that is due
+    while (queue.len > 0 && queue.items[0].release <= now) {
+      struct pending item = queue_pop(&queue);
+      struct direction *dir = &dirs[item.direction];
+      int sent;
+      if (item.direction == UP) {
+        sent = sendto(server_sock, item.data, item.len, 0, server->ai_addr,
+                      server->ai_addrlen);
+      } else {
+        sent = sendto(client_sock, item.data, item.len, 0,
+                      (struct sockaddr *)&client_addr, client_len);
+      }
+      if (sent != -1) {
+        dir->stats.out_packets++;
+        dir->stats.out_bytes += item.len;
+      }
+      free(item.data);
+    }
+
+    if (idle_ms > 0 && queue.len == 0 && now - last_packet > idle_ms) {
+      break;
+    }
+
+    int timeout = -1;
+    if (queue.len > 0) {
+      timeout = (int)ceil(queue.items[0].release - now);
+    } else if (idle_ms > 0) {
+      timeout = (int)ceil(idle_ms - (now - last_packet));
+    }
+
+    struct pollfd fds[2] = {{client_sock, POLLIN, 0}, {server_sock, POLLIN, 0}};
+    int ready = poll(fds, 2, timeout);
+    if (ready == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("poll");
+      break;
+    }
+    now = now_ms();
+
+    if (fds[0].revents & (POLLIN | POLLERR)) {
+      struct sockaddr_storage from;
+      socklen_t from_len = sizeof(from);
+      ssize_t n = recvfrom(client_sock, buf, sizeof(buf), 0,
+                           (struct sockaddr *)&from, &from_len);
+      if (n >= 0) {
+        client_addr = from;
+        client_len = from_len;
+        last_packet = now;
+        impair(&dirs[UP], UP, &queue, buf, n, now);
+      }
+    }
+
+    if (fds[1].revents & (POLLIN | POLLERR)) {
+      ssize_t n = recv(server_sock, buf, sizeof(buf), 0);
+      // nowhere to send it until the client spoke
+      if (n >= 0 && client_len > 0) {
+        last_packet = now;
+        impair(&dirs[DOWN], DOWN, &queue, buf, n, now);
+      }
+    }
+  }
+
+  print_stats(dirs);
+
+  while (queue.len > 0) {
+    free(queue_pop(&queue).data);
+  }
+  free(queue.items);
+  freeaddrinfo(server);
+  close(client_sock);
+  close(server_sock);
+  return 0;
+}
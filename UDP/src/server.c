@@ -1,34 +1,137 @@
 
 
 #define _XOPEN_SOURCE 600
+#define _DEFAULT_SOURCE
 #include "../include/library.h"
+#include "../include/timer_wheel.h"
 
-void validate_port(int argc, char *argv[]);
-int create_and_bind_socket(char *port);
-void handle_connection(int sockfd, struct sockaddr_storage their_addr,
-                       socklen_t addr_len);
-int recv_file_info(struct file_metadata *file_info, int sockfd,
-                   struct sockaddr_storage their_addr, socklen_t addr_len);
-void initialize_buffers(bool **ack_array, char **file_buf, int npages);
+#include <arpa/inet.h>
+#include <limits.h>
+
+// first retransmission of a download page, doubled for every copy
+#define TIMEOUT_MS (TIMEOUT_SEC * 1000 + TIMEOUT_USEC / 1000)
+#define MAX_RTO_MS 1000
+
+void validate_port(const char *arg);
+int create_and_bind_socket(char *port, bool shared);
+void join_group(int sockfd, const char *group);
+int handle_connection(int sockfd, struct sockaddr_storage their_addr,
+                      socklen_t addr_len, const unsigned char *psk,
+                      int psk_len);
+void serve_download(int sockfd, struct sockaddr_storage *their_addr,
+                    socklen_t addr_len, struct file_metadata *file_info);
+
+/*
+ * Our current copy of the file being sent, the base of a delta transfer
+ */
+struct base_file {
+  char name[FILENAME_SIZE];
+  char *data;
+  size_t size;
+  size_t block_size;
+  struct block_signature *sigs;
+  size_t nblocks;
+};
+
+int recv_file_info(struct file_metadata *file_info, struct base_file *base,
+                   int sockfd, struct sockaddr_storage *their_addr,
+                   socklen_t *addr_len, const unsigned char *psk, int psk_len,
+                   unsigned char *key);
+void initialize_buffers(bool **ack_array, char **file_buf, int npages,
+                        int page_size);
 void receive_file(int sockfd, struct sockaddr_storage their_addr,
                   socklen_t addr_len, struct file_metadata *file_info,
-                  bool *ack_array, char *file_buf, int npages);
+                  bool *ack_array, char *file_buf, int npages, int slot,
+                  struct aead *aead, int reply_fd);
+
+/*
+ * Parity pages received so far, per group of the file
+ */
+struct fec_state {
+  int mode;
+  int data_pages;
+  int parity_pages;
+  int ngroups;
+  size_t page_size;
+  char *parity_buf;
+  bool *parity_array;
+  bool *group_done;
+};
+
+void initialize_fec(struct fec_state *fec, struct file_metadata *file_info,
+                    int npages);
+void free_fec(struct fec_state *fec);
+int recover_group(struct fec_state *fec, int group, bool *ack_array,
+                  char *file_buf, int npages, int *recovered);
+int send_handshake_reply(int sockfd, struct file_metadata *file_info,
+                         struct sockaddr_storage *their_addr,
+                         socklen_t addr_len);
+int send_refusal(int sockfd, struct file_metadata *file_info,
+                 struct sockaddr_storage *their_addr, socklen_t addr_len);
+bool same_peer(const struct sockaddr_storage *from, socklen_t from_len,
+               const struct sockaddr_storage *peer, socklen_t peer_len);
+bool valid_filename(char *name);
+int load_base(struct base_file *base, const char *name, size_t block_size);
+void free_base(struct base_file *base);
+void send_signatures(int sockfd, struct base_file *base,
+                     struct signature_request *request,
+                     struct sockaddr_storage *their_addr, socklen_t addr_len);
+void save_file(struct file_metadata *file_info, char *data);
 
 int main(int argc, char *argv[]) {
-  validate_port(argc, argv);
-  char *port = argv[1];
+  unsigned char psk[AEAD_MAX_PSK_SIZE];
+  int psk_len = 0;
+  char *group = NULL;
 
-  int sockfd = create_and_bind_socket(port);
+  int opt;
+  while ((opt = getopt(argc, argv, "k:g:")) != -1) {
+    switch (opt) {
+    case 'g':
+      group = optarg;
+      break;
+    case 'k':
+      psk_len = aead_load_psk(optarg, psk);
+      if (psk_len == -1) {
+        fprintf(stderr, "Could not read a key from %s\n", optarg);
+        exit(EXIT_FAILURE);
+      }
+      break;
+    default:
+      fprintf(stderr, "Usage: %s [-k keyfile] [-g group] port\n", argv[0]);
+      exit(EXIT_FAILURE);
+    }
+  }
+  if (optind >= argc) {
+    fprintf(stderr, "ERROR, no port provided\n");
+    exit(EXIT_FAILURE);
+  }
+  char *port = argv[optind];
+  validate_port(port);
+  fec_init();
+  metrics_init("udpserver");
+  status_init("udpserver");
+  file_cache_init();
+
+  // every receiver of a group listens on the group's port, several of them
+  // may run on one host
+  int sockfd = create_and_bind_socket(port, group != NULL);
   if (sockfd == -1) {
     fprintf(stderr, "listener: failed to bind socket\n");
     return 2;
   }
+  if (group != NULL) {
+    join_group(sockfd, group);
+  }
 
   printf("Servidor corriendo en puerto %s. Esperando conexiones...\n", port);
   struct sockaddr_storage their_addr;
   socklen_t addr_len = sizeof(their_addr);
 
-  handle_connection(sockfd, their_addr, addr_len);
+  // downloads are served one after another, an upload ends the server
+  while (handle_connection(sockfd, their_addr, addr_len, psk, psk_len) ==
+         REQUEST_DOWNLOAD) {
+    metrics_flush();
+  }
 
   close(sockfd);
   return 0;
@@ -37,13 +140,8 @@ int main(int argc, char *argv[]) {
 /*
  * Simple port validation
  */
-void validate_port(int argc, char *argv[]) {
-  if (argc < 2) {
-    fprintf(stderr, "ERROR, no port provided\n");
-    exit(EXIT_FAILURE);
-  }
-
-  int port = atoi(argv[1]);
+void validate_port(const char *arg) {
+  int port = atoi(arg);
   if (port < 1024 || port > 65535) {
     fprintf(stderr, "ERROR, invalid port number\n");
     exit(EXIT_FAILURE);
@@ -53,7 +151,7 @@ void validate_port(int argc, char *argv[]) {
 /*
  * Socket initialization
  */
-int create_and_bind_socket(char *port) {
+int create_and_bind_socket(char *port, bool shared) {
   int sockfd;
   struct addrinfo hints, *servinfo, *p;
   int rv;
@@ -74,6 +172,12 @@ int create_and_bind_socket(char *port) {
       continue;
     }
 
+    int yes = 1;
+    if (shared &&
+        setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)) == -1) {
+      perror("setsockopt SO_REUSEADDR");
+    }
+
     if (bind(sockfd, p->ai_addr, p->ai_addrlen) == -1) {
       close(sockfd);
       perror("listener: bind");
@@ -93,149 +197,1200 @@ int create_and_bind_socket(char *port) {
 }
 
 /*
- * Initialize buffers for file reception
+ * Receive the pages multicast to @param group on every interface
+ */
+void join_group(int sockfd, const char *group) {
+  struct ip_mreq mreq;
+  memset(&mreq, 0, sizeof(mreq));
+  if (inet_pton(AF_INET, group, &mreq.imr_multiaddr) != 1 ||
+      !IN_MULTICAST(ntohl(mreq.imr_multiaddr.s_addr))) {
+    fprintf(stderr, "ERROR, %s is not a multicast group\n", group);
+    exit(EXIT_FAILURE);
+  }
+  mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+  if (setsockopt(sockfd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq,
+                 sizeof(mreq)) == -1) {
+    perror("setsockopt IP_ADD_MEMBERSHIP");
+    exit(EXIT_FAILURE);
+  }
+  printf("Recibiendo del grupo %s\n", group);
+}
+
+/*
+ * Initialize buffers for file reception, recycled from earlier sessions
+ */
+void initialize_buffers(bool **ack_array, char **file_buf, int npages,
+                        int page_size) {
+  *file_buf = pool_calloc((size_t)npages * page_size);
+  *ack_array = pool_calloc(npages * sizeof(bool));
+  if (*file_buf == NULL || *ack_array == NULL) {
+    perror("mmap");
+    exit(EXIT_FAILURE);
+  }
+}
+
+/*
+ * Initialize parity buffers when the client negotiated error correction
  */
-void initialize_buffers(bool **ack_array, char **file_buf, int npages) {
-  *file_buf = malloc(npages * PAGE_SIZE);
-  if (*file_buf == NULL) {
+void initialize_fec(struct fec_state *fec, struct file_metadata *file_info,
+                    int npages) {
+  memset(fec, 0, sizeof(struct fec_state));
+  fec->mode = file_info->fec_mode;
+  if (fec->mode == FEC_NONE) {
+    return;
+  }
+
+  fec->data_pages = file_info->fec_data_pages;
+  fec->parity_pages = file_info->fec_parity_pages;
+  fec->ngroups = fec_ngroups(npages, fec->data_pages);
+  fec->page_size = file_info->page_size;
+
+  int nparity = fec->ngroups * fec->parity_pages;
+  fec->parity_buf = pool_alloc((size_t)nparity * fec->page_size);
+  fec->parity_array = pool_calloc(nparity * sizeof(bool));
+  fec->group_done = pool_calloc(fec->ngroups * sizeof(bool));
+  if (fec->parity_buf == NULL || fec->parity_array == NULL ||
+      fec->group_done == NULL) {
     perror("malloc");
     exit(EXIT_FAILURE);
   }
-  memset(*file_buf, 0, npages * PAGE_SIZE);
+}
+
+void free_fec(struct fec_state *fec) {
+  pool_free(fec->parity_buf);
+  pool_free(fec->parity_array);
+  pool_free(fec->group_done);
+}
+
+/*
+ * Rebuild the missing pages of @param group if enough parity arrived.
+ * Recovered page numbers are stored in @param recovered,
+ * returns how many there are.
+ */
+int recover_group(struct fec_state *fec, int group, bool *ack_array,
+                  char *file_buf, int npages, int *recovered) {
+  if (fec->mode == FEC_NONE || fec->group_done[group]) {
+    return 0;
+  }
+
+  int k = fec_group_size(group, npages, fec->data_pages);
+  int m = fec->parity_pages;
+  int first = group * fec->data_pages;
+  int missing = 0, parity_count = 0;
+
+  char *data[FEC_MAX_DATA_PAGES];
+  char *parity[FEC_MAX_PARITY_PAGES];
+  for (int i = 0; i < k; i++) {
+    data[i] = file_buf + (first + i) * fec->page_size;
+    if (!ack_array[first + i]) {
+      missing++;
+    }
+  }
+  for (int j = 0; j < m; j++) {
+    parity[j] = fec->parity_buf + (group * m + j) * fec->page_size;
+    if (fec->parity_array[group * m + j]) {
+      parity_count++;
+    }
+  }
+
+  if (missing == 0) {
+    fec->group_done[group] = true;
+    return 0;
+  }
+  if (missing > parity_count) {
+    return 0;
+  }
+
+  if (fec_decode(fec->mode, k, m, data, ack_array + first,
+                 parity, fec->parity_array + group * m, fec->page_size) == -1) {
+    return 0;
+  }
+
+  int n = 0;
+  for (int i = 0; i < k; i++) {
+    if (!ack_array[first + i]) {
+      ack_array[first + i] = true;
+      recovered[n++] = first + i;
+    }
+  }
+  fec->group_done[group] = true;
+  return n;
+}
+
+/*
+ * Reply to the metadata with the settings we accepted
+ */
+int send_handshake_reply(int sockfd, struct file_metadata *file_info,
+                         struct sockaddr_storage *their_addr,
+                         socklen_t addr_len) {
+  struct handshake_reply reply;
+  memset(&reply, 0, sizeof(reply));
+  reply.response.pagenumber = -1;
+  reply.response.ack = ACK;
+  reply.metadata = *file_info;
+
+  return sendto(sockfd, &reply, sizeof(reply), 0,
+                (struct sockaddr *)their_addr, addr_len);
+}
+
+/*
+ * Turn down the request in @param file_info; a client in download mode
+ * reads the reason from the metadata
+ */
+int send_refusal(int sockfd, struct file_metadata *file_info,
+                 struct sockaddr_storage *their_addr, socklen_t addr_len) {
+  struct handshake_reply reply;
+  memset(&reply, 0, sizeof(reply));
+  reply.response.pagenumber = -1;
+  reply.response.ack = NACK;
+  reply.metadata = *file_info;
+
+  return sendto(sockfd, &reply, sizeof(reply), 0,
+                (struct sockaddr *)their_addr, addr_len);
+}
+
+/*
+ * Whether a datagram from @param from came from @param peer
+ */
+bool same_peer(const struct sockaddr_storage *from, socklen_t from_len,
+               const struct sockaddr_storage *peer, socklen_t peer_len) {
+  return from_len == peer_len && memcmp(from, peer, peer_len) == 0;
+}
+
+/*
+ * Files are saved in the working directory: refuse anything that looks
+ * like a path
+ */
+bool valid_filename(char *name) {
+  name[FILENAME_SIZE - 1] = '\0';
+  return name[0] != '\0' && strchr(name, '/') == NULL &&
+         strcmp(name, ".") != 0 && strcmp(name, "..") != 0;
+}
+
+/*
+ * Load our copy of @param name and its block signatures.
+ * Kept across requests, returns -1 if we have no copy.
+ */
+int load_base(struct base_file *base, const char *name, size_t block_size) {
+  if (base->data != NULL && strcmp(base->name, name) == 0 &&
+      base->block_size == block_size) {
+    return 0;
+  }
+  free_base(base);
 
-  *ack_array = malloc(npages * sizeof(bool));
-  if (*ack_array == NULL) {
+  base->data = delta_load_base(name, &base->size);
+  if (base->data == NULL) {
+    return -1;
+  }
+  strncpy(base->name, name, FILENAME_SIZE - 1);
+  base->block_size = block_size;
+  base->nblocks = delta_nblocks(base->size, block_size);
+  base->sigs = malloc((base->nblocks + 1) * sizeof(struct block_signature));
+  if (base->sigs == NULL) {
     perror("malloc");
     exit(EXIT_FAILURE);
   }
-  memset(*ack_array, 0, npages * sizeof(bool));
+  compute_signatures(base->data, base->size, block_size, base->sigs);
+  return 0;
+}
+
+void free_base(struct base_file *base) {
+  free(base->data);
+  free(base->sigs);
+  memset(base, 0, sizeof(struct base_file));
+}
+
+/*
+ * Answer a request for SIGNATURES_PER_REPLY block signatures.
+ * nblocks is 0 when we have no copy of the file.
+ */
+void send_signatures(int sockfd, struct base_file *base,
+                     struct signature_request *request,
+                     struct sockaddr_storage *their_addr, socklen_t addr_len) {
+  struct signature_reply reply;
+  memset(&reply, 0, offsetof(struct signature_reply, sigs));
+  reply.pagenumber = SIGNATURE_PAGE;
+  reply.first_block = request->first_block;
+
+  if (valid_filename(request->name) &&
+      request->block_size >= MIN_PAGE_SIZE - AEAD_TAG_SIZE &&
+      request->block_size <= MAX_PAGE_SIZE &&
+      load_base(base, request->name, request->block_size) == 0 &&
+      base->nblocks > 0) {
+    reply.nblocks = base->nblocks;
+    reply.old_size = base->size;
+    if (request->first_block >= 0 &&
+        (size_t)request->first_block < base->nblocks) {
+      size_t count = base->nblocks - request->first_block;
+      reply.count = (count > SIGNATURES_PER_REPLY) ? SIGNATURES_PER_REPLY
+                                                   : count;
+      memcpy(reply.sigs, base->sigs + request->first_block,
+             reply.count * sizeof(struct block_signature));
+    }
+  }
+
+  size_t len = offsetof(struct signature_reply, sigs) +
+               reply.count * sizeof(struct block_signature);
+  if (sendto(sockfd, &reply, len, 0, (struct sockaddr *)their_addr,
+             addr_len) == -1) {
+    perror("sendto");
+  }
+}
+
+/*
+ * Write the received file to the working directory, through a temporary
+ * name so a failed write never clobbers the base of the next delta
+ */
+void save_file(struct file_metadata *file_info, char *data) {
+  char tmp_name[FILENAME_SIZE + 8];
+  snprintf(tmp_name, sizeof(tmp_name), "%s.part", file_info->name);
+
+  FILE *file = fopen(tmp_name, "w");
+  if (file == NULL) {
+    perror("fopen");
+    return;
+  }
+  if ((file_info->size > 0 && fwrite(data, file_info->size, 1, file) != 1) ||
+      fclose(file) != 0) {
+    perror("fwrite");
+    remove(tmp_name);
+    return;
+  }
+  if (rename(tmp_name, file_info->name) == -1) {
+    perror("rename");
+    remove(tmp_name);
+    return;
+  }
+  printf("Archivo guardado como %s\n", file_info->name);
+}
+
+/*
+ * Whether we can take a multicast transfer with the sender's settings
+ * exactly as they are
+ */
+static bool multicast_acceptable(struct file_metadata *file_info) {
+  return file_info->page_size >= MIN_PAGE_SIZE &&
+         file_info->page_size <= MAX_PAGE_SIZE &&
+         fec_validate(file_info->fec_mode, file_info->fec_data_pages,
+                      file_info->fec_parity_pages) == 0 &&
+         codec_supported(file_info->codec) &&
+         file_info->cipher == CIPHER_NONE &&
+         file_info->transfer == TRANSFER_FULL &&
+         file_info->request == REQUEST_UPLOAD &&
+         valid_filename(file_info->name);
 }
 
 /*
  * Handle initial file transfer setup
  */
-int recv_file_info(struct file_metadata *file_info, int sockfd,
-                   struct sockaddr_storage their_addr, socklen_t addr_len) {
+int recv_file_info(struct file_metadata *file_info, struct base_file *base,
+                   int sockfd, struct sockaddr_storage *their_addr,
+                   socklen_t *addr_len, const unsigned char *psk, int psk_len,
+                   unsigned char *key) {
   int numbytes;
+  int buf[MAX_DATAGRAM_SIZE / sizeof(int)];
+  struct mtu_probe *probe = (struct mtu_probe *)buf;
 
-  memset(file_info, 0, sizeof(struct file_metadata));
-  if ((numbytes = recvfrom(sockfd, file_info, sizeof(struct file_metadata), 0,
-                           (struct sockaddr *)&their_addr, &addr_len)) == -1) {
-    perror("recvfrom");
-    exit(EXIT_FAILURE);
+  // answer path MTU probes and signature requests until the metadata
+  // shows up
+  while (1) {
+    *addr_len = sizeof(struct sockaddr_storage);
+    if ((numbytes = recvfrom(sockfd, buf, sizeof(buf), 0,
+                             (struct sockaddr *)their_addr, addr_len)) ==
+        -1) {
+      perror("recvfrom");
+      exit(EXIT_FAILURE);
+    }
+
+    if (numbytes >= (int)sizeof(struct mtu_probe) &&
+        probe->pagenumber == PROBE_PAGE) {
+      struct mtu_probe reply = {PROBE_PAGE, numbytes};
+      if (sendto(sockfd, &reply, sizeof(reply), 0,
+                 (struct sockaddr *)their_addr, *addr_len) == -1) {
+        perror("sendto");
+      }
+      continue;
+    }
+
+    if (numbytes == sizeof(struct signature_request) &&
+        probe->pagenumber == SIGNATURE_PAGE) {
+      send_signatures(sockfd, base, (struct signature_request *)buf,
+                      their_addr, *addr_len);
+      continue;
+    }
+
+    if (is_metadata(buf, numbytes)) {
+      memcpy(file_info, buf, sizeof(struct file_metadata));
+      // downloads are sent in the clear, which would leak what the key
+      // protects: turned down, naming the cipher we want instead
+      if (psk_len > 0 && file_info->request == REQUEST_DOWNLOAD) {
+        printf("Descarga de %.*s rechazada, clave compartida\n",
+               FILENAME_SIZE - 1, file_info->name);
+        file_info->cipher = CIPHER_AES_GCM;
+        if (send_refusal(sockfd, file_info, their_addr, *addr_len) == -1) {
+          perror("sendto");
+        }
+        continue;
+      }
+      // with a pre-shared key only authenticated uploads are taken: an
+      // unknown cipher must not fall back to plaintext below
+      if (psk_len > 0 && (file_info->cipher == CIPHER_NONE ||
+                          !cipher_supported(file_info->cipher))) {
+        printf("Archivo sin cifrar rechazado\n");
+        file_info->cipher = CIPHER_AES_GCM;
+        if (send_refusal(sockfd, file_info, their_addr, *addr_len) == -1) {
+          perror("sendto");
+        }
+        continue;
+      }
+      // a multicast sender cannot change its settings for one receiver
+      if (file_info->reliability == RELIABILITY_MULTICAST &&
+          !multicast_acceptable(file_info)) {
+        printf("Envío multicast con opciones no soportadas, ignorado\n");
+        continue;
+      }
+      break;
+    }
   }
 
-  struct response response;
-  memset(&response, 0, sizeof(response));
-  response.pagenumber = -1;
-  response.ack = ACK;
+  // answered by serve_download
+  if (file_info->request == REQUEST_DOWNLOAD) {
+    return 0;
+  }
 
-  printf("Aceptando archivo. Enviando respuesta al cliente\n");
+  if (!cipher_supported(file_info->cipher)) {
+    printf("Cifrado %d no soportado\n", file_info->cipher);
+    file_info->cipher = CIPHER_NONE;
+  }
+  // sealed pages carry a tag, so the client shrank them to fit the MTU
+  int overhead = (file_info->cipher != CIPHER_NONE) ? AEAD_TAG_SIZE : 0;
+  if (file_info->page_size < MIN_PAGE_SIZE - overhead ||
+      file_info->page_size > MAX_PAGE_SIZE - overhead) {
+    printf("Tamaño de página %d inválido, usando %d\n", file_info->page_size,
+           DEFAULT_PAGE_SIZE - overhead);
+    file_info->page_size = DEFAULT_PAGE_SIZE - overhead;
+  }
 
-  if ((numbytes = sendto(sockfd, &response, sizeof(response), 0,
-                         (struct sockaddr *)&their_addr, addr_len)) == -1) {
-    perror("sendto");
-    exit(EXIT_FAILURE);
+  // our key share goes back in the reply, in place of the client's
+  if (file_info->cipher != CIPHER_NONE) {
+    struct key_share share;
+    unsigned char client_public[AEAD_PUBLIC_KEY_SIZE];
+    memcpy(client_public, file_info->public_key, AEAD_PUBLIC_KEY_SIZE);
+    if (key_share_generate(&share) == -1 ||
+        aead_derive_key(&share, client_public, client_public,
+                        share.public_key, psk, psk_len, key) == -1) {
+      fprintf(stderr, "Clave del cliente inválida\n");
+      exit(EXIT_FAILURE);
+    }
+    memcpy(file_info->public_key, share.public_key, AEAD_PUBLIC_KEY_SIZE);
+    key_share_free(&share);
+    printf("Páginas cifradas con %s%s\n", cipher_name(file_info->cipher),
+           psk_len > 0 ? ", clave compartida" : "");
+  }
+
+  if (fec_validate(file_info->fec_mode, file_info->fec_data_pages,
+                   file_info->fec_parity_pages) == -1) {
+    printf("FEC %d:%d no soportado, se desactiva\n",
+           file_info->fec_data_pages, file_info->fec_parity_pages);
+    file_info->fec_mode = FEC_NONE;
+  }
+  if (file_info->fec_mode == FEC_NONE) {
+    file_info->fec_data_pages = 0;
+    file_info->fec_parity_pages = 0;
+  }
+  if (file_info->reliability != RELIABILITY_NACK &&
+      file_info->reliability != RELIABILITY_MULTICAST) {
+    file_info->reliability = RELIABILITY_ACK;
+  }
+  if (!codec_supported(file_info->codec)) {
+    printf("Compresión %d no soportada, se desactiva\n", file_info->codec);
+    file_info->codec = CODEC_RAW;
+  }
+  if (!valid_filename(file_info->name)) {
+    printf("Nombre de archivo inválido, se guarda como received\n");
+    strcpy(file_info->name, "received");
+  }
+
+  // the delta can only be applied against the copy we sent signatures of
+  if (file_info->transfer == TRANSFER_DELTA &&
+      load_base(base, file_info->name, file_info->page_size) == -1) {
+    printf("Sin copia de %s, se pide el archivo completo\n", file_info->name);
+    file_info->transfer = TRANSFER_FULL;
+  }
+  if (file_info->transfer != TRANSFER_DELTA) {
+    file_info->transfer = TRANSFER_FULL;
+    file_info->payload_size = file_info->size;
+  }
+
+  // a multicast receiver joins from its own socket, see handle_connection
+  if (file_info->reliability != RELIABILITY_MULTICAST) {
+    printf("Aceptando archivo. Enviando respuesta al cliente\n");
+    if (send_handshake_reply(sockfd, file_info, their_addr, *addr_len) ==
+        -1) {
+      perror("sendto");
+      exit(EXIT_FAILURE);
+    }
   }
 
-  return (file_info->size + PAGE_SIZE - 1) / PAGE_SIZE;
+  return (file_info->payload_size + file_info->page_size - 1) /
+         file_info->page_size;
 }
 
 /*
- * Handle the connection and receive the file
+ * Handle the connection: receive the file, or send ours.
+ * Returns the enum REQUEST served.
  */
-void handle_connection(int sockfd, struct sockaddr_storage their_addr,
-                       socklen_t addr_len) {
+int handle_connection(int sockfd, struct sockaddr_storage their_addr,
+                      socklen_t addr_len, const unsigned char *psk,
+                      int psk_len) {
   struct file_metadata file_info;
+  struct base_file base;
   bool *ack_array = NULL;
   char *file_buf = NULL;
+  unsigned char key[AEAD_KEY_SIZE];
+  struct aead aead = {NULL};
 
+  memset(&base, 0, sizeof(base));
   set_socket_buffers(sockfd);
-  int npages = recv_file_info(&file_info, sockfd, their_addr, addr_len);
-  initialize_buffers(&ack_array, &file_buf, npages);
+  int npages = recv_file_info(&file_info, &base, sockfd, &their_addr,
+                              &addr_len, psk, psk_len, key);
+  if (file_info.request == REQUEST_DOWNLOAD) {
+    serve_download(sockfd, &their_addr, addr_len, &file_info);
+    return REQUEST_DOWNLOAD;
+  }
+  if (file_info.cipher != CIPHER_NONE) {
+    if (aead_init(&aead, file_info.cipher, key, false) == -1) {
+      exit(EXIT_FAILURE);
+    }
+    memset(key, 0, sizeof(key));
+  }
 
-  printf("Recibiendo archivo %s, tamaño %zu bytes, %d páginas\n",
-         file_info.name, file_info.size, npages);
+  // a multicast receiver talks to the sender from a socket of its own: other
+  // receivers on this host may share the group port, and a unicast repair
+  // has to reach us and not them
+  int reply_fd = sockfd;
+  if (file_info.reliability == RELIABILITY_MULTICAST) {
+    reply_fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (reply_fd == -1) {
+      perror("socket");
+      exit(EXIT_FAILURE);
+    }
+    set_socket_buffers(reply_fd);
+    srandom(getpid() ^ metrics_now_us());
+    printf("Uniéndose al envío multicast\n");
+    if (send_handshake_reply(reply_fd, &file_info, &their_addr, addr_len) ==
+        -1) {
+      perror("sendto");
+    }
+  }
+  initialize_buffers(&ack_array, &file_buf, npages, file_info.page_size);
+  int slot = status_begin((struct sockaddr *)&their_addr, addr_len,
+                          file_info.name, file_info.payload_size, npages);
+
+  printf("Recibiendo archivo %s, tamaño %u bytes, %d páginas de %d bytes\n",
+         file_info.name, file_info.size, npages, file_info.page_size);
+  if (file_info.transfer == TRANSFER_DELTA) {
+    printf("Delta de %u bytes contra la copia local de %zu bytes\n",
+           file_info.payload_size, base.size);
+  }
 
   receive_file(sockfd, their_addr, addr_len, &file_info, ack_array, file_buf,
-               npages);
+               npages, slot, aead.ctx != NULL ? &aead : NULL, reply_fd);
+  status_end(slot);
+  aead_free(&aead);
+  if (reply_fd != sockfd) {
+    close(reply_fd);
+  }
+
+  // rebuild the new file from our copy and the received delta
+  char *data = file_buf;
+  if (file_info.transfer == TRANSFER_DELTA) {
+    data = pool_alloc(file_info.size);
+    if (data == NULL) {
+      perror("mmap");
+      exit(EXIT_FAILURE);
+    }
+    if (delta_apply(file_buf, file_info.payload_size, base.data, base.size,
+                    file_info.page_size, data, file_info.size) == -1) {
+      fprintf(stderr, "Delta inválido\n");
+      memset(data, 0, file_info.size);
+    }
+  }
 
   unsigned char hash[HASH_SIZE];
-  calculate_sha256(file_buf, file_info.size, hash);
+  calculate_sha256(data, file_info.size, hash);
   printf("Hash calculado: ");
   printHex(hash);
   printf("Hash recibido: ");
   printHex(file_info.sha256_hash);
   compareHash(hash, file_info.sha256_hash);
 
-  free(file_buf);
-  free(ack_array);
+  // keep it as the base of the next delta
+  if (memcmp(hash, file_info.sha256_hash, HASH_SIZE) == 0) {
+    save_file(&file_info, data);
+  }
+
+  if (data != file_buf) {
+    pool_free(data);
+  }
+  free_base(&base);
+  pool_free(file_buf);
+  pool_free(ack_array);
+  return REQUEST_UPLOAD;
+}
+
+/*
+ * A download in flight: the pages of one cached file and a retransmission
+ * timer for each of them
+ */
+struct download {
+  int sockfd;
+  struct sockaddr_storage *their_addr;
+  socklen_t addr_len;
+  struct cached_file *file;
+  int page_size;
+  struct timer_wheel wheel;
+  struct timer *timers;
+  unsigned char *send_count;
+  uint64_t *sent_at;
+};
+
+static uint64_t now_ms(void) { return metrics_now_us() / 1000; }
+
+/*
+ * Sends a page straight from the mapping, the last one padded to a whole
+ * page like the client pads an upload, and sets its retransmission timer
+ */
+static void send_cached_page(struct download *download, int pagenumber) {
+  static char last[MAX_PAGE_SIZE];
+  size_t page_size = download->page_size;
+  size_t offset = (size_t)pagenumber * page_size;
+  const char *data = download->file->data + offset;
+
+  if (offset + page_size > download->file->size) {
+    memset(last, 0, page_size);
+    memcpy(last, data, download->file->size - offset);
+    data = last;
+  }
+
+  uint64_t start = metrics_now_us();
+  ssize_t sent = send_page_data(
+      download->sockfd, (struct sockaddr *)download->their_addr,
+      download->addr_len, pagenumber, CODEC_RAW, data, page_size);
+  uint64_t now = metrics_now_us();
+  metrics_record(HISTOGRAM_SEND_US, now - start);
+  metrics_inc(METRIC_SOCKET_WRITES);
+  metrics_inc(METRIC_PAGES_SENT);
+  if (sent > 0) {
+    metrics_add(METRIC_BYTES_SENT, sent);
+  }
+
+  // a page the socket buffer had no room for is resent like a lost one
+  unsigned char *copies = &download->send_count[pagenumber];
+  if (*copies > 0) {
+    metrics_inc(METRIC_PAGES_RETRANSMITTED);
+  }
+  if (*copies < UCHAR_MAX) {
+    (*copies)++;
+  }
+  download->sent_at[pagenumber] = now;
+
+  long backoff = (long)TIMEOUT_MS << (*copies < 7 ? *copies - 1 : 6);
+  wheel_schedule(&download->wheel, &download->timers[pagenumber],
+                 now / 1000 + (backoff < MAX_RTO_MS ? backoff : MAX_RTO_MS));
+}
+
+static void resend_page(struct timer *timer) {
+  send_cached_page(timer->owner, timer->id);
+}
+
+/*
+ * Send our copy of @param file_info->name from the file cache, the other
+ * way around from an upload in ACK mode: up to BURST_SIZE pages in flight,
+ * the client acks each one and sends its EOT once it has them all
+ */
+void serve_download(int sockfd, struct sockaddr_storage *their_addr,
+                    socklen_t addr_len, struct file_metadata *file_info) {
+  // the pages go out of the mapping as they are
+  file_info->fec_mode = FEC_NONE;
+  file_info->fec_data_pages = 0;
+  file_info->fec_parity_pages = 0;
+  file_info->reliability = RELIABILITY_ACK;
+  file_info->codec = CODEC_RAW;
+  file_info->transfer = TRANSFER_FULL;
+  if (file_info->page_size < MIN_PAGE_SIZE ||
+      file_info->page_size > MAX_PAGE_SIZE) {
+    file_info->page_size = DEFAULT_PAGE_SIZE;
+  }
+
+  struct cached_file *file =
+      valid_filename(file_info->name) ? file_cache_get(file_info->name) : NULL;
+  if (file == NULL || file->size > UINT_MAX) {
+    printf("Archivo %s no disponible para descarga\n", file_info->name);
+    file_info->cipher = CIPHER_NONE;
+    if (send_refusal(sockfd, file_info, their_addr, addr_len) == -1) {
+      perror("sendto");
+    }
+    file_cache_release(file);
+    return;
+  }
+
+  int page_size = file_info->page_size;
+  int npages = file_cache_npages(file, page_size);
+  file_info->size = file->size;
+  file_info->payload_size = file->size;
+  file_info->npages = npages;
+  memcpy(file_info->sha256_hash, file->sha256, HASH_SIZE);
+  printf("Enviando archivo %s, tamaño %u bytes, %d páginas de %d bytes\n",
+         file_info->name, file_info->size, npages, page_size);
+  if (send_handshake_reply(sockfd, file_info, their_addr, addr_len) == -1) {
+    perror("sendto");
+  }
+
+  struct download download;
+  memset(&download, 0, sizeof(download));
+  download.sockfd = sockfd;
+  download.their_addr = their_addr;
+  download.addr_len = addr_len;
+  download.file = file;
+  download.page_size = page_size;
+  download.timers = malloc((npages + 1) * sizeof(struct timer));
+  download.send_count = calloc(npages + 1, sizeof(unsigned char));
+  download.sent_at = calloc(npages + 1, sizeof(uint64_t));
+  bool *ack_array = pool_calloc(npages + 1);
+  if (download.timers == NULL || download.send_count == NULL ||
+      download.sent_at == NULL || ack_array == NULL) {
+    perror("malloc");
+    exit(EXIT_FAILURE);
+  }
+  wheel_init(&download.wheel, now_ms());
+  for (int p = 0; p < npages; p++) {
+    timer_init(&download.timers[p], &download, p);
+  }
+
+  int slot = status_begin((struct sockaddr *)their_addr, addr_len,
+                          file_info->name, file->size, npages);
+  int next_page = 0, in_flight = 0, acked = 0;
+  bool done = npages == 0;
+  uint64_t last_reply = now_ms();
+  char reply[MTU_SIZE];
+
+  while (!done && acked < npages) {
+    for (; in_flight < BURST_SIZE && next_page < npages;
+         next_page++, in_flight++) {
+      send_cached_page(&download, next_page);
+    }
+
+    if (now_ms() - last_reply > IDLE_TIMEOUTS * TIMEOUT_MS) {
+      printf("El cliente no responde, se cancela la descarga\n");
+      break;
+    }
+
+    fd_set readfds;
+    FD_ZERO(&readfds);
+    FD_SET(sockfd, &readfds);
+    int64_t wait = wheel_timeout(&download.wheel);
+    if (wait < 0 || wait > TIMEOUT_MS) {
+      wait = TIMEOUT_MS;
+    }
+    struct timeval timeout = {0, wait * 1000};
+
+    int retval = select(sockfd + 1, &readfds, NULL, NULL, &timeout);
+    if (retval == -1) {
+      perror("select");
+    } else if (retval == 0) {
+      metrics_inc(METRIC_SELECT_TIMEOUTS);
+    } else {
+      struct sockaddr_storage from;
+      socklen_t from_len = sizeof(from);
+      int numbytes = recvfrom(sockfd, reply, sizeof(reply), 0,
+                              (struct sockaddr *)&from, &from_len);
+      metrics_inc(METRIC_SOCKET_READS);
+      struct response *response = (struct response *)reply;
+      // anyone else has to wait for the next request
+      bool ours =
+          numbytes != -1 && same_peer(&from, from_len, their_addr, addr_len);
+
+      if (ours && is_metadata(reply, numbytes)) {
+        // our handshake reply got lost and the client is asking again
+        last_reply = now_ms();
+        send_handshake_reply(sockfd, file_info, their_addr, addr_len);
+      } else if (ours && numbytes >= (int)sizeof(struct response)) {
+        last_reply = now_ms();
+        int page = response->pagenumber;
+        if (page == EOT_PAGE && response->ack == END_OF_TRANSMISSION) {
+          done = true;
+        } else if (page >= 0 && page < next_page && response->ack == ACK) {
+          metrics_inc(METRIC_ACKS_RECEIVED);
+          if (ack_array[page]) {
+            metrics_inc(METRIC_DUPLICATE_ACKS);
+          } else {
+            ack_array[page] = true;
+            acked++;
+            in_flight--;
+            wheel_cancel(&download.wheel, &download.timers[page]);
+            // Karn: an ack for a resent page could belong to any copy
+            if (download.send_count[page] == 1) {
+              metrics_record(HISTOGRAM_ACK_RTT_US,
+                             metrics_now_us() - download.sent_at[page]);
+            }
+            size_t bytes = (size_t)acked * page_size;
+            status_progress(slot, bytes < file->size ? bytes : file->size,
+                            acked, -1);
+          }
+        }
+      }
+    }
+
+    wheel_advance(&download.wheel, now_ms(), resend_page);
+  }
+
+  printf("Descarga de %s %s\n", file_info->name,
+         (done || acked == npages) ? "completa" : "incompleta");
+  status_end(slot);
+  free(download.timers);
+  free(download.send_count);
+  free(download.sent_at);
+  pool_free(ack_array);
+  file_cache_release(file);
+}
+
+/*
+ * Decompress a page into its slot of the file buffer.
+ * Returns -1 if it does not expand to exactly a page.
+ */
+static int store_page(struct file_page *file_page, char *dst,
+                      size_t page_size) {
+  if (file_page->codec == CODEC_RAW) {
+    if (file_page->length != page_size) {
+      return -1;
+    }
+    memcpy(dst, file_page->data, page_size);
+    return 0;
+  }
+
+  long len = decompress_block(file_page->codec, file_page->data,
+                              file_page->length, dst, page_size);
+  return (len == (long)page_size) ? 0 : -1;
+}
+
+/*
+ * Acknowledge a single page to the client
+ */
+static void send_ack(int sockfd, char *reply, int pagenumber,
+                     struct sockaddr_storage *their_addr, socklen_t addr_len) {
+  struct response *response = (struct response *)reply;
+  response[0].pagenumber = pagenumber;
+  response[0].ack = ACK;
+
+  if (sendto(sockfd, reply, sizeof(struct response), 0,
+             (struct sockaddr *)their_addr, addr_len) == -1) {
+    perror("sendto");
+  }
+  metrics_inc(METRIC_ACKS_SENT);
+}
+
+/*
+ * Report the missing pages in [@param *first_missing, @param limit)
+ * Advances @param *first_missing past the pages already received
+ */
+static void send_nack_report(int sockfd, bool *ack_array, int *first_missing,
+                             int limit, struct sockaddr_storage *their_addr,
+                             socklen_t addr_len) {
+  struct nack_report report;
+  report.pagenumber = NACK_PAGE;
+  report.ack = NACK;
+  report.ngaps = 0;
+
+  while (*first_missing < limit && ack_array[*first_missing]) {
+    (*first_missing)++;
+  }
+
+  int page = *first_missing;
+  while (page < limit && report.ngaps < NACK_MAX_GAPS) {
+    if (ack_array[page]) {
+      page++;
+      continue;
+    }
+    struct gap *gap = &report.gaps[report.ngaps++];
+    gap->first = page;
+    while (page < limit && !ack_array[page]) {
+      page++;
+    }
+    gap->count = page - gap->first;
+  }
+
+  if (report.ngaps == 0) {
+    return;
+  }
+
+  size_t len = offsetof(struct nack_report, gaps) +
+               report.ngaps * sizeof(struct gap);
+  if (sendto(sockfd, &report, len, 0, (struct sockaddr *)their_addr,
+             addr_len) == -1) {
+    perror("sendto");
+  }
+  metrics_inc(METRIC_NACK_REPORTS_SENT);
+}
+
+/*
+ * A multicast receiver's NACK held back until due_us, so that one receiver
+ * asks for a lost page and the others hear the sender confirm it, and never
+ * sent sooner than holdoff_us after the previous one
+ */
+struct pending_nack {
+  uint64_t due_us;
+  uint64_t holdoff_us;
+  int limit;
+};
+
+static void schedule_nack(struct pending_nack *nack, int limit) {
+  if (limit > nack->limit) {
+    nack->limit = limit;
+  }
+  if (nack->due_us != 0) {
+    return;
+  }
+  uint64_t now = metrics_now_us();
+  uint64_t earliest = (now > nack->holdoff_us) ? now : nack->holdoff_us;
+  nack->due_us = earliest + random() % (MCAST_NACK_BACKOFF_MS * 1000) + 1;
+}
+
+/*
+ * Sends the held back NACK once it is due.
+ * Returns the microseconds until it is, -1 if there is none.
+ */
+static long flush_nack(int sockfd, struct pending_nack *nack, bool *ack_array,
+                       int *first_missing, struct sockaddr_storage *their_addr,
+                       socklen_t addr_len) {
+  if (nack->due_us == 0) {
+    return -1;
+  }
+  uint64_t now = metrics_now_us();
+  if (now < nack->due_us) {
+    return nack->due_us - now;
+  }
+  send_nack_report(sockfd, ack_array, first_missing, nack->limit, their_addr,
+                   addr_len);
+  nack->due_us = 0;
+  nack->holdoff_us = now + MCAST_NACK_HOLDOFF_MS * 1000;
+  return -1;
+}
+
+/*
+ * Drops the held back NACK if the sender confirms it is repairing every page
+ * we miss: another receiver already asked for them
+ */
+static void confirm_nack(struct pending_nack *nack, const bool *ack_array,
+                         int first_missing, const struct nack_report *ncf) {
+  if (nack->due_us == 0) {
+    return;
+  }
+  // both lists of gaps are in page order
+  int g = 0;
+  for (int page = first_missing; page < nack->limit; page++) {
+    if (ack_array[page]) {
+      continue;
+    }
+    while (g < ncf->ngaps &&
+           ncf->gaps[g].first + ncf->gaps[g].count <= page) {
+      g++;
+    }
+    if (g == ncf->ngaps || ncf->gaps[g].first > page) {
+      return;
+    }
+  }
+  nack->due_us = 0;
+  nack->holdoff_us = metrics_now_us() + MCAST_NACK_HOLDOFF_MS * 1000;
+  metrics_inc(METRIC_NACKS_SUPPRESSED);
 }
 
 /*
  * Receive the file from the client
- * Gets the page from the buffer and sends an ack
+ * Gets the page from the buffer and sends an ack, or in NACK mode
+ * periodically reports the gaps. In multicast pages arrive on @param sockfd
+ * and everything to and from the sender alone goes through @param reply_fd.
  */
 void receive_file(int sockfd, struct sockaddr_storage their_addr,
                   socklen_t addr_len, struct file_metadata *file_info,
-                  bool *ack_array, char *file_buf, int npages) {
-  int numbytes, recvd_pages = 0, tries_remaining = 5;
-  struct file_page file_page;
+                  bool *ack_array, char *file_buf, int npages, int slot,
+                  struct aead *aead, int reply_fd) {
+  int numbytes, recvd_pages = 0, tries_remaining = 5, duplicate_pages = 0;
+  size_t page_size = file_info->page_size;
+  size_t datagram_size =
+      PAGE_HEADER_SIZE + page_size + (aead != NULL ? AEAD_TAG_SIZE : 0);
+  int corrupt_pages = 0, forged_pages = 0;
   char reply[MTU_SIZE];
   struct response *response = (struct response *)reply;
 
+  bool nack_mode = file_info->reliability != RELIABILITY_ACK;
+  bool multicast = file_info->reliability == RELIABILITY_MULTICAST;
+  int idle = 0, highest_seen = -1, first_missing = 0, since_report = 0;
+  uint64_t last_arrival = 0;
+  struct pending_nack nack = {0, 0, 0};
+  int maxfd = (sockfd > reply_fd) ? sockfd : reply_fd;
+
+  struct fec_state fec;
+  initialize_fec(&fec, file_info, npages);
+  int nparity = fec.ngroups * fec.parity_pages;
+  int recovered[FEC_MAX_PARITY_PAGES];
+  int total_recovered = 0;
+
+  struct file_page *file_page = malloc(datagram_size);
+  if (file_page == NULL) {
+    perror("malloc");
+    exit(EXIT_FAILURE);
+  }
+
   while (tries_remaining > 0 && recvd_pages < npages) {
     memset(&reply, 0, MTU_SIZE);
-    memset(&file_page, 0, sizeof(struct file_page));
 
     fd_set readfds;
     FD_ZERO(&readfds);
     FD_SET(sockfd, &readfds);
+    FD_SET(reply_fd, &readfds);
     struct timeval timeout = {TIMEOUT_SEC, TIMEOUT_USEC};
 
+    // wake up in time for a held back NACK
+    long nack_wait = flush_nack(reply_fd, &nack, ack_array, &first_missing,
+                                &their_addr, addr_len);
+    if (nack_wait >= 0) {
+      timeout.tv_sec = 0;
+      timeout.tv_usec = nack_wait;
+    }
+
+    int retval = select(maxfd + 1, &readfds, NULL, NULL, &timeout);
+    if (retval == -1) {
+      perror("select");
+      tries_remaining--;
+      continue;
+    } else if (retval == 0 && nack_wait >= 0) {
+      continue;
+    } else if (retval == 0) {
+      metrics_inc(METRIC_SELECT_TIMEOUTS);
+      if (++idle == IDLE_TIMEOUTS) {
+        fprintf(stderr, "Cliente inactivo, abortando recepción\n");
+        break;
+      }
+      // the client may be done sending: report everything still missing
+      if (multicast) {
+        schedule_nack(&nack, npages);
+      } else if (nack_mode) {
+        send_nack_report(sockfd, ack_array, &first_missing, npages,
+                         &their_addr, addr_len);
+      }
+      continue;
+    }
+    idle = 0;
+
     // Get page
-    if ((numbytes = recvfrom(sockfd, &file_page, MTU_SIZE, 0,
-                             (struct sockaddr *)&their_addr, &addr_len)) ==
-        -1) {
+    int fd = FD_ISSET(reply_fd, &readfds) ? reply_fd : sockfd;
+    struct sockaddr_storage from;
+    socklen_t from_len = sizeof(from);
+    if ((numbytes = recvfrom(fd, file_page, datagram_size, 0,
+                             (struct sockaddr *)&from, &from_len)) == -1) {
       perror("recvfrom");
       tries_remaining--;
       continue;
     }
+    // only the client that did the handshake sends pages; anyone else
+    // would get our acks and reports redirected to them
+    if (!same_peer(&from, from_len, &their_addr, addr_len)) {
+      continue;
+    }
+
+    // our handshake reply got lost and the client is asking again; a
+    // multicast sender asks when it has nothing left to send
+    if (is_metadata(file_page, numbytes)) {
+      if (multicast) {
+        schedule_nack(&nack, npages);
+      } else {
+        send_handshake_reply(sockfd, file_info, &their_addr, addr_len);
+      }
+      continue;
+    }
+
+    if (numbytes < (int)PAGE_HEADER_SIZE) {
+      continue;
+    }
+
+    // the sender is repairing these pages for another receiver
+    if (multicast && file_page->pagenumber == NCF_PAGE) {
+      struct nack_report *ncf = (struct nack_report *)file_page;
+      if (numbytes >= (int)offsetof(struct nack_report, gaps) &&
+          ncf->ngaps >= 0 && ncf->ngaps <= NACK_MAX_GAPS &&
+          numbytes >= (int)(offsetof(struct nack_report, gaps) +
+                            ncf->ngaps * sizeof(struct gap))) {
+        confirm_nack(&nack, ack_array, first_missing, ncf);
+      }
+      continue;
+    }
 
     // A -99 pagenumber means client closed the connection
-    if (file_page.pagenumber == -99) {
+    if (file_page->pagenumber == EOT_PAGE) {
       break;
     }
 
-    // printf("Page: %d", file_page.pagenumber);
+    // printf("Page: %d", file_page->pagenumber);
+
+    if (numbytes != (int)(PAGE_HEADER_SIZE + file_page->length) ||
+        file_page->pagenumber < 0 ||
+        file_page->pagenumber >= npages + nparity) {
+      continue;
+    }
+
+    // anything that does not authenticate never reaches the file
+    if (aead != NULL) {
+      long len = aead_open(aead, file_page->pagenumber, file_page->codec,
+                           file_page->data, file_page->length,
+                           file_page->data);
+      if (len == -1) {
+        forged_pages++;
+        continue;
+      }
+      file_page->length = len;
+    }
+
+    uint64_t now = metrics_now_us();
+    if (last_arrival != 0) {
+      metrics_record(HISTOGRAM_PAGE_INTERARRIVAL_US, now - last_arrival);
+    }
+    last_arrival = now;
+    metrics_inc(METRIC_PAGES_RECEIVED);
+    metrics_inc(METRIC_SOCKET_READS);
+    metrics_add(METRIC_BYTES_RECEIVED, numbytes);
+
+    // Parity pages are never acked, they only serve to rebuild lost pages
+    if (file_page->pagenumber >= npages) {
+      int index = file_page->pagenumber - npages;
+      if (!fec.parity_array[index] && file_page->codec == CODEC_RAW &&
+          file_page->length == page_size) {
+        fec.parity_array[index] = true;
+        memcpy(fec.parity_buf + index * page_size, file_page->data,
+               page_size);
+      }
+    } else {
+      // We only store the page if it hasnt been received yet
+      if (!ack_array[file_page->pagenumber]) {
+        size_t offset = file_page->pagenumber * page_size;
 
-    // We only store the page if it hasnt been received yet
-    if (!ack_array[file_page.pagenumber]) {
+        // decompressed on arrival; a corrupt page is left for retransmission
+        if (store_page(file_page, file_buf + offset, page_size) == -1) {
+          corrupt_pages++;
+          metrics_inc(METRIC_CORRUPT_PAGES);
+          continue;
+        }
+        ack_array[file_page->pagenumber] = true;
+        recvd_pages++;
+      } else {
+        duplicate_pages++;
+        metrics_inc(METRIC_DUPLICATE_PAGES);
+      }
 
-      ack_array[file_page.pagenumber] = true;
-      size_t offset = file_page.pagenumber * PAGE_SIZE;
+      if (file_page->pagenumber > highest_seen) {
+        highest_seen = file_page->pagenumber;
+      }
 
-      memcpy(file_buf + offset, file_page.data, PAGE_SIZE);
-      recvd_pages++;
+      // printf("OK \n");
+      if (!nack_mode) {
+        send_ack(sockfd, reply, file_page->pagenumber, &their_addr, addr_len);
+      }
     }
 
-    response[0].pagenumber = file_page.pagenumber;
-    response[0].ack = ACK;
+    if (fec.mode != FEC_NONE) {
+      int group = (file_page->pagenumber < npages)
+                      ? file_page->pagenumber / fec.data_pages
+                      : (file_page->pagenumber - npages) / fec.parity_pages;
+      int n = recover_group(&fec, group, ack_array, file_buf, npages,
+                            recovered);
 
-    // printf("OK \n");
-    if ((numbytes = sendto(sockfd, reply, sizeof(reply), 0,
-                           (struct sockaddr *)&their_addr, addr_len)) == -1) {
-      perror("sendto");
+      // ack rebuilt pages so the client does not retransmit them
+      for (int i = 0; i < n && !nack_mode; i++) {
+        send_ack(sockfd, reply, recovered[i], &their_addr, addr_len);
+      }
+      recvd_pages += n;
+      total_recovered += n;
+      metrics_add(METRIC_FEC_RECOVERED_PAGES, n);
+    }
+
+    uint64_t received = (uint64_t)recvd_pages * page_size;
+    status_progress(slot,
+                    received < file_info->payload_size
+                        ? received
+                        : file_info->payload_size,
+                    recvd_pages, duplicate_pages);
+
+    // Gaps inside the last group may still be filled by its parity, so only
+    // report up to the start of the group holding the highest page
+    if (nack_mode && ++since_report >= NACK_INTERVAL) {
+      int limit = highest_seen;
+      if (fec.mode != FEC_NONE) {
+        limit -= highest_seen % fec.data_pages;
+      }
+      if (multicast) {
+        schedule_nack(&nack, limit);
+      } else {
+        send_nack_report(sockfd, ack_array, &first_missing, limit,
+                         &their_addr, addr_len);
+      }
+      since_report = 0;
     }
   }
 
+  if (fec.mode != FEC_NONE) {
+    printf("Páginas recuperadas por FEC: %d\n", total_recovered);
+  }
+  if (corrupt_pages > 0) {
+    printf("Páginas descartadas por no descomprimir: %d\n", corrupt_pages);
+  }
+  if (forged_pages > 0) {
+    printf("Páginas descartadas por no autenticar: %d\n", forged_pages);
+  }
+  free_fec(&fec);
+
   // transmission done, send finish to client
-  response[0].pagenumber = -99;
+  response[0].pagenumber = EOT_PAGE;
   response[0].ack = END_OF_TRANSMISSION;
 
   printf("Sending eot ");
-  if ((numbytes = sendto(sockfd, reply, sizeof(reply), 0,
+  if ((numbytes = sendto(reply_fd, reply, sizeof(struct response), 0,
                          (struct sockaddr *)&their_addr, addr_len)) == -1) {
     perror("sendto");
   }
+
+  // Without per page acks the completion report is the only signal the
+  // client gets: repeat it while retransmissions keep arriving. A multicast
+  // sender keeps repairing for the others, only its polls get an answer.
+  if (nack_mode && recvd_pages == npages) {
+    idle = 0;
+    while (idle < MAX_RETRIES) {
+      fd_set readfds;
+      FD_ZERO(&readfds);
+      FD_SET(sockfd, &readfds);
+      FD_SET(reply_fd, &readfds);
+      struct timeval timeout = {TIMEOUT_SEC, TIMEOUT_USEC};
+
+      if (select(maxfd + 1, &readfds, NULL, NULL, &timeout) <= 0) {
+        idle++;
+        continue;
+      }
+      int fd = FD_ISSET(reply_fd, &readfds) ? reply_fd : sockfd;
+      struct sockaddr_storage from;
+      socklen_t from_len = sizeof(from);
+      if ((numbytes = recvfrom(fd, file_page, datagram_size, 0,
+                               (struct sockaddr *)&from, &from_len)) == -1) {
+        break;
+      }
+      if (!same_peer(&from, from_len, &their_addr, addr_len) ||
+          (multicast && !is_metadata(file_page, numbytes))) {
+        continue;
+      }
+      if (sendto(reply_fd, reply, sizeof(struct response), 0,
+                 (struct sockaddr *)&their_addr, addr_len) == -1) {
+        perror("sendto");
+      }
+    }
+  }
+
+  free(file_page);
 }
@@ -0,0 +1,333 @@
+#define _GNU_SOURCE
+#include "../include/status.h"
+
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#define PEER_SIZE (NI_MAXHOST + NI_MAXSERV + 3)
+#define FILE_SIZE 64
+// how often the status thread samples the slots to compute current rates
+#define SAMPLE_INTERVAL_MS 1000
+
+/*
+ * One transfer. seq is odd while the owner is writing it.
+ */
+struct session {
+  uint64_t seq;
+  bool active;
+  char peer[PEER_SIZE];
+  char file[FILE_SIZE];
+  uint64_t size;
+  uint64_t bytes;
+  int64_t pages;
+  int64_t total_pages;
+  int64_t retransmits;
+  uint64_t started_us;
+};
+
+/*
+ * Progress of a slot as seen by the status thread at some point in time
+ */
+struct sample {
+  uint64_t started_us;
+  uint64_t bytes;
+  uint64_t at_us;
+};
+
+static struct session sessions[STATUS_MAX_SESSIONS];
+static int claimed[STATUS_MAX_SESSIONS];
+
+static const char *program_name = "unknown";
+static char socket_path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+static struct sample previous[STATUS_MAX_SESSIONS], last[STATUS_MAX_SESSIONS];
+
+static uint64_t now_us(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static void write_begin(struct session *s) {
+  __atomic_store_n(&s->seq, s->seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void write_end(struct session *s) {
+  __atomic_store_n(&s->seq, s->seq + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Copies a slot, retrying while its owner is halfway through an update.
+ * Returns whether it holds a transfer.
+ */
+static bool read_session(struct session *s, struct session *copy) {
+  while (1) {
+    uint64_t before = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+    if (before & 1) {
+      sched_yield();
+      continue;
+    }
+    memcpy(copy, s, sizeof(struct session));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&s->seq, __ATOMIC_RELAXED) == before) {
+      return copy->active;
+    }
+  }
+}
+
+int status_begin(const struct sockaddr *peer, socklen_t peer_len,
+                 const char *file, uint64_t size, int64_t total_pages) {
+  int slot = -1;
+  for (int i = 0; i < STATUS_MAX_SESSIONS && slot == -1; i++) {
+    int expected = 0;
+    if (__atomic_compare_exchange_n(&claimed[i], &expected, 1, false,
+                                    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+      slot = i;
+    }
+  }
+  if (slot == -1) {
+    return -1;
+  }
+
+  char host[NI_MAXHOST], port[NI_MAXSERV];
+  if (getnameinfo(peer, peer_len, host, sizeof(host), port, sizeof(port),
+                  NI_NUMERICHOST | NI_NUMERICSERV) != 0) {
+    strcpy(host, "?");
+    strcpy(port, "?");
+  }
+
+  struct session *s = &sessions[slot];
+  write_begin(s);
+  snprintf(s->peer, PEER_SIZE, strchr(host, ':') ? "[%s]:%s" : "%s:%s", host,
+           port);
+  snprintf(s->file, FILE_SIZE, "%s", file);
+  s->size = size;
+  s->bytes = 0;
+  s->pages = total_pages < 0 ? -1 : 0;
+  s->total_pages = total_pages;
+  s->retransmits = 0;
+  s->started_us = now_us();
+  s->active = true;
+  write_end(s);
+  return slot;
+}
+
+void status_progress(int slot, uint64_t bytes, int64_t pages,
+                     int64_t retransmits) {
+  if (slot < 0) {
+    return;
+  }
+  struct session *s = &sessions[slot];
+  write_begin(s);
+  s->bytes = bytes;
+  s->pages = pages;
+  s->retransmits = retransmits;
+  write_end(s);
+}
+
+void status_end(int slot) {
+  if (slot < 0) {
+    return;
+  }
+  struct session *s = &sessions[slot];
+  write_begin(s);
+  s->active = false;
+  write_end(s);
+  __atomic_store_n(&claimed[slot], 0, __ATOMIC_RELEASE);
+}
+
+/*
+ * Remembers where every transfer was, keeping the sample before it, so the
+ * current rate covers the last one to two intervals
+ */
+static void take_samples(void) {
+  uint64_t now = now_us();
+  for (int i = 0; i < STATUS_MAX_SESSIONS; i++) {
+    struct session copy;
+    if (!read_session(&sessions[i], &copy)) {
+      continue;
+    }
+    if (copy.started_us != last[i].started_us) {
+      last[i] = (struct sample){copy.started_us, 0, copy.started_us};
+    }
+    previous[i] = last[i];
+    last[i] = (struct sample){copy.started_us, copy.bytes, now};
+  }
+}
+
+static void write_string(FILE *out, const char *str) {
+  fputc('"', out);
+  for (const unsigned char *c = (const unsigned char *)str; *c; c++) {
+    if (*c == '"' || *c == '\\') {
+      fprintf(out, "\\%c", *c);
+    } else if (*c < 0x20) {
+      fprintf(out, "\\u%04x", *c);
+    } else {
+      fputc(*c, out);
+    }
+  }
+  fputc('"', out);
+}
+
+static void write_int(FILE *out, const char *key, int64_t value) {
+  if (value < 0) {
+    fprintf(out, ", \"%s\": null", key);
+  } else {
+    fprintf(out, ", \"%s\": %lld", key, (long long)value);
+  }
+}
+
+static void write_status(FILE *out) {
+  uint64_t now = now_us();
+  fprintf(out, "{\"program\": \"%s\", \"pid\": %d, \"sessions\": [",
+          program_name, (int)getpid());
+
+  int written = 0;
+  for (int i = 0; i < STATUS_MAX_SESSIONS; i++) {
+    struct session s;
+    if (!read_session(&sessions[i], &s)) {
+      continue;
+    }
+
+    // bytes over the last sampling window, or since the start when the
+    // transfer is younger than that
+    struct sample from = {s.started_us, 0, s.started_us};
+    if (previous[i].started_us == s.started_us && previous[i].at_us < now) {
+      from = previous[i];
+    }
+    double seconds = (now - from.at_us) / 1e6;
+    double rate = (seconds > 0 && s.bytes >= from.bytes)
+                      ? (s.bytes - from.bytes) / seconds
+                      : 0;
+
+    fprintf(out, "%s{\"peer\": ", written++ ? ", " : "");
+    write_string(out, s.peer);
+    fprintf(out, ", \"file\": ");
+    write_string(out, s.file);
+    fprintf(out, ", \"size\": %llu, \"bytes_received\": %llu",
+            (unsigned long long)s.size, (unsigned long long)s.bytes);
+    write_int(out, "pages_received", s.pages);
+    write_int(out, "total_pages", s.total_pages);
+    write_int(out, "retransmits", s.retransmits);
+    fprintf(out, ", \"elapsed_ms\": %.3f, \"rate_bytes_per_sec\": %.0f",
+            (now - s.started_us) / 1000.0, rate);
+    if (rate > 0 && s.size >= s.bytes) {
+      fprintf(out, ", \"eta_ms\": %.0f", (s.size - s.bytes) / rate * 1000);
+    } else {
+      fprintf(out, ", \"eta_ms\": null");
+    }
+    fprintf(out, "}");
+  }
+  fprintf(out, "]}\n");
+}
+
+static void answer(int fd) {
+  char *text = NULL;
+  size_t len = 0;
+  FILE *out = open_memstream(&text, &len);
+  if (out == NULL) {
+    return;
+  }
+  write_status(out);
+  fclose(out);
+
+  // whoever connected has a second to read it
+  struct timeval timeout = {1, 0};
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+  for (size_t sent = 0; sent < len;) {
+    ssize_t n = send(fd, text + sent, len - sent, MSG_NOSIGNAL);
+    if (n <= 0) {
+      break;
+    }
+    sent += n;
+  }
+  free(text);
+}
+
+static void *status_loop(void *arg) {
+  int listenfd = *(int *)arg;
+  free(arg);
+
+  uint64_t next_sample = now_us();
+  while (1) {
+    uint64_t now = now_us();
+    if (now >= next_sample) {
+      take_samples();
+      next_sample = now + SAMPLE_INTERVAL_MS * 1000;
+    }
+
+    struct pollfd pfd = {listenfd, POLLIN, 0};
+    if (poll(&pfd, 1, (next_sample - now) / 1000 + 1) <= 0) {
+      continue;
+    }
+    int fd = accept(listenfd, NULL, NULL);
+    if (fd == -1) {
+      continue;
+    }
+    answer(fd);
+    close(fd);
+  }
+  return NULL;
+}
+
+static void remove_socket(void) { unlink(socket_path); }
+
+void status_init(const char *program) {
+  program_name = program;
+
+  const char *path = getenv("TRANSFER_STATUS");
+  if (path == NULL || path[0] == '\0') {
+    return;
+  }
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "TRANSFER_STATUS: path too long\n");
+    return;
+  }
+  strcpy(addr.sun_path, path);
+
+  int listenfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (listenfd == -1) {
+    perror("TRANSFER_STATUS: socket");
+    return;
+  }
+  // a previous run that was killed leaves its socket behind
+  unlink(path);
+  if (bind(listenfd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+      listen(listenfd, 8) == -1) {
+    perror("TRANSFER_STATUS");
+    close(listenfd);
+    return;
+  }
+  chmod(path, S_IRUSR | S_IWUSR);
+  strcpy(socket_path, path);
+  atexit(remove_socket);
+
+  int *arg = malloc(sizeof(int));
+  pthread_t thread;
+  if (arg == NULL) {
+    close(listenfd);
+    return;
+  }
+  *arg = listenfd;
+  if (pthread_create(&thread, NULL, status_loop, arg) != 0) {
+    perror("TRANSFER_STATUS: pthread_create");
+    free(arg);
+    close(listenfd);
+    return;
+  }
+  pthread_detach(thread);
+}
@@ -0,0 +1,135 @@
+#include "../include/timer_wheel.h"
+
+#include <stddef.h>
+#include <string.h>
+
+#define LEVEL_SHIFT(level) (WHEEL_BITS * (level))
+// furthest a timer can be scheduled, later deadlines are clamped to it
+#define WHEEL_RANGE ((uint64_t)1 << LEVEL_SHIFT(WHEEL_LEVELS))
+
+void wheel_init(struct timer_wheel *wheel, uint64_t now) {
+  memset(wheel, 0, sizeof(struct timer_wheel));
+  wheel->now = now;
+}
+
+void timer_init(struct timer *timer, void *owner, int id) {
+  memset(timer, 0, sizeof(struct timer));
+  timer->owner = owner;
+  timer->id = id;
+}
+
+static void link_timer(struct timer **slot, struct timer *timer) {
+  timer->next = *slot;
+  if (*slot != NULL) {
+    (*slot)->pprev = &timer->next;
+  }
+  *slot = timer;
+  timer->pprev = slot;
+}
+
+static void unlink_timer(struct timer *timer) {
+  *timer->pprev = timer->next;
+  if (timer->next != NULL) {
+    timer->next->pprev = timer->pprev;
+  }
+  timer->next = NULL;
+  timer->pprev = NULL;
+}
+
+/*
+ * Puts the timer in the lowest level whose span still reaches its deadline,
+ * and not before tick @param earliest
+ */
+static void place(struct timer_wheel *wheel, struct timer *timer,
+                  uint64_t earliest) {
+  uint64_t expires = timer->expires;
+  if (expires < earliest) {
+    expires = earliest;
+  }
+  if (expires - wheel->now >= WHEEL_RANGE) {
+    expires = wheel->now + WHEEL_RANGE - 1;
+  }
+
+  uint64_t delta = expires - wheel->now;
+  int level = 0;
+  while (level < WHEEL_LEVELS - 1 &&
+         delta >= ((uint64_t)1 << LEVEL_SHIFT(level + 1))) {
+    level++;
+  }
+  int slot = (expires >> LEVEL_SHIFT(level)) & (WHEEL_SLOTS - 1);
+  link_timer(&wheel->slots[level][slot], timer);
+}
+
+void wheel_schedule(struct timer_wheel *wheel, struct timer *timer,
+                    uint64_t expires) {
+  if (timer_pending(timer)) {
+    unlink_timer(timer);
+  } else {
+    wheel->pending++;
+  }
+  timer->expires = expires;
+  // the current tick has already been run
+  place(wheel, timer, wheel->now + 1);
+}
+
+void wheel_cancel(struct timer_wheel *wheel, struct timer *timer) {
+  if (timer_pending(timer)) {
+    unlink_timer(timer);
+    wheel->pending--;
+  }
+}
+
+/*
+ * Moves the timers of a higher level slot down, now that they are close.
+ * Runs before the current tick, so timers due now still expire on it.
+ */
+static void cascade(struct timer_wheel *wheel, int level) {
+  int slot = (wheel->now >> LEVEL_SHIFT(level)) & (WHEEL_SLOTS - 1);
+  struct timer *timer = wheel->slots[level][slot];
+  wheel->slots[level][slot] = NULL;
+
+  while (timer != NULL) {
+    struct timer *next = timer->next;
+    place(wheel, timer, wheel->now);
+    timer = next;
+  }
+}
+
+void wheel_advance(struct timer_wheel *wheel, uint64_t now,
+                   void (*expire)(struct timer *timer)) {
+  while (wheel->now < now) {
+    if (wheel->pending == 0) {
+      wheel->now = now;
+      break;
+    }
+    wheel->now++;
+
+    for (int level = 1; level < WHEEL_LEVELS; level++) {
+      if (wheel->now & (((uint64_t)1 << LEVEL_SHIFT(level)) - 1)) {
+        break;
+      }
+      cascade(wheel, level);
+    }
+
+    struct timer **slot = &wheel->slots[0][wheel->now & (WHEEL_SLOTS - 1)];
+    while (*slot != NULL) {
+      struct timer *timer = *slot;
+      unlink_timer(timer);
+      wheel->pending--;
+      expire(timer);
+    }
+  }
+}
+
+int64_t wheel_timeout(const struct timer_wheel *wheel) {
+  if (wheel->pending == 0) {
+    return -1;
+  }
+  for (int ticks = 1; ticks < WHEEL_SLOTS; ticks++) {
+    if (wheel->slots[0][(wheel->now + ticks) & (WHEEL_SLOTS - 1)] != NULL) {
+      return ticks;
+    }
+  }
+  // only later timers: wake up for the next cascade
+  return WHEEL_SLOTS - (wheel->now & (WHEEL_SLOTS - 1));
+}
@@ -0,0 +1,642 @@
+/*
+ * Benchmark harness for the TCP and UDP transfer programs.
+ *
+ * Generates payloads of the requested sizes, runs every client/server pair
+ * over loopback a number of times and reports completion time percentiles,
+ * throughput and CPU time per GB as CSV and JSON. Every run is checked
+ * against the copy the server saved, so a broken transfer shows up as a
+ * failure instead of a fast run.
+ *
+ * With -r the UDP runs go through udprelay, which injects loss, delay,
+ * reordering and so on; the bytes the client put on the wire then give the
+ * retransmission overhead.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <math.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_SIZES 16
+#define MAX_ARGS 32
+#define CLIENT_TIMEOUT_SEC 120
+#define SERVER_START_USEC 200000
+#define SERVER_EXIT_MSEC 5000
+
+// the TCP server keeps the whole file in a buffer of this size
+#define TCP_MAX_SIZE 10000000
+
+struct protocol {
+  const char *name;
+  const char *client;
+  const char *server;
+  // the UDP server exits after every transfer, the TCP one keeps serving
+  bool one_shot;
+  char *extra_args[MAX_ARGS];
+  int nextra;
+  // impairment relay in front of the server, NULL for a direct path
+  const char *relay;
+  char *relay_args[MAX_ARGS];
+  int nrelay;
+};
+
+struct result {
+  const char *protocol;
+  size_t size;
+  int runs;
+  int failures;
+  double p50_ms;
+  double p99_ms;
+  double mean_ms;
+  double throughput_mbps;
+  double cpu_sec_per_gb;
+  const char *impairment;
+  // client bytes on the wire over payload bytes, minus one; NAN without relay
+  double wire_overhead_pct;
+};
+
+struct options {
+  size_t sizes[MAX_SIZES];
+  int nsizes;
+  int runs;
+  int port;
+  bool text;
+  const char *protocols;
+  const char *output;
+  const char *tcp_args;
+  const char *udp_args;
+  const char *relay_args;
+  const char *bin_dir;
+};
+
+static char scratch[] = "/tmp/benchXXXXXX";
+
+static void usage(const char *program) {
+  fprintf(stderr,
+          "usage: %s [-s sizes] [-n runs] [-p tcp,udp] [-o prefix] [-g random|text]\n"
+          "          [-P port] [-t 'tcp client args'] [-u 'udp client args']\n"
+          "          [-r 'udprelay args'] [-b repo]\n"
+          "  sizes are a comma separated list with an optional K, M or G suffix\n",
+          program);
+  exit(EXIT_FAILURE);
+}
+
+static double now_ms(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000.0 + now.tv_nsec / 1e6;
+}
+
+static double rusage_sec(const struct rusage *usage) {
+  return usage->ru_utime.tv_sec + usage->ru_utime.tv_usec / 1e6 +
+         usage->ru_stime.tv_sec + usage->ru_stime.tv_usec / 1e6;
+}
+
+static size_t parse_size(const char *arg) {
+  char *end;
+  double value = strtod(arg, &end);
+  switch (*end) {
+  case 'k':
+  case 'K':
+    value *= 1024;
+    break;
+  case 'm':
+  case 'M':
+    value *= 1024 * 1024;
+    break;
+  case 'g':
+  case 'G':
+    value *= 1024.0 * 1024 * 1024;
+    break;
+  case '\0':
+    break;
+  default:
+    fprintf(stderr, "Invalid size %s\n", arg);
+    exit(EXIT_FAILURE);
+  }
+  return (size_t)value;
+}
+
+static void parse_sizes(struct options *opts, char *arg) {
+  opts->nsizes = 0;
+  for (char *tok = strtok(arg, ","); tok != NULL; tok = strtok(NULL, ",")) {
+    if (opts->nsizes == MAX_SIZES) {
+      fprintf(stderr, "At most %d sizes\n", MAX_SIZES);
+      exit(EXIT_FAILURE);
+    }
+    opts->sizes[opts->nsizes++] = parse_size(tok);
+  }
+}
+
+/*
+ * Splits @param args on spaces into @param out, returns how many there are
+ */
+static int split_args(char **out, const char *args) {
+  int n = 0;
+  if (args == NULL) {
+    return 0;
+  }
+  char *copy = strdup(args);
+  for (char *tok = strtok(copy, " "); tok != NULL && n < MAX_ARGS;
+       tok = strtok(NULL, " ")) {
+    out[n++] = tok;
+  }
+  return n;
+}
+
+/*
+ * Seeded payloads so every run of the suite sends the same bytes.
+ * Text payloads are built from a small vocabulary, so they compress.
+ */
+static void generate_payload(const char *path, size_t size, bool text) {
+  static const char *words[] = {"transfer", "page",   "ack",     "server",
+                                "client",   "socket", "buffer",  "window",
+                                "burst",    "hash",   "timeout", "retry"};
+  FILE *file = fopen(path, "w");
+  if (file == NULL) {
+    perror("fopen");
+    exit(EXIT_FAILURE);
+  }
+
+  uint64_t state = 0x9e3779b97f4a7c15ULL ^ size;
+  char block[4096];
+  size_t written = 0;
+  while (written < size) {
+    size_t len = 0;
+    while (len < sizeof(block)) {
+      state ^= state << 13;
+      state ^= state >> 7;
+      state ^= state << 17;
+      if (!text) {
+        size_t n = sizeof(block) - len < 8 ? sizeof(block) - len : 8;
+        memcpy(block + len, &state, n);
+        len += n;
+        continue;
+      }
+      const char *word = words[state % 12];
+      size_t n = strlen(word);
+      if (len + n + 1 > sizeof(block)) {
+        memset(block + len, '\n', sizeof(block) - len);
+        len = sizeof(block);
+        break;
+      }
+      memcpy(block + len, word, n);
+      block[len + n] = (state >> 32) % 11 == 0 ? '\n' : ' ';
+      len += n + 1;
+    }
+    if (len > size - written) {
+      len = size - written;
+    }
+    fwrite(block, len, 1, file);
+    written += len;
+  }
+  fclose(file);
+}
+
+/*
+ * Runs @param argv in @param dir with its output sent to @param log
+ */
+static pid_t spawn(char *const argv[], const char *dir, const char *log) {
+  pid_t pid = fork();
+  if (pid == -1) {
+    perror("fork");
+    exit(EXIT_FAILURE);
+  }
+  if (pid == 0) {
+    int fd = open(log, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd != -1) {
+      dup2(fd, STDOUT_FILENO);
+      dup2(fd, STDERR_FILENO);
+      close(fd);
+    }
+    if (chdir(dir) == -1) {
+      _exit(127);
+    }
+    execv(argv[0], argv);
+    _exit(127);
+  }
+  return pid;
+}
+
+/*
+ * Waits up to @param timeout_ms for @param pid, killing it afterwards.
+ * Returns the exit status, -1 if it had to be killed.
+ */
+static int wait_for(pid_t pid, int timeout_ms, struct rusage *usage) {
+  double deadline = now_ms() + timeout_ms;
+  int status;
+  while (1) {
+    pid_t done = wait4(pid, &status, WNOHANG, usage);
+    if (done == pid) {
+      return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+    }
+    if (done == -1 && errno != EINTR) {
+      return -1;
+    }
+    if (now_ms() > deadline) {
+      kill(pid, SIGKILL);
+      wait4(pid, &status, 0, usage);
+      return -1;
+    }
+    usleep(1000);
+  }
+}
+
+/*
+ * The servers save what they receive in their working directory;
+ * a run only counts if the copy matches the payload
+ */
+static bool same_file(const char *a, const char *b) {
+  FILE *fa = fopen(a, "r"), *fb = fopen(b, "r");
+  bool same = fa != NULL && fb != NULL;
+  char ba[65536], bb[65536];
+  while (same) {
+    size_t na = fread(ba, 1, sizeof(ba), fa);
+    size_t nb = fread(bb, 1, sizeof(bb), fb);
+    if (na != nb || memcmp(ba, bb, na) != 0) {
+      same = false;
+    }
+    if (na == 0) {
+      break;
+    }
+  }
+  if (fa != NULL) {
+    fclose(fa);
+  }
+  if (fb != NULL) {
+    fclose(fb);
+  }
+  return same;
+}
+
+static int compare_double(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+// nearest rank percentile of sorted values
+static double percentile(const double *sorted, int n, double p) {
+  if (n == 0) {
+    return 0;
+  }
+  int rank = (int)ceil(p / 100.0 * n);
+  return sorted[rank > 0 ? rank - 1 : 0];
+}
+
+static pid_t start_server(struct protocol *proto, int port,
+                          const char *server_dir, const char *log) {
+  char port_str[16];
+  snprintf(port_str, sizeof(port_str), "%d", port);
+  char *argv[] = {(char *)proto->server, port_str, NULL};
+  pid_t pid = spawn(argv, server_dir, log);
+  usleep(SERVER_START_USEC);
+  return pid;
+}
+
+/*
+ * The relay runs on the benchmark port and forwards to the server one above
+ */
+static pid_t start_relay(struct protocol *proto, int port, const char *log) {
+  char listen_port[16], server_port[16];
+  snprintf(listen_port, sizeof(listen_port), "%d", port);
+  snprintf(server_port, sizeof(server_port), "%d", port + 1);
+
+  char *argv[MAX_ARGS + 5];
+  int argc = 0;
+  argv[argc++] = (char *)proto->relay;
+  for (int i = 0; i < proto->nrelay; i++) {
+    argv[argc++] = proto->relay_args[i];
+  }
+  argv[argc++] = listen_port;
+  argv[argc++] = "127.0.0.1";
+  argv[argc++] = server_port;
+  argv[argc] = NULL;
+
+  unlink(log);
+  pid_t pid = spawn(argv, scratch, log);
+  usleep(SERVER_START_USEC / 4);
+  return pid;
+}
+
+/*
+ * Stops the relay and returns the bytes the client sent through it
+ */
+static unsigned long stop_relay(pid_t relay, const char *log) {
+  struct rusage usage;
+  kill(relay, SIGTERM);
+  wait_for(relay, SERVER_EXIT_MSEC, &usage);
+
+  unsigned long in_bytes = 0;
+  char line[512];
+  FILE *file = fopen(log, "r");
+  while (file != NULL && fgets(line, sizeof(line), file) != NULL) {
+    if (sscanf(line, "relay up in_packets=%*u in_bytes=%lu", &in_bytes) == 1) {
+      break;
+    }
+  }
+  if (file != NULL) {
+    fclose(file);
+  }
+  return in_bytes;
+}
+
+static struct result run_benchmark(struct protocol *proto, size_t size,
+                                   struct options *opts) {
+  struct result result = {proto->name, size, 0, 0, 0, 0, 0, 0, 0, "none", NAN};
+  char payload_dir[64], server_dir[64], payload[128], saved[128];
+  char server_log[128], client_log[128], relay_log[128], name[32];
+  char port_str[16];
+
+  snprintf(payload_dir, sizeof(payload_dir), "%s/payload", scratch);
+  snprintf(server_dir, sizeof(server_dir), "%s/%s", scratch, proto->name);
+  snprintf(name, sizeof(name), "p%zu.bin", size);
+  snprintf(payload, sizeof(payload), "%s/%s", payload_dir, name);
+  snprintf(saved, sizeof(saved), "%s/%s", server_dir, name);
+  snprintf(server_log, sizeof(server_log), "%s/%s_server.log", scratch,
+           proto->name);
+  snprintf(client_log, sizeof(client_log), "%s/%s_client.log", scratch,
+           proto->name);
+  snprintf(relay_log, sizeof(relay_log), "%s/relay.log", scratch);
+  snprintf(port_str, sizeof(port_str), "%d", opts->port);
+  mkdir(server_dir, 0755);
+
+  // with a relay in the way the server moves one port up
+  int server_port = opts->port;
+  if (proto->relay != NULL) {
+    server_port++;
+    result.impairment = opts->relay_args;
+  }
+  double wire_bytes = 0;
+
+  char *argv[MAX_ARGS + 5];
+  int argc = 0;
+  argv[argc++] = (char *)proto->client;
+  for (int i = 0; i < proto->nextra; i++) {
+    argv[argc++] = proto->extra_args[i];
+  }
+  argv[argc++] = "127.0.0.1";
+  argv[argc++] = port_str;
+  argv[argc++] = name;
+  argv[argc] = NULL;
+
+  double *times = malloc(opts->runs * sizeof(double));
+  double total_ms = 0, cpu_sec = 0;
+  struct rusage usage;
+  pid_t server = -1;
+
+  for (int run = 0; run < opts->runs; run++) {
+    if (server == -1) {
+      server = start_server(proto, server_port, server_dir, server_log);
+    }
+    pid_t relay = -1;
+    if (proto->relay != NULL) {
+      relay = start_relay(proto, opts->port, relay_log);
+    }
+    unlink(saved);
+
+    double start = now_ms();
+    pid_t client = spawn(argv, payload_dir, client_log);
+    int status = wait_for(client, CLIENT_TIMEOUT_SEC * 1000, &usage);
+    double elapsed = now_ms() - start;
+    cpu_sec += rusage_sec(&usage);
+
+    if (proto->one_shot) {
+      if (wait_for(server, SERVER_EXIT_MSEC, &usage) == -1) {
+        status = -1;
+      }
+      cpu_sec += rusage_sec(&usage);
+      server = -1;
+    } else {
+      // the TCP server saves after answering the client
+      for (int i = 0; i < 100 && !same_file(payload, saved); i++) {
+        usleep(10000);
+      }
+    }
+
+    if (relay != -1) {
+      wire_bytes += stop_relay(relay, relay_log);
+    }
+
+    if (status != 0 || !same_file(payload, saved)) {
+      result.failures++;
+      fprintf(stderr, "%s %zu bytes: run %d failed, see %s\n", proto->name,
+              size, run, scratch);
+      continue;
+    }
+    times[result.runs++] = elapsed;
+    total_ms += elapsed;
+  }
+
+  if (server != -1) {
+    kill(server, SIGTERM);
+    wait_for(server, SERVER_EXIT_MSEC, &usage);
+    cpu_sec += rusage_sec(&usage);
+  }
+  unlink(saved);
+
+  qsort(times, result.runs, sizeof(double), compare_double);
+  result.p50_ms = percentile(times, result.runs, 50);
+  result.p99_ms = percentile(times, result.runs, 99);
+  if (result.runs > 0) {
+    result.mean_ms = total_ms / result.runs;
+    result.throughput_mbps =
+        (double)size * result.runs * 8 / (total_ms / 1000) / 1e6;
+  }
+  // failed runs burnt CPU too, charge it to the bytes that made it
+  double gigabytes = (double)size * result.runs / 1e9;
+  result.cpu_sec_per_gb = gigabytes > 0 ? cpu_sec / gigabytes : 0;
+  if (proto->relay != NULL && size > 0) {
+    result.wire_overhead_pct =
+        (wire_bytes / ((double)size * opts->runs) - 1) * 100;
+  }
+
+  free(times);
+  return result;
+}
+
+static void write_reports(struct result *results, int n, const char *prefix) {
+  char path[512];
+  snprintf(path, sizeof(path), "%s.csv", prefix);
+  FILE *csv = fopen(path, "w");
+  snprintf(path, sizeof(path), "%s.json", prefix);
+  FILE *json = fopen(path, "w");
+  if (csv == NULL || json == NULL) {
+    perror("fopen");
+    exit(EXIT_FAILURE);
+  }
+
+  fprintf(csv, "protocol,impairment,size_bytes,runs,failures,p50_ms,p99_ms,"
+               "mean_ms,throughput_mbps,cpu_sec_per_gb,wire_overhead_pct\n");
+  fprintf(json, "[\n");
+  for (int i = 0; i < n; i++) {
+    struct result *r = &results[i];
+    // unknown overhead is an empty CSV field and a JSON null
+    char overhead[32] = "";
+    if (!isnan(r->wire_overhead_pct)) {
+      snprintf(overhead, sizeof(overhead), "%.2f", r->wire_overhead_pct);
+    }
+    fprintf(csv, "%s,\"%s\",%zu,%d,%d,%.3f,%.3f,%.3f,%.2f,%.3f,%s\n",
+            r->protocol, r->impairment, r->size, r->runs, r->failures,
+            r->p50_ms, r->p99_ms, r->mean_ms, r->throughput_mbps,
+            r->cpu_sec_per_gb, overhead);
+    fprintf(json,
+            "  {\"protocol\": \"%s\", \"impairment\": \"%s\", "
+            "\"size_bytes\": %zu, \"runs\": %d, \"failures\": %d, "
+            "\"p50_ms\": %.3f, \"p99_ms\": %.3f, \"mean_ms\": %.3f, "
+            "\"throughput_mbps\": %.2f, \"cpu_sec_per_gb\": %.3f, "
+            "\"wire_overhead_pct\": %s}%s\n",
+            r->protocol, r->impairment, r->size, r->runs, r->failures,
+            r->p50_ms, r->p99_ms, r->mean_ms, r->throughput_mbps,
+            r->cpu_sec_per_gb, overhead[0] ? overhead : "null",
+            i + 1 < n ? "," : "");
+  }
+  fprintf(json, "]\n");
+  fclose(csv);
+  fclose(json);
+}
+
+static char *binary_path(const char *repo, const char *relative) {
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s/%s", repo, relative);
+  char *resolved = realpath(path, NULL);
+  if (resolved == NULL || access(resolved, X_OK) == -1) {
+    fprintf(stderr, "Missing %s, build it first\n", path);
+    exit(EXIT_FAILURE);
+  }
+  return resolved;
+}
+
+int main(int argc, char *argv[]) {
+  char default_sizes[] = "64K,1M,8M";
+  struct options opts = {.runs = 10,
+                         .port = 5300,
+                         .protocols = "tcp,udp",
+                         .output = "bench_results",
+                         .bin_dir = ".."};
+  parse_sizes(&opts, default_sizes);
+
+  int opt;
+  while ((opt = getopt(argc, argv, "s:n:p:o:g:P:t:u:r:b:")) != -1) {
+    switch (opt) {
+    case 's':
+      parse_sizes(&opts, optarg);
+      break;
+    case 'n':
+      opts.runs = atoi(optarg);
+      break;
+    case 'p':
+      opts.protocols = optarg;
+      break;
+    case 'o':
+      opts.output = optarg;
+      break;
+    case 'g':
+      opts.text = strcmp(optarg, "text") == 0;
+      break;
+    case 'P':
+      opts.port = atoi(optarg);
+      break;
+    case 't':
+      opts.tcp_args = optarg;
+      break;
+    case 'u':
+      opts.udp_args = optarg;
+      break;
+    case 'r':
+      opts.relay_args = optarg;
+      break;
+    case 'b':
+      opts.bin_dir = optarg;
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  if (opts.runs < 1 || opts.nsizes == 0) {
+    usage(argv[0]);
+  }
+
+  struct protocol protocols[] = {
+      {"tcp", "TCP/bin/tcpclient", "TCP/bin/tcpserver", false, {NULL}, 0, NULL,
+       {NULL}, 0},
+      {"udp", "UDP/bin/udpclient", "UDP/bin/udpserver", true, {NULL}, 0, NULL,
+       {NULL}, 0},
+  };
+  protocols[0].nextra = split_args(protocols[0].extra_args, opts.tcp_args);
+  protocols[1].nextra = split_args(protocols[1].extra_args, opts.udp_args);
+
+  // an empty -r (as the Makefile passes by default) means a direct path
+  protocols[1].nrelay = split_args(protocols[1].relay_args, opts.relay_args);
+  if (protocols[1].nrelay > 0) {
+    protocols[1].relay = "UDP/bin/udprelay";
+  }
+
+  // only the protocols being run need to be built
+  for (size_t p = 0; p < sizeof(protocols) / sizeof(protocols[0]); p++) {
+    if (strstr(opts.protocols, protocols[p].name) == NULL) {
+      continue;
+    }
+    protocols[p].client = binary_path(opts.bin_dir, protocols[p].client);
+    protocols[p].server = binary_path(opts.bin_dir, protocols[p].server);
+    if (protocols[p].relay != NULL) {
+      protocols[p].relay = binary_path(opts.bin_dir, protocols[p].relay);
+    }
+  }
+
+  if (mkdtemp(scratch) == NULL) {
+    perror("mkdtemp");
+    return EXIT_FAILURE;
+  }
+  char payload_dir[64];
+  snprintf(payload_dir, sizeof(payload_dir), "%s/payload", scratch);
+  mkdir(payload_dir, 0755);
+
+  for (int i = 0; i < opts.nsizes; i++) {
+    char path[128];
+    snprintf(path, sizeof(path), "%s/p%zu.bin", payload_dir, opts.sizes[i]);
+    generate_payload(path, opts.sizes[i], opts.text);
+  }
+
+  struct result results[2 * MAX_SIZES];
+  int nresults = 0;
+  for (size_t p = 0; p < sizeof(protocols) / sizeof(protocols[0]); p++) {
+    if (strstr(opts.protocols, protocols[p].name) == NULL) {
+      continue;
+    }
+    for (int i = 0; i < opts.nsizes; i++) {
+      if (!protocols[p].one_shot && opts.sizes[i] > TCP_MAX_SIZE) {
+        fprintf(stderr, "tcp: skipping %zu bytes, the server takes at most %d\n",
+                opts.sizes[i], TCP_MAX_SIZE);
+        continue;
+      }
+      struct result r = run_benchmark(&protocols[p], opts.sizes[i], &opts);
+      printf("%-4s %10zu bytes  p50 %9.3f ms  p99 %9.3f ms  %8.2f Mbit/s  "
+             "%7.3f CPU s/GB  %d/%d ok",
+             r.protocol, r.size, r.p50_ms, r.p99_ms, r.throughput_mbps,
+             r.cpu_sec_per_gb, r.runs, r.runs + r.failures);
+      if (!isnan(r.wire_overhead_pct)) {
+        printf("  %+.1f%% on the wire", r.wire_overhead_pct);
+      }
+      printf("\n");
+      results[nresults++] = r;
+    }
+  }
+
+  write_reports(results, nresults, opts.output);
+  printf("Results in %s.csv and %s.json, logs in %s\n", opts.output,
+         opts.output, scratch);
+  return 0;
+}